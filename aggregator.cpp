@@ -0,0 +1,116 @@
+#include "aggregator.h"
+
+#define MS_PER_HOUR 3600000.0
+
+Aggregator aggregator;
+
+Aggregator::Aggregator()
+  : window_ms_(600000), next_seq_(1), have_power_(false), last_power_mW_(0),
+    last_power_ms_(0), total_energy_mWh_(0) {
+  open(0);
+}
+
+void Aggregator::begin(uint32_t window_ms, unsigned long now) {
+  window_ms_ = window_ms;
+  open(now);
+}
+
+void Aggregator::setWindow(uint32_t window_ms, unsigned long now) {
+  if (window_ms == window_ms_) {
+    return;
+  }
+  bool empty = current_.energy_mWh == 0;
+  for (uint8_t i = 0; i < AGG_CHANNEL_COUNT; i++) {
+    empty = empty && current_.channels[i].count == 0;
+  }
+  if (!empty) {
+    close(now);
+  }
+  window_ms_ = window_ms;
+  open(now);
+}
+
+uint32_t Aggregator::windowMs() const {
+  return window_ms_;
+}
+
+void Aggregator::addSample(uint8_t channel, float value, unsigned long now) {
+  if (channel >= AGG_CHANNEL_COUNT || isnan(value)) {
+    return;
+  }
+  service(now);
+  ChannelStats &stats = current_.channels[channel];
+  if (stats.count == 0 || value < stats.min) {
+    stats.min = value;
+  }
+  if (stats.count == 0 || value > stats.max) {
+    stats.max = value;
+  }
+  stats.sum += value;
+  stats.count++;
+}
+
+void Aggregator::addPower(float power_mW, unsigned long now, unsigned long max_gap_ms) {
+  service(now);
+  if (have_power_ && now - last_power_ms_ <= max_gap_ms) {
+    double energy = (last_power_mW_ + power_mW) * 0.5 * (now - last_power_ms_) / MS_PER_HOUR;
+    current_.energy_mWh += energy;
+    total_energy_mWh_ += energy;
+  }
+  have_power_ = true;
+  last_power_mW_ = power_mW;
+  last_power_ms_ = now;
+  addSample(AGG_POWER, power_mW, now);
+}
+
+void Aggregator::breakPower() {
+  have_power_ = false;
+}
+
+void Aggregator::service(unsigned long now) {
+  if (now - current_.start_ms < window_ms_) {
+    return;
+  }
+  unsigned long end = current_.start_ms + window_ms_;
+  close(end);
+  open(now - end >= window_ms_ ? now : end);
+}
+
+const AggWindow &Aggregator::current() const {
+  return current_;
+}
+
+uint32_t Aggregator::nextSeq() const {
+  return next_seq_;
+}
+
+uint32_t Aggregator::oldestSeq() const {
+  return next_seq_ > AGG_HISTORY ? next_seq_ - AGG_HISTORY : 1;
+}
+
+const AggWindow *Aggregator::closed(uint32_t seq) const {
+  if (seq < oldestSeq() || seq >= next_seq_) {
+    return NULL;
+  }
+  return &history_[seq % AGG_HISTORY];
+}
+
+double Aggregator::totalEnergy_mWh() const {
+  return total_energy_mWh_;
+}
+
+float Aggregator::mean(const ChannelStats &stats) {
+  return stats.count ? (float)(stats.sum / stats.count) : NAN;
+}
+
+void Aggregator::open(unsigned long start) {
+  memset(&current_, 0, sizeof(current_));
+  current_.seq = next_seq_;
+  current_.start_ms = start;
+}
+
+void Aggregator::close(unsigned long end) {
+  current_.duration_ms = end - current_.start_ms;
+  history_[next_seq_ % AGG_HISTORY] = current_;
+  next_seq_++;
+}
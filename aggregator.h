@@ -0,0 +1,69 @@
+#ifndef AGGREGATOR_H
+#define AGGREGATOR_H
+
+#include <Arduino.h>
+
+#define AGG_VOLTAGE 0
+#define AGG_CURRENT 1
+#define AGG_POWER 2
+#define AGG_OUTDOOR 3
+#define AGG_INDOOR 4
+#define AGG_CHANNEL_COUNT 5
+#define AGG_HISTORY 16
+
+struct ChannelStats {
+  float min;
+  float max;
+  double sum;
+  uint32_t count;
+};
+
+struct AggWindow {
+  uint32_t seq;
+  uint32_t start_ms;
+  uint32_t duration_ms;
+  double energy_mWh;
+  ChannelStats channels[AGG_CHANNEL_COUNT];
+};
+
+// Running min/max/mean/count per channel over fixed windows, plus
+// trapezoidal energy from successive power samples. Only the open window
+// and a short ring of closed ones are kept.
+class Aggregator {
+public:
+  Aggregator();
+
+  void begin(uint32_t window_ms, unsigned long now);
+  void setWindow(uint32_t window_ms, unsigned long now);
+  uint32_t windowMs() const;
+
+  void addSample(uint8_t channel, float value, unsigned long now);
+  void addPower(float power_mW, unsigned long now, unsigned long max_gap_ms);
+  void breakPower();
+  void service(unsigned long now);
+
+  const AggWindow &current() const;
+  uint32_t nextSeq() const;
+  uint32_t oldestSeq() const;
+  const AggWindow *closed(uint32_t seq) const;
+  double totalEnergy_mWh() const;
+
+  static float mean(const ChannelStats &stats);
+
+private:
+  void open(unsigned long start);
+  void close(unsigned long end);
+
+  uint32_t window_ms_;
+  AggWindow current_;
+  AggWindow history_[AGG_HISTORY];
+  uint32_t next_seq_;
+  bool have_power_;
+  float last_power_mW_;
+  unsigned long last_power_ms_;
+  double total_energy_mWh_;
+};
+
+extern Aggregator aggregator;
+
+#endif
@@ -10,6 +10,13 @@ from datetime import datetime, timedelta
 import atexit
 import os
 import logging
+import math
+import struct
+import itertools
+import queue
+import functools
+import re
+import contextlib
 
 # Configure logging
 logging.basicConfig(level=logging.WARNING, format='%(asctime)s - %(levelname)s - %(message)s')
@@ -19,376 +26,1186 @@ app = Flask(__name__)
 
 # --- Configuration Constants ---
 BAUD_RATE = 115200
+LINK_BAUD_RATE = BAUD_RATE  # switch the link to this rate (up to 921600) after connecting
 DATA_TIMEOUT = 5
 DB_FILE = 'sensor_data.db'
+DB_BATCH_SIZE = 200  # queued readings that trigger an immediate batched insert
+DB_FLUSH_INTERVAL = 10  # seconds between batched inserts of queued readings
+DB_POOL_SIZE = 4  # SQLite connections shared by all threads; more readers wait for a free one
+RAW_RETENTION_DAYS = 2  # days of raw readings kept; older day partitions are dropped
+ROLLUP_RETENTION_DAYS = {'1m': 14, '15m': 365, '1h': None}  # None keeps a rollup forever
+HISTORY_MAX_POINTS = 500  # history queries use the finest resolution that stays under this many rows
+STORE_STREAM_SAMPLES = False  # also store every periodic stream sample, not just the scheduled or reported ones
+SERIAL_PROTOCOL = 'text'  # 'text' (JSON lines) or 'binary' (COBS frames)
+UART_WAKE_DELAY = 0.0  # seconds to wait after a wake-up newline when the ESP32 uses light sleep
+REPORT_BY_EXCEPTION = False  # store only the samples the ESP32 reports on change or heartbeat instead of polling
+CACHE_STREAM_PERIOD_MS = 1000  # the ESP32 pushes every channel this often to keep the latest-value cache fresh; 0 disables
+CACHE_STALE_AFTER = 5  # seconds after which a cached value is refreshed with a serial request
+RECONNECT_DELAY = 2  # seconds between attempts to reopen the serial port
+READ_TIMEOUT = 0.2  # seconds the reader thread blocks on the port before checking it again
+SERIAL_PORTS = None  # ports to manage, e.g. ['/dev/ttyACM0', '/dev/ttyACM1']; None scans for USB and ACM devices
+NODE_SCAN_INTERVAL = 10  # seconds between scans for newly plugged-in boards
+NODE_NAMES = {}  # device id (from the hello handshake) -> name used in /n/<node> routes
+DEFAULT_NODE = None  # node served by the routes without /n/<node>; None picks the first connected board
+LEGACY_NODE = 'legacy'  # node id given to rows stored before readings were tagged by node
+
+# --- Binary Frame Types ---
+FRAME_TEMP = 0x01
+FRAME_SOLAR = 0x02
+FRAME_RELAY = 0x03
+FRAME_SETTINGS = 0x04
+FRAME_SAMPLE = 0x05
+FRAME_DUMP_BEGIN = 0x06
+FRAME_DUMP_END = 0x07
+FRAME_STREAM = 0x08
+FRAME_AGG = 0x09
+FRAME_LOG = 0x0A
+FRAME_TEMPS = 0x0B
+FRAME_ALL = 0x0C
+FRAME_REPORT = 0x0D
+FRAME_TEXT = 0x7F
+FRAME_TAGGED = 0x80
+TEMP_DISCONNECTED_C = -127.0
+SETTING_TOKEN = re.compile(r'[A-Za-z0-9_.]+')  # keys and values forwarded to the ESP32 command line
+DAY_MS = 24 * 3600 * 1000
+SERIES = {'temperature': ('indoor_temp_C', 'outdoor_temp_C'), 'solar': ('voltage_V', 'current_mA', 'power_mW')}
+ROLLUPS = {'1m': 60 * 1000, '15m': 15 * 60 * 1000, '1h': 3600 * 1000}
+RELAY_FILTERS = {0: 'none', 1: 'ema', 2: 'median'}
+INA219_ADC_MODES = {0x0: '9bit', 0x1: '10bit', 0x2: '11bit', 0x3: '12bit', 0x9: 'avg2', 0xA: 'avg4',
+                    0xB: 'avg8', 0xC: 'avg16', 0xD: 'avg32', 0xE: 'avg64', 0xF: 'avg128'}
 
 # --- Global Variables and Locks ---
-serial_lock = threading.Lock()
-ser = None
-
-# --- Serial Port Management ---
-
-def find_serial_port():
-    ports = serial.tools.list_ports.comports()
-    for port in ports:
-        if "USB" in port.device or "ACM" in port.device:
-            logging.info(f"Found potential serial port: {port.device}")
-            return port.device
-    logging.warning("No suitable serial port found.")
+nodes = {}  # serial port -> Node
+nodes_lock = threading.Lock()
+CACHED_FIELDS = ('o_temp', 'i_temp', 'voltage_V', 'current_mA', 'power_mW', 'relay', 'mode')
+db_pool = queue.LifoQueue()  # idle SQLite connections, opened on demand up to DB_POOL_SIZE
+db_pool_slots = threading.BoundedSemaphore(DB_POOL_SIZE)
+db_lock = threading.Lock()  # serializes writes
+pending_rows = {series: [] for series in SERIES}  # readings queued for the next batched insert
+pending_lock = threading.Lock()
+
+# --- Binary Protocol Decoding ---
+
+def crc16_ccitt(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+def cobs_decode(data):
+    output = bytearray()
+    index = 0
+    while index < len(data):
+        code = data[index]
+        if code == 0 or index + code > len(data) + 1:
+            raise ValueError("Invalid COBS block")
+        output += data[index + 1:index + code]
+        index += code
+        if code < 0xFF and index < len(data):
+            output.append(0)
+    return bytes(output)
+
+def temp_value(value):
+    return "error" if value == TEMP_DISCONNECTED_C else round(value, 2)
+
+def solar_value(value):
+    return "error" if math.isnan(value) else round(value, 2)
+
+def stat_value(value):
+    return None if math.isnan(value) else round(value, 2)
+
+def decode_frame(raw):
+    try:
+        packet = cobs_decode(raw)
+    except ValueError:
+        logging.warning(f"Could not decode COBS frame: {raw.hex()}")
+        return None
+    if len(packet) < 5 or crc16_ccitt(packet[:-2]) != struct.unpack('<H', packet[-2:])[0]:
+        logging.warning(f"Dropping frame with bad length or CRC: {packet.hex()}")
+        return None
+    frame_type = packet[0]
+    payload = packet[3:-2]
+    request_id = None
+    if frame_type & FRAME_TAGGED:
+        if len(payload) < 2:
+            logging.warning(f"Dropping tagged frame without a request id: {packet.hex()}")
+            return None
+        (request_id,) = struct.unpack_from('<H', payload)
+        payload = payload[2:]
+        frame_type &= ~FRAME_TAGGED
+    reply = decode_payload(frame_type, payload)
+    if reply is not None and request_id is not None:
+        reply["id"] = request_id
+    if reply is not None and frame_type == FRAME_STREAM:
+        reply["event"] = "stream"
+    if reply is not None and frame_type == FRAME_REPORT:
+        reply["event"] = "report"
+    return reply
+
+def tagged_text(text):
+    """Turns a '#<id> text' line into a reply so the request waiting on it sees it."""
+    request_id, _, message = text[1:].partition(' ')
+    if request_id.isdigit():
+        return {"id": int(request_id), "text": message}
     return None
 
-def connect_to_serial():
-    global ser
-    if ser and ser.is_open:
-        return True
-    
-    serial_port = find_serial_port()
-    if not serial_port:
-        return False
-    
+def decode_payload(frame_type, payload):
     try:
-        ser = serial.Serial(serial_port, BAUD_RATE, timeout=DATA_TIMEOUT)
-        time.sleep(2)
-        ser.flushInput()
-        logging.info(f"Serial port {serial_port} opened successfully.")
-        return True
-    except serial.SerialException as e:
-        logging.error(f"Error opening serial port {serial_port}: {e}")
-        ser = None
-        return False
-
-def close_serial_port():
-    global ser
-    if ser and ser.is_open:
-        logging.info("Closing serial port...")
-        ser.close()
-        ser = None
+        if frame_type == FRAME_TEMP:
+            channels, outdoor, indoor, age_ms, o_res, i_res, conversion_ms = struct.unpack('<BffIBBH', payload)
+            age = None if age_ms == 0xFFFFFFFF else age_ms
+            if channels == 0x01:
+                return {"sensor": "o_temp", "value": temp_value(outdoor), "res": o_res, "age_ms": age, "conversion_ms": conversion_ms}
+            if channels == 0x02:
+                return {"sensor": "i_temp", "value": temp_value(indoor), "res": i_res, "age_ms": age, "conversion_ms": conversion_ms}
+            return {"o_temp": temp_value(outdoor), "i_temp": temp_value(indoor), "o_res": o_res, "i_res": i_res,
+                    "age_ms": age, "conversion_ms": conversion_ms}
+        if frame_type == FRAME_SOLAR:
+            voltage, current, power, age_ms, conversion_us = struct.unpack('<fffII', payload)
+            if math.isnan(voltage):
+                return {"sensor": "solar_pwr", "status": "error"}
+            return {"sensor": "solar_pwr", "voltage_V": round(voltage, 2), "current_mA": round(current, 2), "power_mW": round(power, 2),
+                    "age_ms": age_ms, "conversion_us": conversion_us}
+        if frame_type == FRAME_RELAY:
+            return {"sensor": "relay", "value": "ON" if payload[0] else "OFF",
+                    "mode": "auto" if payload[1] else "manual"}
+        if frame_type == FRAME_SETTINGS:
+            (mode, power_on, power_off, v_cutoff, v_high, on_delay, temp_period, sample_period, control_period,
+             bus_adc, shunt_adc, conversion_us, agg_window, log_period, temp_resolution,
+             temp_budget, off_delay, v_emergency, relay_filter,
+             filter_depth) = struct.unpack('<BffffIIIIBBIIIBIIfBB', payload)
+            return {"relay_settings": {
+                "mode": "auto" if mode else "manual",
+                "power_on_threshold_mW": round(power_on, 2),
+                "power_off_threshold_mW": round(power_off, 2),
+                "voltage_low_cutoff_V": round(v_cutoff, 2),
+                "voltage_high_on_threshold_V": round(v_high, 2),
+                "voltage_emergency_cutoff_V": round(v_emergency, 2),
+                "on_delay_ms": on_delay,
+                "off_delay_ms": off_delay,
+                "relay_filter": RELAY_FILTERS.get(relay_filter, relay_filter),
+                "filter_depth": filter_depth,
+                "temp_period_ms": temp_period,
+                "sample_period_ms": sample_period,
+                "control_period_ms": control_period,
+                "ina_bus_adc": INA219_ADC_MODES.get(bus_adc, bus_adc),
+                "ina_shunt_adc": INA219_ADC_MODES.get(shunt_adc, shunt_adc),
+                "ina_conversion_us": conversion_us,
+                "agg_window_ms": agg_window,
+                "log_period_ms": log_period,
+                "temp_resolution": temp_resolution or "auto",
+                "temp_budget_ms": temp_budget
+            }}
+        if frame_type == FRAME_SAMPLE:
+            seq, ts_ms, outdoor, indoor, voltage, current, power = struct.unpack('<IIfffff', payload)
+            return {"seq": seq, "ts_ms": ts_ms, "o_temp": temp_value(outdoor), "i_temp": temp_value(indoor),
+                    "voltage_V": solar_value(voltage), "current_mA": solar_value(current), "power_mW": solar_value(power)}
+        if frame_type == FRAME_DUMP_BEGIN:
+            first_seq, count, now_ms = struct.unpack('<III', payload)
+            return {"dump": "begin", "first_seq": first_seq, "count": count, "now_ms": now_ms}
+        if frame_type == FRAME_DUMP_END:
+            (last_seq,) = struct.unpack('<I', payload)
+            return {"dump": "end", "last_seq": last_seq}
+        if frame_type == FRAME_STREAM:
+            seq, ts_ms, channels = struct.unpack_from('<IIB', payload)
+            offset = 9
+            reply = {"stream": seq, "ts_ms": ts_ms}
+            if channels & 0x01:
+                (reply["o_temp"],) = struct.unpack_from('<f', payload, offset)
+                reply["o_temp"] = temp_value(reply["o_temp"])
+                offset += 4
+            if channels & 0x02:
+                (reply["i_temp"],) = struct.unpack_from('<f', payload, offset)
+                reply["i_temp"] = temp_value(reply["i_temp"])
+                offset += 4
+            if channels & 0x04:
+                voltage, current, power = struct.unpack_from('<fff', payload, offset)
+                reply.update({"voltage_V": solar_value(voltage), "current_mA": solar_value(current), "power_mW": solar_value(power)})
+                offset += 12
+            if channels & 0x08:
+                reply["relay"] = "ON" if payload[offset] else "OFF"
+            return reply
+        if frame_type == FRAME_AGG:
+            seq, start_ms, duration_ms, energy = struct.unpack_from('<IIIf', payload)
+            reply = {"window": seq, "start_ms": start_ms, "duration_ms": duration_ms, "energy_mWh": round(energy, 2)}
+            for i, name in enumerate(("voltage_V", "current_mA", "power_mW", "o_temp", "i_temp")):
+                low, high, mean, count = struct.unpack_from('<fffI', payload, 16 + 16 * i)
+                reply[name] = {"min": stat_value(low), "max": stat_value(high), "mean": stat_value(mean), "count": count}
+            return reply
+        if frame_type == FRAME_LOG:
+            ts, session, flags, outdoor, indoor, voltage, current, power = struct.unpack('<IHBfffff', payload)
+            return {"log": ts, "synced": bool(flags & 0x80), "session": session,
+                    "o_temp": temp_value(outdoor), "i_temp": temp_value(indoor),
+                    "voltage_V": solar_value(voltage), "current_mA": solar_value(current), "power_mW": solar_value(power),
+                    "relay": "ON" if flags & 0x08 else "OFF"}
+        if frame_type == FRAME_TEMPS:
+            reply = {}
+            resolutions = {}
+            offset = 1
+            for _ in range(payload[0]):
+                length = payload[offset]
+                label = payload[offset + 1:offset + 1 + length].decode('utf-8')
+                temp, resolutions[label] = struct.unpack_from('<fB', payload, offset + 1 + length)
+                reply[label] = temp_value(temp)
+                offset += 6 + length
+            age_ms, conversion_ms = struct.unpack_from('<IH', payload, offset)
+            reply["res"] = resolutions
+            reply["age_ms"] = None if age_ms == 0xFFFFFFFF else age_ms
+            reply["conversion_ms"] = conversion_ms
+            return reply
+        if frame_type == FRAME_ALL:
+            (ts_ms, outdoor, indoor, temp_age, voltage, current, power, solar_age, relay, mode,
+             power_on, power_off, v_cutoff, v_high, on_delay, off_delay,
+             v_emergency) = struct.unpack('<IffIfffIBBffffIIf', payload)
+            reply = {"ts_ms": ts_ms, "o_temp": temp_value(outdoor), "i_temp": temp_value(indoor),
+                     "voltage_V": solar_value(voltage), "current_mA": solar_value(current),
+                     "power_mW": solar_value(power), "relay": "ON" if relay else "OFF",
+                     "mode": "auto" if mode else "manual",
+                     "power_on_threshold_mW": round(power_on, 2), "power_off_threshold_mW": round(power_off, 2),
+                     "voltage_low_cutoff_V": round(v_cutoff, 2), "voltage_high_on_threshold_V": round(v_high, 2),
+                     "on_delay_ms": on_delay, "off_delay_ms": off_delay,
+                     "voltage_emergency_cutoff_V": round(v_emergency, 2)}
+            if temp_age != 0xFFFFFFFF:
+                reply["temp_age_ms"] = temp_age
+            if solar_age != 0xFFFFFFFF:
+                reply["solar_age_ms"] = solar_age
+            return reply
+        if frame_type == FRAME_REPORT:
+            seq, ts_ms, changed, outdoor, indoor, voltage, current, power = struct.unpack('<IIBfffff', payload)
+            return {"report": seq, "ts_ms": ts_ms, "changed": changed, "o_temp": temp_value(outdoor),
+                    "i_temp": temp_value(indoor), "voltage_V": solar_value(voltage),
+                    "current_mA": solar_value(current), "power_mW": solar_value(power)}
+        if frame_type == FRAME_TEXT:
+            text = payload.decode('utf-8')
+            if text.startswith('{') and text.endswith('}'):
+                return json.loads(text)
+            if text.startswith('#'):
+                return tagged_text(text)
+            logging.info(f"Ignoring non-JSON text frame: {text}")
+            return None
+    except (struct.error, IndexError, UnicodeDecodeError, json.JSONDecodeError) as e:
+        logging.warning(f"Malformed payload for frame type {frame_type:#04x}: {e}")
+        return None
+    logging.warning(f"Ignoring unknown frame type {frame_type:#04x}")
+    return None
 
 # --- Data Fetching and Processing ---
 
-def fetch_from_serial(command):
-    global ser
-    with serial_lock:
-        if not ser or not ser.is_open:
-            logging.warning("Serial port not connected. Attempting to reconnect...")
-            if not connect_to_serial():
-                logging.error("Failed to reconnect to serial port.")
-                return None
+def decode_line(raw):
+    line = raw.decode('utf-8', errors='replace').strip()
+    if line and line.startswith('{') and line.endswith('}'):
+        try:
+            return json.loads(line)
+        except json.JSONDecodeError:
+            logging.warning(f"Could not parse line as JSON: {line}")
+    elif line.startswith('#'):
+        return tagged_text(line)
+    elif line:
+        logging.info(f"Ignoring non-JSON line: {line}")
+    return None
 
+def cache_entries(data):
+    """Picks out whatever channel values a reply or event carries."""
+    values = {key: data[key] for key in CACHED_FIELDS if key in data}
+    sensor = data.get('sensor')
+    if sensor in ('o_temp', 'i_temp') and 'value' in data:
+        values[sensor] = data['value']
+    elif sensor == 'relay':
+        values['relay'] = data.get('value')
+    if data.get('relay_event'):
+        values['relay'] = 'ON' if data['relay_event'] == 'auto_on' else 'OFF'
+    if data.get('mode') not in ('auto', 'manual'):
+        values.pop('mode', None)
+    if values.get('relay') not in ('ON', 'OFF'):
+        values.pop('relay', None)
+    return values
+
+# --- Nodes ---
+#
+# Each board on the bridge is a Node with its own port, reader and writer threads, request ids and
+# latest-value cache, so a slow or unplugged board never holds up the others.
+
+class Node:
+    def __init__(self, port):
+        self.port = port
+        self.device = None  # device id from the hello handshake
+        self.ser = None
+        self.rx_buffer = b''
+        self.serial_lock = threading.Lock()  # guards opening, closing and writing the port
+        self.command_queue = queue.Queue()
+        self.replies_ready = threading.Condition()
+        self.pending_replies = {}  # request id -> replies read on its behalf but not yet collected
+        self.request_ids = itertools.count(1)
+        self.latest_cache = {}  # field -> (value, time received)
+        self.cache_lock = threading.Lock()
+        self.last_backfill_ts = None
+
+    @property
+    def name(self):
+        return NODE_NAMES.get(self.device, self.device)
+
+    def is_connected(self):
+        return self.ser is not None and self.ser.is_open
+
+    # --- Serial Port Management ---
+
+    def connect(self):
+        if self.is_connected():
+            return True
         try:
-            ser.flushInput()
-            ser.write(command.encode('utf-8') + b'\n')
-            
-            start_time = time.time()
-            while time.time() - start_time < DATA_TIMEOUT:
-                line = ser.readline().decode('utf-8').strip()
-                if line and line.startswith('{') and line.endswith('}'):
-                    try:
-                        data = json.loads(line)
-                        return data
-                    except json.JSONDecodeError:
-                        logging.warning(f"Could not parse line as JSON: {line}")
-                elif line:
-                    logging.info(f"Ignoring non-JSON line: {line}")
-            
-            logging.warning(f"Timed out waiting for a valid JSON response to command: {command}")
-            return None
+            self.ser = serial.Serial(self.port, BAUD_RATE, timeout=READ_TIMEOUT)
+            time.sleep(2)
+            if LINK_BAUD_RATE != BAUD_RATE:
+                self.ser.write(f'baud {LINK_BAUD_RATE}\n'.encode('utf-8'))
+                self.ser.flush()
+                time.sleep(0.1)
+                self.ser.baudrate = LINK_BAUD_RATE
+            self.ser.write(b'proto bin\n' if SERIAL_PROTOCOL == 'binary' else b'proto text\n')
+            self.ser.write(f'time {int(time.time())}\n'.encode('utf-8'))
+            self.ser.write(b'report on\n' if REPORT_BY_EXCEPTION else b'report off\n')
+            time.sleep(0.1)
+            self.ser.flushInput()
+            self.rx_buffer = b''
+            device = self.handshake()
+            if device is None:
+                logging.warning(f"No device id handshake on {self.port}; closing it.")
+                self.close()
+                return False
+            self.device = device
+            if CACHE_STREAM_PERIOD_MS:
+                self.ser.write(f'stream {CACHE_STREAM_PERIOD_MS} all\n'.encode('utf-8'))
+            logging.info(f"Serial port {self.port} opened successfully; node {self.name}.")
+            return True
         except serial.SerialException as e:
-            logging.error(f"Serial communication error: {e}. Attempting to close and reconnect.")
-            close_serial_port()
+            logging.error(f"Error opening serial port {self.port}: {e}")
+            self.ser = None
+            return False
+
+    def handshake(self):
+        """Asks the board for its device id, reading the port directly before the reader loop takes over."""
+        self.ser.write(b'hello\n')
+        deadline = time.time() + DATA_TIMEOUT
+        while time.time() < deadline:
+            for data in self.read_messages():
+                if data.get('command') == 'hello' and 'device' in data:
+                    return data['device']
+        return None
+
+    def close(self):
+        if self.is_connected():
+            logging.info(f"Closing serial port {self.port}...")
+            self.ser.close()
+        self.ser = None
+
+    def read_messages(self):
+        """Reads what the port has and returns the complete replies; a partial one waits for the next read."""
+        self.rx_buffer += self.ser.read(self.ser.in_waiting or 1)
+        delimiter = b'\x00' if SERIAL_PROTOCOL == 'binary' else b'\n'
+        *chunks, self.rx_buffer = self.rx_buffer.split(delimiter)
+        messages = []
+        for chunk in chunks:
+            if not chunk:
+                continue
+            data = decode_frame(chunk) if SERIAL_PROTOCOL == 'binary' else decode_line(chunk)
+            if data is not None:
+                messages.append(data)
+        return messages
+
+    def write_command(self, command):
+        if UART_WAKE_DELAY > 0:
+            self.ser.write(b'\n')
+            time.sleep(UART_WAKE_DELAY)
+        self.ser.write(command.encode('utf-8') + b'\n')
+
+    # --- Latest-Value Cache ---
+
+    def cache_values(self, values):
+        received = time.time()
+        with self.cache_lock:
+            for key, value in values.items():
+                self.latest_cache[key] = (value, received)
+
+    def cached_values(self, fields):
+        """Returns the cached fields with the age of the oldest, or None if any is missing."""
+        now = time.time()
+        with self.cache_lock:
+            if not all(field in self.latest_cache for field in fields):
+                return None
+            values = {field: self.latest_cache[field][0] for field in fields}
+            age_s = now - min(self.latest_cache[field][1] for field in fields)
+        values['age_ms'] = int(age_s * 1000)
+        values['stale'] = age_s > CACHE_STALE_AFTER
+        return values
+
+    def latest_values(self, fields, command):
+        """Answers from the cache, falling back to a serial request when it has nothing fresh."""
+        values = self.cached_values(fields)
+        if values is None or values['stale']:
+            self.fetch(command)
+            values = self.cached_values(fields) or values
+        return values
+
+    # --- Serial Reader, Writer and Request Matching ---
+
+    def handle_event(self, data):
+        if data.get('event') == 'relay':
+            logging.info(f"Relay event on {self.name}: {data}")
+        elif data.get('event') == 'report':
+            store_report(self.device, data)
+        elif data.get('event') == 'stream' and STORE_STREAM_SAMPLES:
+            store_stream_sample(self.device, data)
+
+    def route_response(self, data):
+        """Files a reply under its request id; events and untagged lines never block a request."""
+        values = cache_entries(data)
+        if values:
+            self.cache_values(values)
+        if 'event' in data:
+            self.handle_event(data)
+            return
+        request_id = data.pop('id', None)
+        with self.replies_ready:
+            if request_id not in self.pending_replies:
+                logging.info(f"Ignoring reply with no waiting request on {self.port}: {data}")
+                return
+            self.pending_replies[request_id].append(data)
+            self.replies_ready.notify_all()
+
+    def reader_loop(self):
+        """Owns the port: reconnects when it drops and routes everything it reads."""
+        while True:
+            if not self.is_connected():
+                with self.serial_lock:
+                    connected = self.connect()
+                if not connected:
+                    time.sleep(RECONNECT_DELAY)
+                    continue
+            try:
+                for data in self.read_messages():
+                    self.route_response(data)
+            except serial.SerialException as e:
+                logging.error(f"Serial communication error on {self.port}: {e}. Attempting to close and reconnect.")
+                with self.serial_lock:
+                    self.close()
+            except Exception as e:
+                logging.error(f"An unexpected error occurred while reading {self.port}: {e}")
+
+    def writer_loop(self):
+        while True:
+            command = self.command_queue.get()
+            try:
+                with self.serial_lock:
+                    if self.is_connected():
+                        self.write_command(command)
+                    else:
+                        logging.warning(f"Serial port {self.port} not connected; dropping command: {command}")
+            except serial.SerialException as e:
+                logging.error(f"Serial write to {self.port} failed for '{command}': {e}")
+
+    def start(self):
+        threading.Thread(target=self.reader_loop, name=f'serial-reader {self.port}', daemon=True).start()
+        threading.Thread(target=self.writer_loop, name=f'serial-writer {self.port}', daemon=True).start()
+
+    def send_request(self, command):
+        """Queues a command tagged with a fresh request id, so several can be in flight at once."""
+        request_id = next(self.request_ids) % 0x10000
+        with self.replies_ready:
+            self.pending_replies[request_id] = []
+        self.command_queue.put(f'#{request_id} {command}')
+        return request_id
+
+    def finish_request(self, request_id):
+        with self.replies_ready:
+            self.pending_replies.pop(request_id, None)
+
+    def next_reply(self, request_id, timeout):
+        """Waits for the reader thread to file the next reply to a request."""
+        deadline = time.time() + timeout
+        with self.replies_ready:
+            while not self.pending_replies.get(request_id):
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    return None
+                self.replies_ready.wait(remaining)
+            return self.pending_replies[request_id].pop(0)
+
+    def fetch(self, command):
+        if not self.is_connected():
+            logging.warning(f"Serial port {self.port} not connected; cannot send '{command}'.")
+            return None
+        request_id = self.send_request(command)
+        try:
+            data = self.next_reply(request_id, DATA_TIMEOUT)
+            if data is None:
+                logging.warning(f"Timed out waiting for a valid JSON response from {self.name} to command: {command}")
+            return data
+        finally:
+            self.finish_request(request_id)
+
+    def fetch_records(self, command, marker):
+        """Collects the records a bulk command sends between its begin and end markers."""
+        if not self.is_connected():
+            logging.warning(f"Serial port {self.port} not connected; cannot send '{command}'.")
             return None
-        except Exception as e:
-            logging.error(f"An unexpected error occurred during serial communication: {e}")
+        request_id = self.send_request(command)
+        try:
+            records = []
+            started = False
+            while True:
+                data = self.next_reply(request_id, DATA_TIMEOUT)
+                if data is None:
+                    break
+                if data.get(marker) == 'begin':
+                    started = True
+                elif data.get(marker) == 'end':
+                    return records
+                elif started:
+                    records.append(data)
+            logging.warning(f"Timed out waiting for the end of '{command}' from {self.name} after {len(records)} records")
             return None
+        finally:
+            self.finish_request(request_id)
+
+# --- Node Discovery ---
+
+def find_serial_ports():
+    if SERIAL_PORTS:
+        return list(SERIAL_PORTS)
+    ports = [port.device for port in serial.tools.list_ports.comports()
+             if "USB" in port.device or "ACM" in port.device]
+    if not ports:
+        logging.warning("No suitable serial port found.")
+    return ports
+
+def discover_nodes():
+    """Starts a node for every serial port that does not have one yet."""
+    for port in find_serial_ports():
+        with nodes_lock:
+            if port in nodes:
+                continue
+            node = nodes[port] = Node(port)
+        logging.info(f"Found potential serial port: {port}")
+        node.start()
+
+def node_discovery_loop():
+    while True:
+        discover_nodes()
+        time.sleep(NODE_SCAN_INTERVAL)
+
+def start_serial_threads():
+    threading.Thread(target=node_discovery_loop, name='node-discovery', daemon=True).start()
+
+def close_serial_ports():
+    with nodes_lock:
+        for node in nodes.values():
+            node.close()
+
+def connected_nodes():
+    with nodes_lock:
+        return sorted((node for node in nodes.values() if node.is_connected() and node.device),
+                      key=lambda node: node.port)
+
+def lookup_node(name):
+    """Finds a connected node by alias or device id; no name means DEFAULT_NODE or the first board."""
+    name = name or DEFAULT_NODE
+    candidates = connected_nodes()
+    if name is None:
+        return candidates[0] if candidates else None
+    return next((node for node in candidates if name in (node.name, node.device)), None)
+
+def node_device(name):
+    """Maps a route's node name to the device id its rows are stored under, connected or not."""
+    name = name or DEFAULT_NODE
+    if name is None:
+        node = lookup_node(None)
+        return node.device if node else None
+    return next((device for device, alias in NODE_NAMES.items() if alias == name), name)
+
+def for_each_node(job):
+    """Runs a job for every connected node in parallel, so a slow board does not delay the rest."""
+    threads = [threading.Thread(target=job, args=(node,), name=f'{job.__name__} {node.port}')
+               for node in connected_nodes()]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
 
 # --- Database Management ---
+#
+# Raw readings live in one table per UTC day (e.g. temperature_readings_20480) keyed by node and integer
+# epoch milliseconds, so pruning drops whole tables. Each insert batch also updates 1-minute, 15-minute and
+# hourly rollup tables, which serve the history endpoints.
 
-def get_db_connection():
-    conn = sqlite3.connect(os.path.join(os.path.dirname(__file__), DB_FILE))
+def open_db_connection():
+    conn = sqlite3.connect(os.path.join(os.path.dirname(__file__), DB_FILE), check_same_thread=False)
     conn.row_factory = sqlite3.Row
+    conn.execute('PRAGMA journal_mode=WAL')
+    conn.execute('PRAGMA synchronous=NORMAL')
     return conn
 
+@contextlib.contextmanager
+def db_connection():
+    """Lends a pooled connection for the block; WAL lets readers run alongside the writer."""
+    with db_pool_slots:
+        try:
+            conn = db_pool.get_nowait()
+        except queue.Empty:
+            conn = open_db_connection()
+        try:
+            yield conn
+        finally:
+            db_pool.put(conn)
+
+def partition_table(series, day):
+    return f'{series}_readings_{day}'
+
+def partition_days(conn, series):
+    rows = conn.execute("SELECT name FROM sqlite_master WHERE type = 'table' AND name GLOB ?",
+                        (f'{series}_readings_[0-9]*',)).fetchall()
+    return sorted(int(row['name'].rsplit('_', 1)[1]) for row in rows)
+
+def ensure_partition(conn, series, day):
+    table = partition_table(series, day)
+    columns = ', '.join(f'{field} REAL' for field in SERIES[series])
+    conn.execute(f'CREATE TABLE IF NOT EXISTS {table} (node TEXT NOT NULL, ts_ms INTEGER NOT NULL, {columns}, '
+                 f'PRIMARY KEY (node, ts_ms)) WITHOUT ROWID')
+    return table
+
+def rollup_table(series, resolution):
+    return f'{series}_rollup_{resolution}'
+
+def ensure_rollup(conn, series, resolution):
+    table = rollup_table(series, resolution)
+    columns = ', '.join(f'{f}_n INTEGER, {f}_sum REAL, {f}_min REAL, {f}_max REAL' for f in SERIES[series])
+    conn.execute(f'CREATE TABLE IF NOT EXISTS {table} (node TEXT NOT NULL, bucket_ms INTEGER NOT NULL, {columns}, '
+                 f'PRIMARY KEY (node, bucket_ms)) WITHOUT ROWID')
+    return table
+
+def rollup_upsert_sql(series, resolution):
+    fields = SERIES[series]
+    columns = ', '.join(f'{f}_n, {f}_sum, {f}_min, {f}_max' for f in fields)
+    placeholders = ', '.join('?' * (2 + 4 * len(fields)))
+    updates = ', '.join(
+        f'{f}_n = {f}_n + excluded.{f}_n, {f}_sum = {f}_sum + excluded.{f}_sum, '
+        f'{f}_min = COALESCE(MIN({f}_min, excluded.{f}_min), {f}_min, excluded.{f}_min), '
+        f'{f}_max = COALESCE(MAX({f}_max, excluded.{f}_max), {f}_max, excluded.{f}_max)'
+        for f in fields)
+    return (f'INSERT INTO {rollup_table(series, resolution)} (node, bucket_ms, {columns}) VALUES ({placeholders}) '
+            f'ON CONFLICT(node, bucket_ms) DO UPDATE SET {updates}')
+
+def reading_value(value):
+    return None if value is None or isinstance(value, str) else float(value)
+
+def update_rollups(conn, series, rows):
+    field_count = len(SERIES[series])
+    for resolution, width_ms in ROLLUPS.items():
+        buckets = {}
+        for row in rows:
+            key = (row[0], row[1] // width_ms * width_ms)
+            acc = buckets.setdefault(key, [[0, 0.0, None, None] for _ in range(field_count)])
+            for stats, value in zip(acc, row[2:]):
+                if value is None:
+                    continue
+                stats[0] += 1
+                stats[1] += value
+                stats[2] = value if stats[2] is None else min(stats[2], value)
+                stats[3] = value if stats[3] is None else max(stats[3], value)
+        conn.executemany(rollup_upsert_sql(series, resolution),
+                         [(*key, *[v for stats in acc for v in stats]) for key, acc in buckets.items()])
+
+def write_rows(conn, series, rows):
+    """Inserts (node, ts_ms, *values) rows into their day partitions, skipping ones already stored, and rolls up the new ones."""
+    by_day = {}
+    for row in rows:
+        by_day.setdefault(row[1] // DAY_MS, {}).setdefault(row[:2], row)
+    placeholders = ', '.join('?' * (2 + len(SERIES[series])))
+    inserted = []
+    for day, day_rows in by_day.items():
+        table = ensure_partition(conn, series, day)
+        timestamps = [key[1] for key in day_rows]
+        existing = {tuple(r) for r in conn.execute(f'SELECT node, ts_ms FROM {table} WHERE ts_ms BETWEEN ? AND ?',
+                                                   (min(timestamps), max(timestamps)))}
+        fresh = [row for key, row in day_rows.items() if key not in existing]
+        conn.executemany(f'INSERT INTO {table} VALUES ({placeholders})', fresh)
+        inserted.extend(fresh)
+    update_rollups(conn, series, inserted)
+    return len(inserted)
+
+def record_reading(series, node, ts_ms, *values):
+    """Queues one reading of a node for the next batched insert."""
+    with pending_lock:
+        pending_rows[series].append((node, ts_ms, *[reading_value(v) for v in values]))
+        full = len(pending_rows[series]) >= DB_BATCH_SIZE
+    if full:
+        flush_readings()
+
+def flush_readings():
+    with pending_lock:
+        batches = {series: rows for series, rows in pending_rows.items() if rows}
+        for series in batches:
+            pending_rows[series] = []
+    if not batches:
+        return
+    try:
+        with db_lock, db_connection() as conn:
+            with conn:
+                for series, rows in batches.items():
+                    write_rows(conn, series, rows)
+    except sqlite3.Error as e:
+        logging.error(f"Error storing {sum(len(rows) for rows in batches.values())} readings to SQLite: {e}")
+
+def latest_timestamp_ms(series, node):
+    with db_connection() as conn:
+        for day in reversed(partition_days(conn, series)):
+            row = conn.execute(f'SELECT MAX(ts_ms) FROM {partition_table(series, day)} WHERE node = ?', (node,)).fetchone()
+            if row[0] is not None:
+                return row[0]
+        return None
+
+def migrate_legacy_table(conn, series):
+    """Moves rows from the old ISO-timestamp table into day partitions."""
+    legacy = f'{series}_readings'
+    if not conn.execute("SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?", (legacy,)).fetchone():
+        return
+    fields = SERIES[series]
+    rows = [(LEGACY_NODE, int(datetime.fromisoformat(row['timestamp']).timestamp() * 1000),
+             *[reading_value(row[f]) for f in fields])
+            for row in conn.execute(f'SELECT timestamp, {", ".join(fields)} FROM {legacy}')]
+    moved = write_rows(conn, series, rows)
+    conn.execute(f'DROP TABLE {legacy}')
+    logging.info(f"Migrated {moved} rows from {legacy} into day partitions.")
+
+def add_node_column(conn, table, create):
+    """Rebuilds a table from before readings were tagged by node, filing its rows under LEGACY_NODE."""
+    columns = [row['name'] for row in conn.execute(f'PRAGMA table_info({table})')]
+    if not columns or 'node' in columns:
+        return
+    conn.execute(f'ALTER TABLE {table} RENAME TO legacy_{table}')
+    create()
+    conn.execute(f'INSERT INTO {table} (node, {", ".join(columns)}) SELECT ?, {", ".join(columns)} FROM legacy_{table}',
+                 (LEGACY_NODE,))
+    conn.execute(f'DROP TABLE legacy_{table}')
+
 def setup_database():
-    conn = get_db_connection()
-    cursor = conn.cursor()
-    cursor.execute('''
-        CREATE TABLE IF NOT EXISTS temperature_readings (
-            timestamp TEXT PRIMARY KEY,
-            indoor_temp_C REAL,
-            outdoor_temp_C REAL
-        )
-    ''')
-    cursor.execute('''
-        CREATE TABLE IF NOT EXISTS solar_readings (
-            timestamp TEXT PRIMARY KEY,
-            voltage_V REAL,
-            current_mA REAL,
-            power_mW REAL
-        )
-    ''')
-    conn.commit()
-    conn.close()
+    with db_lock, db_connection() as conn:
+        with conn:
+            for series in SERIES:
+                for resolution in ROLLUPS:
+                    add_node_column(conn, rollup_table(series, resolution), lambda: ensure_rollup(conn, series, resolution))
+                    ensure_rollup(conn, series, resolution)
+                for day in partition_days(conn, series):
+                    add_node_column(conn, partition_table(series, day), lambda: ensure_partition(conn, series, day))
+                migrate_legacy_table(conn, series)
+
+def now_ms():
+    return int(time.time() * 1000)
+
+def iso_from_ms(ts_ms):
+    return datetime.fromtimestamp(ts_ms / 1000).isoformat()
+
+def raw_partitions(conn, series, start_ms, end_ms):
+    return [partition_table(series, day) for day in partition_days(conn, series)
+            if start_ms // DAY_MS <= day <= end_ms // DAY_MS]
+
+def pick_resolution(conn, series, node, start_ms, end_ms):
+    """Raw rows while they fit in HISTORY_MAX_POINTS, else the finest rollup that does."""
+    count = sum(conn.execute(f'SELECT COUNT(*) FROM {table} WHERE node = ? AND ts_ms >= ?',
+                             (node, start_ms)).fetchone()[0]
+                for table in raw_partitions(conn, series, start_ms, end_ms))
+    if count <= HISTORY_MAX_POINTS:
+        return 'raw'
+    for resolution, width_ms in ROLLUPS.items():
+        if (end_ms - start_ms) // width_ms <= HISTORY_MAX_POINTS:
+            return resolution
+    return list(ROLLUPS)[-1]
+
+def query_history(series, fields, hours, node, resolution=None):
+    """Returns a node's readings of the last few hours, from the raw partitions or a rollup table."""
+    end_ms = now_ms()
+    start_ms = end_ms - hours * 3600 * 1000
+    with db_connection() as conn:
+        resolution = resolution or pick_resolution(conn, series, node, start_ms, end_ms)
+        if resolution == 'raw':
+            rows = []
+            for table in raw_partitions(conn, series, start_ms, end_ms):
+                rows.extend(conn.execute(f'SELECT ts_ms, {", ".join(fields)} FROM {table} '
+                                         f'WHERE node = ? AND ts_ms >= ? ORDER BY ts_ms', (node, start_ms)))
+            return [{"timestamp": iso_from_ms(row['ts_ms']), "ts_ms": row['ts_ms'], **{f: row[f] for f in fields}}
+                    for row in rows]
+        width_ms = ROLLUPS[resolution]
+        columns = ', '.join(f'{f}_n, {f}_sum, {f}_min, {f}_max' for f in fields)
+        rows = conn.execute(f'SELECT bucket_ms, {columns} FROM {rollup_table(series, resolution)} '
+                            f'WHERE node = ? AND bucket_ms >= ? ORDER BY bucket_ms', (node, start_ms // width_ms * width_ms))
+        history = []
+        for row in rows:
+            entry = {"timestamp": iso_from_ms(row['bucket_ms']), "ts_ms": row['bucket_ms']}
+            for f in fields:
+                n = row[f'{f}_n']
+                entry[f] = round(row[f'{f}_sum'] / n, 2) if n else None
+                entry[f'{f}_min'] = row[f'{f}_min']
+                entry[f'{f}_max'] = row[f'{f}_max']
+            history.append(entry)
+        return history
+
+def history_response(series, fields, hours, node=None):
+    resolution = request.args.get('resolution')
+    if resolution is not None and resolution != 'raw' and resolution not in ROLLUPS:
+        return jsonify({"error": f"Unknown resolution '{resolution}'"}), 400
+    device = node_device(node)
+    if device is None:
+        return jsonify({"error": "No node connected"}), 404
+    try:
+        return jsonify(query_history(series, fields, hours, device, resolution))
+    except sqlite3.Error as e:
+        logging.error(f"Error querying {series} history: {e}")
+        return jsonify({"error": "Failed to query history"}), 500
 
 # --- Scheduled Jobs (using APScheduler) ---
 
+def store_temperature_data(node):
+    data = node.latest_values(('i_temp', 'o_temp'), 't')
+    if data and not data['stale']:
+        record_reading('temperature', node.device, now_ms(), data['i_temp'], data['o_temp'])
+    else:
+        logging.warning(f"Failed to fetch temperature data from {node.name} for storage.")
+
 def store_temperature_data_job():
     logging.info("Running scheduled job to store temperature data...")
-    data = fetch_from_serial('t')
-    if data and 'i_temp' in data and 'o_temp' in data:
-        record = {
-            'timestamp': datetime.now().isoformat(),
-            'indoor_temp_C': data['i_temp'],
-            'outdoor_temp_C': data['o_temp']
-        }
-        try:
-            conn = get_db_connection()
-            cursor = conn.cursor()
-            cursor.execute('''
-                INSERT OR REPLACE INTO temperature_readings (timestamp, indoor_temp_C, outdoor_temp_C)
-                VALUES (?, ?, ?)
-            ''', (record['timestamp'], record['indoor_temp_C'], record['outdoor_temp_C']))
-            conn.commit()
-            conn.close()
-            logging.info("Temperature data stored successfully.")
-        except sqlite3.Error as e:
-            logging.error(f"Error storing data to SQLite: {e}")
+    for_each_node(store_temperature_data)
+
+def store_solar_data(node):
+    s_data = node.latest_values(('voltage_V', 'current_mA', 'power_mW'), 's')
+    if s_data and not s_data['stale'] and s_data['voltage_V'] != 'error':
+        record_reading('solar', node.device, now_ms(), s_data['voltage_V'], s_data['current_mA'], s_data['power_mW'])
     else:
-        logging.warning("Failed to fetch temperature data for storage.")
+        logging.warning(f"Failed to fetch solar data from {node.name} for storage.")
 
 def store_solar_data_job():
     logging.info("Running scheduled job to store solar data...")
-    s_data = fetch_from_serial('s')
-    if s_data and 'voltage_V' in s_data and 'current_mA' in s_data and 'power_mW' in s_data:
-        record = {
-            'timestamp': datetime.now().isoformat(),
-            'voltage_V': s_data['voltage_V'],
-            'current_mA': s_data['current_mA'],
-            'power_mW': s_data['power_mW']
-        }
-        try:
-            conn = get_db_connection()
-            cursor = conn.cursor()
-            cursor.execute('''
-                INSERT OR REPLACE INTO solar_readings (timestamp, voltage_V, current_mA, power_mW)
-                VALUES (?, ?, ?, ?)
-            ''', (record['timestamp'], record['voltage_V'], record['current_mA'], record['power_mW']))
-            conn.commit()
-            conn.close()
-            logging.info("Solar data stored successfully.")
-        except sqlite3.Error as e:
-            logging.error(f"Error storing solar data to SQLite: {e}")
-    else:
-        logging.warning("Failed to fetch solar data for storage.")
+    for_each_node(store_solar_data)
+
+def store_report(device, data):
+    """Stores the channels a report-by-exception sample says have changed."""
+    ts_ms = now_ms()
+    if data['changed'] & 0x03:
+        record_reading('temperature', device, ts_ms, data['i_temp'], data['o_temp'])
+    if data['changed'] & 0x04 and data['voltage_V'] != 'error':
+        record_reading('solar', device, ts_ms, data['voltage_V'], data['current_mA'], data['power_mW'])
+
+def store_stream_sample(device, data):
+    ts_ms = now_ms()
+    if 'o_temp' in data and 'i_temp' in data:
+        record_reading('temperature', device, ts_ms, data['i_temp'], data['o_temp'])
+    if 'voltage_V' in data and data['voltage_V'] != 'error':
+        record_reading('solar', device, ts_ms, data['voltage_V'], data['current_mA'], data['power_mW'])
+
+def backfill_node(node):
+    try:
+        if node.last_backfill_ts is None:
+            latest_ms = latest_timestamp_ms('temperature', node.device)
+            node.last_backfill_ts = latest_ms // 1000 + 1 if latest_ms is not None else 0
+        records = node.fetch_records(f'backfill {node.last_backfill_ts}', 'backfill')
+        if records is None:
+            logging.warning(f"Failed to backfill from the flash log of {node.name}.")
+            return
+        temperature_rows = []
+        solar_rows = []
+        for record in records:
+            if not record.get('synced'):
+                continue
+            ts_ms = record['log'] * 1000
+            temperature_rows.append((node.device, ts_ms, reading_value(record['i_temp']), reading_value(record['o_temp'])))
+            if record['voltage_V'] != 'error':
+                solar_rows.append((node.device, ts_ms, record['voltage_V'], record['current_mA'], record['power_mW']))
+            node.last_backfill_ts = max(node.last_backfill_ts, record['log'] + 1)
+        with db_lock, db_connection() as conn:
+            with conn:
+                stored = write_rows(conn, 'temperature', temperature_rows)
+                write_rows(conn, 'solar', solar_rows)
+        logging.info(f"Backfilled {stored} of {len(records)} flash log records from {node.name}.")
+    except sqlite3.Error as e:
+        logging.error(f"Error storing backfilled data from {node.name} to SQLite: {e}")
+
+def backfill_job():
+    logging.info("Running scheduled job to backfill from the ESP32 flash logs...")
+    for_each_node(backfill_node)
 
 def prune_old_data_job():
+    """Drops raw day partitions and deletes rollup buckets that are past their retention."""
     logging.info("Running scheduled job to prune old data...")
-    cutoff_time = datetime.now() - timedelta(days=2)
-    cutoff_iso = cutoff_time.isoformat()
+    today = now_ms() // DAY_MS
     try:
-        conn = get_db_connection()
-        cursor = conn.cursor()
-        cursor.execute('DELETE FROM temperature_readings WHERE timestamp < ?', (cutoff_iso,))
-        deleted_temp_count = cursor.rowcount
-        cursor.execute('DELETE FROM solar_readings WHERE timestamp < ?', (cutoff_iso,))
-        deleted_solar_count = cursor.rowcount
-        conn.commit()
-        conn.close()
-        logging.info(f"Successfully pruned {deleted_temp_count} old temperature records and {deleted_solar_count} old solar records.")
+        with db_lock, db_connection() as conn:
+            with conn:
+                dropped = 0
+                for series in SERIES:
+                    for day in partition_days(conn, series):
+                        if day < today - RAW_RETENTION_DAYS:
+                            conn.execute(f'DROP TABLE {partition_table(series, day)}')
+                            dropped += 1
+                    for resolution, days in ROLLUP_RETENTION_DAYS.items():
+                        if days is not None:
+                            conn.execute(f'DELETE FROM {rollup_table(series, resolution)} WHERE bucket_ms < ?',
+                                         ((today - days) * DAY_MS,))
+        logging.info(f"Successfully dropped {dropped} old day partitions.")
     except sqlite3.Error as e:
         logging.error(f"Error pruning old data: {e}")
 
 # --- Flask API Endpoints ---
-@app.route('/r/on', methods=['POST'])
-def turn_relay_on():
-    data = fetch_from_serial('r1')
+#
+# Every endpoint serves the default node at its plain path and any board at /n/<node>/...
+
+def node_route(rule, **options):
+    """Registers a view at its plain path and under /n/<node>, and hands it the connected node."""
+    def register(view):
+        @functools.wraps(view)
+        def with_node(node=None):
+            target = lookup_node(node)
+            if target is None:
+                return jsonify({"error": f"Node '{node}' is not connected" if node else "No node connected"}), 404
+            return view(target)
+        app.route(rule, **options)(with_node)
+        app.route(f'/n/<node>{rule}', endpoint=f'{view.__name__}_node', **options)(with_node)
+        return with_node
+    return register
+
+def history_route(rule):
+    """Like node_route, but passes the node name through so history is served for offline boards too."""
+    def register(view):
+        app.route(rule)(view)
+        app.route(f'/n/<node>{rule}', endpoint=f'{view.__name__}_node')(view)
+        return view
+    return register
+
+@app.route('/nodes')
+def get_nodes():
+    with nodes_lock:
+        known = list(nodes.values())
+    return jsonify([{"name": node.name, "device": node.device, "port": node.port, "connected": node.is_connected()}
+                    for node in sorted(known, key=lambda node: node.port)])
+
+@node_route('/r/on', methods=['POST'])
+def turn_relay_on(node):
+    data = node.fetch('r1')
     if data and data.get('value') == 'ON':
         return jsonify({"status": "success", "message": "Relay turned ON"})
     return jsonify({"status": "error", "message": "Failed to turn relay ON"}), 500
 
-@app.route('/r/off', methods=['POST'])
-def turn_relay_off():
-    data = fetch_from_serial('r0')
+@node_route('/r/off', methods=['POST'])
+def turn_relay_off(node):
+    data = node.fetch('r0')
     if data and data.get('value') == 'OFF':
         return jsonify({"status": "success", "message": "Relay turned OFF"})
     return jsonify({"status": "error", "message": "Failed to turn relay OFF"}), 500
 
-@app.route('/r/latest')
-def get_r_status():
-    data = fetch_from_serial('r')
-    if data and 'value' in data:
-        return jsonify({"relay_status": data['value']})
+@node_route('/r/latest')
+def get_r_status(node):
+    data = node.latest_values(('relay',), 'r')
+    if data:
+        return jsonify({"relay_status": data['relay'], "age_ms": data['age_ms'], "stale": data['stale']})
     return jsonify({"error": "Failed to fetch data"}), 500
 
-@app.route('/o/latest')
-def get_o_temp():
-    data = fetch_from_serial('o')
-    if data and 'value' in data:
-        return jsonify({"outdoor": data['value']})
+@node_route('/o/latest')
+def get_o_temp(node):
+    data = node.latest_values(('o_temp',), 'o')
+    if data:
+        return jsonify({"outdoor": data['o_temp'], "age_ms": data['age_ms'], "stale": data['stale']})
     return jsonify({"error": "Failed to fetch data"}), 500
 
-@app.route('/i/latest')
-def get_i_temp():
-    data = fetch_from_serial('i')
-    if data and 'value' in data:
-        return jsonify({"indoor": data['value']})
+@node_route('/i/latest')
+def get_i_temp(node):
+    data = node.latest_values(('i_temp',), 'i')
+    if data:
+        return jsonify({"indoor": data['i_temp'], "age_ms": data['age_ms'], "stale": data['stale']})
     return jsonify({"error": "Failed to fetch data"}), 500
 
-@app.route('/s/latest')
-def get_s_pwr():
-    data = fetch_from_serial('s')
+@node_route('/s/latest')
+def get_s_pwr(node):
+    data = node.latest_values(('voltage_V', 'current_mA', 'power_mW'), 's')
     if data:
-        solar_value = {
-            "voltage_V": data.get("voltage_V", "N/A"),
-            "current_mA": data.get("current_mA", "N/A"),
-            "power_mW": data.get("power_mW", "N/A")
-        }
-        return jsonify(solar_value)
+        return jsonify(data)
     return jsonify({"error": "Failed to fetch data"}), 500
 
-@app.route('/t/latest')
-def get_t_latest():
-    data = fetch_from_serial('t')
-    if data and 'i_temp' in data and 'o_temp' in data:
+@node_route('/t/latest')
+def get_t_latest(node):
+    data = node.latest_values(('i_temp', 'o_temp'), 't')
+    if data:
         return jsonify({
             "indoor_temp_C": data['i_temp'],
-            "outdoor_temp_C": data['o_temp']
+            "outdoor_temp_C": data['o_temp'],
+            "age_ms": data['age_ms'],
+            "stale": data['stale']
         })
     return jsonify({"error": "Failed to fetch one or more temperature readings"}), 500
 
-@app.route('/o/24')
-def get_o_24h():
-    conn = get_db_connection()
-    cursor = conn.cursor()
-    time_24h_ago = datetime.now() - timedelta(hours=24)
-    cursor.execute('SELECT timestamp, outdoor_temp_C FROM temperature_readings WHERE timestamp >= ?', (time_24h_ago.isoformat(),))
-    rows = cursor.fetchall()
-    conn.close()
-    return jsonify([dict(row) for row in rows])
-
-@app.route('/o/48')
-def get_o_48h():
-    conn = get_db_connection()
-    cursor = conn.cursor()
-    time_48h_ago = datetime.now() - timedelta(hours=48)
-    cursor.execute('SELECT timestamp, outdoor_temp_C FROM temperature_readings WHERE timestamp >= ?', (time_48h_ago.isoformat(),))
-    rows = cursor.fetchall()
-    conn.close()
-    return jsonify([dict(row) for row in rows])
-
-@app.route('/i/24')
-def get_i_24h():
-    conn = get_db_connection()
-    cursor = conn.cursor()
-    time_24h_ago = datetime.now() - timedelta(hours=24)
-    cursor.execute('SELECT timestamp, indoor_temp_C FROM temperature_readings WHERE timestamp >= ?', (time_24h_ago.isoformat(),))
-    rows = cursor.fetchall()
-    conn.close()
-    return jsonify([dict(row) for row in rows])
-
-@app.route('/i/48')
-def get_i_48h():
-    conn = get_db_connection()
-    cursor = conn.cursor()
-    time_48h_ago = datetime.now() - timedelta(hours=48)
-    cursor.execute('SELECT timestamp, indoor_temp_C FROM temperature_readings WHERE timestamp >= ?', (time_48h_ago.isoformat(),))
-    rows = cursor.fetchall()
-    conn.close()
-    return jsonify([dict(row) for row in rows])
-
-@app.route('/t/24')
-def get_t_24h():
-    conn = get_db_connection()
-    cursor = conn.cursor()
-    time_24h_ago = datetime.now() - timedelta(hours=24)
-    cursor.execute('SELECT * FROM temperature_readings WHERE timestamp >= ?', (time_24h_ago.isoformat(),))
-    rows = cursor.fetchall()
-    conn.close()
-    return jsonify([dict(row) for row in rows])
-
-@app.route('/t/48')
-def get_t_48h():
-    conn = get_db_connection()
-    cursor = conn.cursor()
-    time_48h_ago = datetime.now() - timedelta(hours=48)
-    cursor.execute('SELECT * FROM temperature_readings WHERE timestamp >= ?', (time_48h_ago.isoformat(),))
-    rows = cursor.fetchall()
-    conn.close()
-    return jsonify([dict(row) for row in rows])
-
-@app.route('/s/24')
-def get_s_24h():
-    conn = get_db_connection()
-    cursor = conn.cursor()
-    time_24h_ago = datetime.now() - timedelta(hours=24)
-    cursor.execute('SELECT * FROM solar_readings WHERE timestamp >= ?', (time_24h_ago.isoformat(),))
-    rows = cursor.fetchall()
-    conn.close()
-    return jsonify([dict(row) for row in rows])
-
-@app.route('/s/48')
-def get_s_48h():
-    conn = get_db_connection()
-    cursor = conn.cursor()
-    time_48h_ago = datetime.now() - timedelta(hours=48)
-    cursor.execute('SELECT * FROM solar_readings WHERE timestamp >= ?', (time_48h_ago.isoformat(),))
-    rows = cursor.fetchall()
-    conn.close()
-    return jsonify([dict(row) for row in rows])
-
-@app.route('/settings')
-def get_settings():
-    data = fetch_from_serial('get_settings')
+@node_route('/all/latest')
+def get_all_latest(node):
+    data = node.fetch('all')
+    if data and 'relay' in data and 'mode' in data:
+        return jsonify(data)
+    return jsonify({"error": "Failed to fetch the snapshot"}), 500
+
+@node_route('/temps/latest')
+def get_temps_latest(node):
+    data = node.fetch('temps')
+    if data and 'age_ms' in data:
+        return jsonify(data)
+    return jsonify({"error": "Failed to fetch temperature readings"}), 500
+
+@node_route('/sensors')
+def get_sensors(node):
+    data = node.fetch('sensors')
+    if data and 'sensors' in data:
+        return jsonify(data)
+    return jsonify({"error": "Failed to fetch the sensor table"}), 500
+
+@history_route('/o/24')
+def get_o_24h(node=None):
+    return history_response('temperature', ('outdoor_temp_C',), 24, node)
+
+@history_route('/o/48')
+def get_o_48h(node=None):
+    return history_response('temperature', ('outdoor_temp_C',), 48, node)
+
+@history_route('/i/24')
+def get_i_24h(node=None):
+    return history_response('temperature', ('indoor_temp_C',), 24, node)
+
+@history_route('/i/48')
+def get_i_48h(node=None):
+    return history_response('temperature', ('indoor_temp_C',), 48, node)
+
+@history_route('/t/24')
+def get_t_24h(node=None):
+    return history_response('temperature', ('indoor_temp_C', 'outdoor_temp_C'), 24, node)
+
+@history_route('/t/48')
+def get_t_48h(node=None):
+    return history_response('temperature', ('indoor_temp_C', 'outdoor_temp_C'), 48, node)
+
+@history_route('/s/24')
+def get_s_24h(node=None):
+    return history_response('solar', ('voltage_V', 'current_mA', 'power_mW'), 24, node)
+
+@history_route('/s/48')
+def get_s_48h(node=None):
+    return history_response('solar', ('voltage_V', 'current_mA', 'power_mW'), 48, node)
+
+@node_route('/settings')
+def get_settings(node):
+    data = node.fetch('get_settings')
     if data and 'relay_settings' in data:
         return jsonify(data['relay_settings'])
     return jsonify({"error": "Failed to fetch settings"}), 500
 
-@app.route('/settings/auto', methods=['POST'])
-def set_auto_mode():
-    fetch_from_serial('auto')
+@node_route('/settings/auto', methods=['POST'])
+def set_auto_mode(node):
+    node.fetch('auto')
     return jsonify({"status": "success", "message": "Automatic mode enabled"}), 200
 
-@app.route('/settings/manual', methods=['POST'])
-def set_manual_mode():
-    fetch_from_serial('manual')
+@node_route('/settings/manual', methods=['POST'])
+def set_manual_mode(node):
+    node.fetch('manual')
     return jsonify({"status": "success", "message": "Manual mode enabled"}), 200
 
-@app.route('/settings/set_power_on_mW', methods=['POST'])
-def set_power_on_threshold():
+@node_route('/settings/set_power_on_mW', methods=['POST'])
+def set_power_on_threshold(node):
     value = request.args.get('value')
     if value is None:
         return jsonify({"status": "error", "message": "Missing 'value' parameter"}), 400
-    data = fetch_from_serial(f'set_power_on_mW {value}')
+    if not SETTING_TOKEN.fullmatch(value):
+        return jsonify({"status": "error", "message": "Invalid 'value' parameter"}), 400
+    data = node.fetch(f'set_power_on_mW {value}')
+    if data and data.get('command') == 'set_power_on_mW' and data.get('status') == 'error':
+        return jsonify({"status": "error", "message": data.get('message'), "low": data.get('low'), "high": data.get('high')}), 400
     if data and data.get('command') == 'set_power_on_mW':
         return jsonify({"status": "success", "new_value": data.get('value')})
     return jsonify({"status": "error", "message": "Failed to set threshold"}), 500
 
-@app.route('/settings/set_power_off_mW', methods=['POST'])
-def set_power_off_threshold():
+@node_route('/settings/set_power_off_mW', methods=['POST'])
+def set_power_off_threshold(node):
     value = request.args.get('value')
     if value is None:
         return jsonify({"status": "error", "message": "Missing 'value' parameter"}), 400
-    data = fetch_from_serial(f'set_power_off_mW {value}')
+    if not SETTING_TOKEN.fullmatch(value):
+        return jsonify({"status": "error", "message": "Invalid 'value' parameter"}), 400
+    data = node.fetch(f'set_power_off_mW {value}')
+    if data and data.get('command') == 'set_power_off_mW' and data.get('status') == 'error':
+        return jsonify({"status": "error", "message": data.get('message'), "low": data.get('low'), "high": data.get('high')}), 400
     if data and data.get('command') == 'set_power_off_mW':
         return jsonify({"status": "success", "new_value": data.get('value')})
     return jsonify({"status": "error", "message": "Failed to set threshold"}), 500
 
-@app.route('/settings/set_voltage_cutoff_V', methods=['POST'])
-def set_voltage_cutoff():
+@node_route('/settings/set_voltage_cutoff_V', methods=['POST'])
+def set_voltage_cutoff(node):
     value = request.args.get('value')
     if value is None:
         return jsonify({"status": "error", "message": "Missing 'value' parameter"}), 400
-    data = fetch_from_serial(f'set_voltage_cutoff_V {value}')
+    if not SETTING_TOKEN.fullmatch(value):
+        return jsonify({"status": "error", "message": "Invalid 'value' parameter"}), 400
+    data = node.fetch(f'set_voltage_cutoff_V {value}')
+    if data and data.get('command') == 'set_voltage_cutoff_V' and data.get('status') == 'error':
+        return jsonify({"status": "error", "message": data.get('message'), "low": data.get('low'), "high": data.get('high')}), 400
     if data and data.get('command') == 'set_voltage_cutoff_V':
         return jsonify({"status": "success", "new_value": data.get('value')})
     return jsonify({"status": "error", "message": "Failed to set threshold"}), 500
 
+@node_route('/settings/set_voltage_high_on_V', methods=['POST'])
+def set_voltage_high_on(node):
+    value = request.args.get('value')
+    if value is None:
+        return jsonify({"status": "error", "message": "Missing 'value' parameter"}), 400
+    if not SETTING_TOKEN.fullmatch(value):
+        return jsonify({"status": "error", "message": "Invalid 'value' parameter"}), 400
+    data = node.fetch(f'set_voltage_high_on_V {value}')
+    if data and data.get('command') == 'set_voltage_high_on_V' and data.get('status') == 'error':
+        return jsonify({"status": "error", "message": data.get('message'), "low": data.get('low'), "high": data.get('high')}), 400
+    if data and data.get('command') == 'set_voltage_high_on_V':
+        return jsonify({"status": "success", "new_value": data.get('value')})
+    return jsonify({"status": "error", "message": "Failed to set threshold"}), 500
+
+@node_route('/settings/set_debounce_ms', methods=['POST'])
+def set_debounce(node):
+    value = request.args.get('value')
+    if value is None:
+        return jsonify({"status": "error", "message": "Missing 'value' parameter"}), 400
+    if not SETTING_TOKEN.fullmatch(value):
+        return jsonify({"status": "error", "message": "Invalid 'value' parameter"}), 400
+    data = node.fetch(f'set_debounce_ms {value}')
+    if data and data.get('command') == 'set_debounce_ms':
+        return jsonify({"status": "success", "new_value": data.get('value')})
+    return jsonify({"status": "error", "message": "Failed to set debounce"}), 500
+
+@node_route('/settings', methods=['POST'])
+def set_many_settings(node):
+    values = request.get_json(silent=True) or request.args.to_dict()
+    if not values:
+        return jsonify({"status": "error", "message": "No settings given"}), 400
+    if not all(SETTING_TOKEN.fullmatch(str(token)) for item in values.items() for token in item):
+        return jsonify({"status": "error", "message": "Setting keys and values may only contain letters, digits, '_' and '.'"}), 400
+    pairs = ' '.join(f'{key}={value}' for key, value in values.items())
+    data = node.fetch(f'set {pairs}')
+    if data and 'relay_settings' in data:
+        return jsonify({"status": "success", "settings": data['relay_settings']})
+    if data and data.get('status') == 'error':
+        return jsonify({"status": "error", "message": data.get('message'), "key": data.get('key'),
+                        "low": data.get('low'), "high": data.get('high')}), 400
+    return jsonify({"status": "error", "message": "Failed to apply settings"}), 500
+
 if __name__ == '__main__':
     setup_database()
-    connect_to_serial()
-    atexit.register(close_serial_port)
+    start_serial_threads()
+    atexit.register(close_serial_ports)
+    atexit.register(flush_readings)
     scheduler = BackgroundScheduler()
-    scheduler.add_job(store_temperature_data_job, 'interval', minutes=15)
-    scheduler.add_job(store_solar_data_job, 'cron', hour='7-19', minute='*/10')
+    if not REPORT_BY_EXCEPTION:
+        scheduler.add_job(store_temperature_data_job, 'interval', minutes=15)
+        scheduler.add_job(store_solar_data_job, 'cron', hour='7-19', minute='*/10')
+    scheduler.add_job(flush_readings, 'interval', seconds=DB_FLUSH_INTERVAL)
     scheduler.add_job(prune_old_data_job, 'interval', hours=24)
+    scheduler.add_job(backfill_job, 'interval', hours=1, next_run_time=datetime.now())
     scheduler.start()
     app.run(host='0.0.0.0', port=5000)
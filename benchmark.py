@@ -0,0 +1,253 @@
+"""End-to-end latency and throughput benchmark for the firmware and app.py.
+
+Drives app.py's HTTP routes with concurrent clients for every combination of serial protocol, cache mode
+(polling every request over serial, or answering from the streamed cache) and link baud rate. The target
+is a real board (--port) or esp_simulator.py. Each combination runs in its own process so app.py starts
+fresh. The report is JSON, and --compare prints the change against an earlier report, e.g. one taken
+with another firmware build.
+"""
+import argparse
+import itertools
+import json
+import math
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.error
+import urllib.request
+from datetime import datetime
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_ENDPOINTS = '/t/latest,/s/latest,/r/latest,/all/latest,/settings,/t/24'
+CONNECT_TIMEOUT = 30  # seconds to wait for app.py to find the board
+
+# --- Statistics ---
+
+def percentile(sorted_values, p):
+    """Nearest-rank percentile of an already sorted list."""
+    if not sorted_values:
+        return None
+    rank = max(0, math.ceil(p / 100 * len(sorted_values)) - 1)
+    return round(sorted_values[rank], 3)
+
+def summarize(samples, duration_s):
+    latencies = sorted(latency for latency, ok in samples if ok)
+    return {
+        "requests": len(samples),
+        "errors": sum(1 for _, ok in samples if not ok),
+        "throughput_rps": round(len(latencies) / duration_s, 2),
+        "latency_ms": {
+            "p50": percentile(latencies, 50),
+            "p95": percentile(latencies, 95),
+            "p99": percentile(latencies, 99),
+            "mean": round(sum(latencies) / len(latencies), 3) if latencies else None,
+            "max": round(latencies[-1], 3) if latencies else None
+        }
+    }
+
+# --- Load Generation ---
+
+def parse_endpoint(spec):
+    """'/t/latest' is a GET; 'POST /r/on' names the method."""
+    method, _, path = spec.strip().rpartition(' ')
+    return (method or 'GET').upper(), path
+
+def request_once(base_url, method, path):
+    start = time.perf_counter()
+    try:
+        req = urllib.request.Request(base_url + path, method=method, data=b'' if method == 'POST' else None)
+        with urllib.request.urlopen(req, timeout=30) as reply:
+            reply.read()
+            ok = reply.status == 200
+    except (urllib.error.URLError, OSError):
+        ok = False
+    return (time.perf_counter() - start) * 1000, ok
+
+def client_loop(base_url, endpoints, deadline, samples, offset):
+    """Cycles through the endpoints back to back; each client starts at a different one."""
+    for index in itertools.count(offset):
+        if time.perf_counter() >= deadline:
+            return
+        spec = endpoints[index % len(endpoints)]
+        samples[spec].append(request_once(base_url, *parse_endpoint(spec)))
+
+def generate_load(base_url, endpoints, clients, duration_s):
+    samples = {spec: [] for spec in endpoints}
+    deadline = time.perf_counter() + duration_s
+    threads = [threading.Thread(target=client_loop, args=(base_url, endpoints, deadline, samples, n))
+               for n in range(clients)]
+    started = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.perf_counter() - started
+    results = {spec: summarize(spec_samples, elapsed) for spec, spec_samples in samples.items()}
+    results["total"] = summarize([s for spec_samples in samples.values() for s in spec_samples], elapsed)
+    return results, elapsed
+
+# --- One Configuration (child process) ---
+
+def run_config(config):
+    """Starts app.py against the port with the given settings, serves it over HTTP and measures it."""
+    sys.path.insert(0, HERE)
+    import app
+    from werkzeug.serving import make_server
+
+    app.DB_FILE = os.path.join(tempfile.mkdtemp(prefix='benchmark-'), 'sensor_data.db')
+    app.SERIAL_PORTS = [config['port']]
+    app.SERIAL_PROTOCOL = config['protocol']
+    app.LINK_BAUD_RATE = config['baud']
+    if config['mode'] == 'streaming':
+        app.CACHE_STREAM_PERIOD_MS = config['stream_period_ms']
+    else:
+        app.CACHE_STREAM_PERIOD_MS = 0
+        app.CACHE_STALE_AFTER = 0
+    app.setup_database()
+    app.start_serial_threads()
+    deadline = time.time() + CONNECT_TIMEOUT
+    while app.lookup_node(None) is None:
+        if time.time() > deadline:
+            return {**config, "error": f"No board answered on {config['port']}"}
+        time.sleep(0.1)
+    hello = app.lookup_node(None).fetch('hello')
+
+    server = make_server('127.0.0.1', 0, app.app, threaded=True)
+    threading.Thread(target=server.serve_forever, name='http', daemon=True).start()
+    base_url = f'http://127.0.0.1:{server.server_port}'
+    if config['warmup_s']:
+        generate_load(base_url, config['endpoints'], config['clients'], config['warmup_s'])
+    endpoints, elapsed = generate_load(base_url, config['endpoints'], config['clients'], config['duration_s'])
+    server.shutdown()
+    return {**config, "firmware": hello, "elapsed_s": round(elapsed, 3), "endpoints": endpoints}
+
+# --- Matrix (parent process) ---
+
+def start_simulator(args):
+    simulator = subprocess.Popen([sys.executable, os.path.join(HERE, 'esp_simulator.py'),
+                                  '--latency-ms', str(args.sim_latency_ms)],
+                                 stdout=subprocess.PIPE, text=True)
+    return simulator, simulator.stdout.readline().strip()
+
+def run_isolated(config):
+    child = subprocess.run([sys.executable, os.path.abspath(__file__), '--run-config', json.dumps(config)],
+                           capture_output=True, text=True, timeout=config['duration_s'] + config['warmup_s'] + 120)
+    lines = child.stdout.strip().splitlines()
+    if child.returncode != 0 or not lines:
+        return {**config, "error": child.stderr.strip().splitlines()[-1:] or f"exit status {child.returncode}"}
+    return json.loads(lines[-1])
+
+def git_label():
+    try:
+        return subprocess.run(['git', 'describe', '--always', '--dirty'], cwd=HERE, capture_output=True,
+                              text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+def run_matrix(args):
+    runs = []
+    for protocol, mode, baud in itertools.product(args.protocols, args.modes, args.bauds):
+        simulator = None
+        port = args.port
+        if port is None:
+            simulator, port = start_simulator(args)
+        config = {"protocol": protocol, "mode": mode, "baud": baud, "port": port, "clients": args.clients,
+                  "duration_s": args.duration, "warmup_s": args.warmup, "stream_period_ms": args.stream_period_ms,
+                  "endpoints": args.endpoints}
+        try:
+            run = run_isolated(config)
+        finally:
+            if simulator:
+                simulator.terminate()
+                simulator.wait()
+        runs.append(run)
+        total = run.get("endpoints", {}).get("total")
+        if total:
+            print(f"{protocol:6} {mode:9} {baud:>7}  {total['throughput_rps']:8.1f} req/s  "
+                  f"p50 {total['latency_ms']['p50']} ms  p99 {total['latency_ms']['p99']} ms  "
+                  f"errors {total['errors']}", file=sys.stderr)
+        else:
+            print(f"{protocol:6} {mode:9} {baud:>7}  failed: {run.get('error')}", file=sys.stderr)
+    return {
+        "label": args.label or git_label(),
+        "created": datetime.now().isoformat(timespec='seconds'),
+        "target": args.port or "simulator",
+        "sim_latency_ms": None if args.port else args.sim_latency_ms,
+        "python": platform.python_version(),
+        "platform": platform.platform(),
+        "runs": runs
+    }
+
+# --- Comparison ---
+
+def change(before, after):
+    if before is None or after is None:
+        return f"{after}"
+    if before == 0:
+        return f"{before} -> {after}"
+    return f"{before} -> {after} ({(after - before) / before * 100:+.1f}%)"
+
+def compare_reports(base_path, new_path):
+    with open(base_path) as f:
+        base = json.load(f)
+    with open(new_path) as f:
+        new = json.load(f)
+    key = lambda run: (run['protocol'], run['mode'], run['baud'])
+    base_runs = {key(run): run for run in base['runs'] if 'endpoints' in run}
+    print(f"{base.get('label')} -> {new.get('label')}")
+    for run in new['runs']:
+        old = base_runs.get(key(run))
+        if old is None or 'endpoints' not in run:
+            continue
+        print(f"{run['protocol']} / {run['mode']} / {run['baud']} baud")
+        for spec, stats in run['endpoints'].items():
+            before = old['endpoints'].get(spec)
+            if before is None:
+                continue
+            print(f"  {spec:16} rps {change(before['throughput_rps'], stats['throughput_rps'])}"
+                  f"  p50 {change(before['latency_ms']['p50'], stats['latency_ms']['p50'])}"
+                  f"  p95 {change(before['latency_ms']['p95'], stats['latency_ms']['p95'])}"
+                  f"  p99 {change(before['latency_ms']['p99'], stats['latency_ms']['p99'])}")
+
+def csv_list(kind):
+    return lambda text: [kind(item) for item in text.split(',') if item]
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--port', help='serial port of a real board; without it each run starts esp_simulator.py')
+    parser.add_argument('--protocols', type=csv_list(str), default=['text', 'binary'])
+    parser.add_argument('--modes', type=csv_list(str), default=['polling', 'streaming'])
+    parser.add_argument('--bauds', type=csv_list(int), default=[115200, 921600])
+    parser.add_argument('--endpoints', type=csv_list(str), default=DEFAULT_ENDPOINTS.split(','),
+                        help="comma-separated paths; prefix with 'POST ' for control endpoints")
+    parser.add_argument('--clients', type=int, default=8, help='concurrent HTTP clients')
+    parser.add_argument('--duration', type=float, default=10, help='measured seconds per run')
+    parser.add_argument('--warmup', type=float, default=1, help='unmeasured seconds before each run')
+    parser.add_argument('--stream-period-ms', type=int, default=1000, help='cache stream period in streaming mode')
+    parser.add_argument('--sim-latency-ms', type=float, default=1.0, help='simulated firmware command handling time')
+    parser.add_argument('--label', help='name of this build in the report (default: git describe)')
+    parser.add_argument('--output', default='benchmark.json', help='where to write the JSON report')
+    parser.add_argument('--compare', nargs=2, metavar=('BASE', 'NEW'), help='compare two reports and exit')
+    parser.add_argument('--run-config', help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.run_config:
+        print(json.dumps(run_config(json.loads(args.run_config))))
+        os._exit(0)  # the serial and discovery threads never return
+    if args.compare:
+        compare_reports(*args.compare)
+        return 0
+    if not set(args.modes) <= {'polling', 'streaming'} or not set(args.protocols) <= {'text', 'binary'}:
+        parser.error("protocols are text,binary and modes are polling,streaming")
+    report = run_matrix(args)
+    with open(args.output, 'w') as f:
+        json.dump(report, f, indent=2)
+    print(f"Wrote {args.output}", file=sys.stderr)
+    return 0 if all('endpoints' in run for run in report['runs']) else 1
+
+if __name__ == '__main__':
+    sys.exit(main())
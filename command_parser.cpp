@@ -0,0 +1,134 @@
+#include "command_parser.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool splitCommandLine(char *line, char *&name, char *&args) {
+  while (*line == ' ' || *line == '\t') {
+    line++;
+  }
+  size_t length = strlen(line);
+  while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t' || line[length - 1] == '\r')) {
+    line[--length] = '\0';
+  }
+  if (length == 0) {
+    return false;
+  }
+
+  name = line;
+  args = strchr(line, ' ');
+  if (args) {
+    *args++ = '\0';
+    while (*args == ' ') {
+      args++;
+    }
+  } else {
+    args = line + length;
+  }
+  return true;
+}
+
+bool splitRequestId(char *&line, bool &has_id, uint16_t &id) {
+  has_id = false;
+  while (*line == ' ' || *line == '\t') {
+    line++;
+  }
+  if (*line != '#') {
+    return true;
+  }
+  char *end;
+  unsigned long value = strtoul(line + 1, &end, 10);
+  if (end == line + 1 || value > 0xFFFF || (*end != ' ' && *end != '\0')) {
+    return false;
+  }
+  has_id = true;
+  id = value;
+  line = end;
+  return true;
+}
+
+const Command *findCommand(const Command *table, size_t count, const char *name) {
+  for (size_t i = 0; i < count; i++) {
+    if (strcmp(name, table[i].name) == 0) {
+      return &table[i];
+    }
+  }
+  return NULL;
+}
+
+bool parseNone(const char *text, CommandArg &) {
+  return *text == '\0';
+}
+
+bool parseText(const char *text, CommandArg &arg) {
+  arg.text = text;
+  return *text != '\0';
+}
+
+bool parsePositiveFloat(const char *text, CommandArg &arg) {
+  char *end;
+  arg.f = strtof(text, &end);
+  return end != text && *end == '\0' && arg.f > 0;
+}
+
+// Whole decimal numbers only: strtoul would quietly negate a leading '-'
+// and skip spaces or a '+', so the first character must be a digit.
+bool parsePositiveUnsigned(const char *text, CommandArg &arg) {
+  if (*text < '0' || *text > '9') {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  unsigned long value = strtoul(text, &end, 10);
+  if (errno == ERANGE || *end != '\0' || value == 0) {
+    return false;
+  }
+#if ULONG_MAX > UINT32_MAX
+  if (value > UINT32_MAX) {
+    return false;
+  }
+#endif
+  arg.u = value;
+  return true;
+}
+
+bool parseOptionalUnsigned(const char *text, CommandArg &arg) {
+  char *end;
+  arg.u = strtoul(text, &end, 10);
+  return *end == '\0';
+}
+
+// Unix time from the host. It must stay exact: as a float it would be
+// rounded to a multiple of 128 s and shift every synced log timestamp.
+bool parseEpochSeconds(const char *text, CommandArg &arg) {
+  if (!parsePositiveUnsigned(text, arg)) {
+    return false;
+  }
+  uint32_t epoch_s = arg.u;
+  arg.epoch_s = epoch_s;
+  return true;
+}
+
+bool parseProtocol(const char *text, CommandArg &arg) {
+  if (strcmp(text, "bin") == 0) {
+    arg.u = 1;
+  } else if (strcmp(text, "text") == 0) {
+    arg.u = 0;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool parseOnOff(const char *text, CommandArg &arg) {
+  if (strcmp(text, "on") == 0) {
+    arg.u = 1;
+  } else if (strcmp(text, "off") == 0) {
+    arg.u = 0;
+  } else {
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,58 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMMAND_LABEL_MAX 12
+
+union CommandArg {
+  const char *text;
+  float f;
+  unsigned long u;
+  uint32_t epoch_s;
+  uint8_t codes[2];
+  struct {
+    uint32_t period_ms;
+    uint8_t channels;
+  } stream;
+  struct {
+    uint8_t index;
+    char name[COMMAND_LABEL_MAX];
+  } label;
+  struct {
+    uint8_t mac[6];
+    uint8_t channel;
+  } peer;
+};
+
+typedef bool (*ArgParser)(const char *text, CommandArg &arg);
+typedef void (*CommandHandler)(const CommandArg &arg);
+
+// Commands that change persisted state set persists, so the settings record
+// is refreshed after them; read-only commands leave it off.
+struct Command {
+  const char *name;
+  ArgParser parse;
+  CommandHandler handler;
+  bool persists;
+};
+
+// Trims a received line in place and splits it into the command name and
+// its argument text. Returns false for blank lines.
+bool splitCommandLine(char *line, char *&name, char *&args);
+// Strips an optional "#<id> " prefix so replies can be matched to their
+// request. Returns false if the prefix is present but not a 16-bit number.
+bool splitRequestId(char *&line, bool &has_id, uint16_t &id);
+const Command *findCommand(const Command *table, size_t count, const char *name);
+
+bool parseNone(const char *text, CommandArg &arg);
+bool parseText(const char *text, CommandArg &arg);
+bool parsePositiveFloat(const char *text, CommandArg &arg);
+bool parsePositiveUnsigned(const char *text, CommandArg &arg);
+bool parseOptionalUnsigned(const char *text, CommandArg &arg);
+bool parseEpochSeconds(const char *text, CommandArg &arg);
+bool parseProtocol(const char *text, CommandArg &arg);
+bool parseOnOff(const char *text, CommandArg &arg);
+
+#endif
@@ -0,0 +1,139 @@
+#include "cpu_governor.h"
+#include "esp32-hal-cpu.h"
+
+static const uint32_t governor_frequencies[GOVERNOR_FREQ_COUNT] = { 160, 80, 40, 20, 10 };
+
+CpuGovernor governor;
+
+CpuGovernor::CpuGovernor()
+  : auto_mode_(true), idle_mhz_(40), busy_mhz_(160), fixed_mhz_(0), floor_mhz_(0), current_mhz_(0), locks_(0),
+    last_busy_ms_(0), last_account_ms_(0), switch_count_(0), before_change_(NULL), after_change_(NULL) {
+  memset(millis_at_, 0, sizeof(millis_at_));
+}
+
+void CpuGovernor::begin(uint32_t idle_mhz, uint32_t busy_mhz, void (*before_change)(), void (*after_change)()) {
+  idle_mhz_ = idle_mhz;
+  busy_mhz_ = busy_mhz;
+  before_change_ = before_change;
+  after_change_ = after_change;
+  current_mhz_ = getCpuFrequencyMhz();
+  last_account_ms_ = millis();
+  last_busy_ms_ = millis();
+}
+
+void CpuGovernor::setAuto() {
+  auto_mode_ = true;
+  last_busy_ms_ = millis();
+}
+
+bool CpuGovernor::setFixed(uint32_t mhz) {
+  if (!isSupported(mhz)) {
+    return false;
+  }
+  auto_mode_ = false;
+  fixed_mhz_ = mhz;
+  apply(max(mhz, floor_mhz_));
+  return true;
+}
+
+bool CpuGovernor::isAuto() const {
+  return auto_mode_;
+}
+
+void CpuGovernor::acquire(uint32_t min_mhz) {
+  locks_++;
+  floor_mhz_ = max(floor_mhz_, min_mhz);
+  if (auto_mode_) {
+    apply(max(busy_mhz_, floor_mhz_));
+  } else {
+    apply(max(fixed_mhz_, floor_mhz_));
+  }
+}
+
+void CpuGovernor::release() {
+  if (locks_ > 0) {
+    locks_--;
+  }
+  if (locks_ == 0) {
+    floor_mhz_ = 0;
+    if (!auto_mode_) {
+      apply(fixed_mhz_);
+    }
+  }
+  last_busy_ms_ = millis();
+}
+
+void CpuGovernor::update(bool busy) {
+  if (!auto_mode_) {
+    return;
+  }
+  unsigned long now = millis();
+  if (busy || locks_ > 0) {
+    last_busy_ms_ = now;
+    apply(max(busy_mhz_, floor_mhz_));
+  } else if (now - last_busy_ms_ >= GOVERNOR_IDLE_HOLD_MS) {
+    apply(idle_mhz_);
+  }
+}
+
+uint32_t CpuGovernor::currentMhz() const {
+  return current_mhz_;
+}
+
+uint32_t CpuGovernor::idleMhz() const {
+  return idle_mhz_;
+}
+
+uint32_t CpuGovernor::busyMhz() const {
+  return busy_mhz_;
+}
+
+uint32_t CpuGovernor::switchCount() const {
+  return switch_count_;
+}
+
+uint32_t CpuGovernor::millisAt(uint8_t index) {
+  account();
+  return index < GOVERNOR_FREQ_COUNT ? millis_at_[index] : 0;
+}
+
+bool CpuGovernor::isSupported(uint32_t mhz) {
+  for (uint8_t i = 0; i < GOVERNOR_FREQ_COUNT; i++) {
+    if (governor_frequencies[i] == mhz) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t CpuGovernor::frequencyAt(uint8_t index) {
+  return index < GOVERNOR_FREQ_COUNT ? governor_frequencies[index] : 0;
+}
+
+void CpuGovernor::apply(uint32_t mhz) {
+  if (mhz == current_mhz_) {
+    return;
+  }
+  account();
+  if (before_change_) {
+    before_change_();
+  }
+  if (setCpuFrequencyMhz(mhz)) {
+    current_mhz_ = mhz;
+    switch_count_++;
+  }
+  if (after_change_) {
+    after_change_();
+  }
+}
+
+void CpuGovernor::account() {
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < GOVERNOR_FREQ_COUNT; i++) {
+    if (governor_frequencies[i] == current_mhz_) {
+      millis_at_[i] += now - last_account_ms_;
+      break;
+    }
+  }
+  last_account_ms_ = now;
+}
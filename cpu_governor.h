@@ -0,0 +1,59 @@
+#ifndef CPU_GOVERNOR_H
+#define CPU_GOVERNOR_H
+
+#include <Arduino.h>
+
+#define GOVERNOR_FREQ_COUNT 5
+#define GOVERNOR_IDLE_HOLD_MS 50
+
+// Switches the CPU between an idle and a busy frequency. Callers hold
+// boost locks for explicit work (e.g. a dump) and pass a busy hint each
+// pass; the clock drops only after GOVERNOR_IDLE_HOLD_MS without either.
+// A lock taken with a minimum frequency also lifts a lower fixed clock to
+// that floor until the last lock is released. before_change runs right
+// before each switch and after_change right after it, whether or not the
+// switch succeeded, so a caller can quiesce clocked peripherals around it.
+class CpuGovernor {
+public:
+  CpuGovernor();
+
+  void begin(uint32_t idle_mhz, uint32_t busy_mhz, void (*before_change)(), void (*after_change)());
+  void setAuto();
+  bool setFixed(uint32_t mhz);
+  bool isAuto() const;
+
+  void acquire(uint32_t min_mhz = 0);
+  void release();
+  void update(bool busy);
+
+  uint32_t currentMhz() const;
+  uint32_t idleMhz() const;
+  uint32_t busyMhz() const;
+  uint32_t switchCount() const;
+  uint32_t millisAt(uint8_t index);
+
+  static bool isSupported(uint32_t mhz);
+  static uint32_t frequencyAt(uint8_t index);
+
+private:
+  void apply(uint32_t mhz);
+  void account();
+
+  bool auto_mode_;
+  uint32_t idle_mhz_;
+  uint32_t busy_mhz_;
+  uint32_t fixed_mhz_;
+  uint32_t floor_mhz_;
+  uint32_t current_mhz_;
+  uint8_t locks_;
+  unsigned long last_busy_ms_;
+  unsigned long last_account_ms_;
+  uint32_t switch_count_;
+  uint32_t millis_at_[GOVERNOR_FREQ_COUNT];
+  void (*before_change_)();
+  void (*after_change_)();
+};
+
+extern CpuGovernor governor;
+
+#endif
@@ -1,12 +1,36 @@
 #include <Wire.h>
-#include <Adafruit_INA219.h>
 #include <OneWire.h>
 #include <DallasTemperature.h>
 #include "esp32-hal-cpu.h"
 #include <WiFi.h>
 #include <BluetoothSerial.h>
+#include <inttypes.h>
+#include "esp_sleep.h"
+#include "driver/uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "response.h"
+#include "ina219_driver.h"
+#include "cpu_governor.h"
+#include "persistent_store.h"
+#include "aggregator.h"
+#include "flash_log.h"
+#include "stats.h"
+#include "relay_controller.h"
+#include "command_parser.h"
+#include "snapshot.h"
+#include "tx_queue.h"
+#include "uplink.h"
+#include "report_filter.h"
 
-Adafruit_INA219 ina219;
+#define INA219_ADDRESS 0x40
+#define I2C_SDA_PIN 6
+#define I2C_SCL_PIN 7
+#define I2C_CLOCK_HZ 400000
+
+INA219Driver ina219(Wire, INA219_ADDRESS);
 bool ina219_found = false;
 
 #define DS18B20_PIN 4
@@ -15,272 +39,2830 @@ DallasTemperature sensors(&oneWireBus);
 
 #define RELAY_PIN 5
 
-DeviceAddress outdoorThermometer;
-DeviceAddress indoorThermometer;
+#define STATS_PERCENTILE 99
+
+Histogram loop_stats;
+Histogram temp_request_stats;
+Histogram scratchpad_stats;
+Histogram ina219_stats;
+Histogram command_stats;
+Histogram tx_backlog_stats;
+Histogram control_stats;
+uint32_t temp_crc_errors = 0;
+uint32_t temp_disconnected_reads = 0;
+uint32_t rx_overflow_count = 0;
+uint32_t control_queue_drops = 0;
+uint32_t relay_event_drops = 0;
+unsigned long stats_reset_ms = 0;
+
+// Bumped on both sides of a CPU frequency change, so it is odd while the
+// clock is switching. Cycle counts are converted with the current clock,
+// so a span during which it moved would mix two rates and is dropped.
+volatile uint32_t cpu_clock_epoch = 0;
+
+struct CycleSpan {
+  uint32_t start_cycles;
+  uint32_t clock_epoch;
+};
+
+CycleSpan startCycleSpan() {
+  CycleSpan span = { ESP.getCycleCount(), cpu_clock_epoch };
+  return span;
+}
+
+void recordCycleSpan(Histogram &histogram, const CycleSpan &span) {
+  uint32_t cycles = ESP.getCycleCount() - span.start_cycles;
+  if (span.clock_epoch == cpu_clock_epoch && !(span.clock_epoch & 1)) {
+    histogram.record(cycles / getCpuFrequencyMhz());
+  }
+}
+
+#define MAX_THERMOMETERS 12
+#define THERMOMETER_LABEL_MAX COMMAND_LABEL_MAX
+#define SCRATCHPAD_RETRIES 1
+
+struct Thermometer {
+  DeviceAddress address;
+  char label[THERMOMETER_LABEL_MAX];
+  float temp_C;
+  uint32_t read_errors;
+  uint8_t resolution;
+  uint8_t target_resolution;
+  uint8_t alarm_high;
+  uint8_t alarm_low;
+  float last_temp_C;
+  unsigned long last_temp_ms;
+  uint8_t stable_cycles;
+};
+
+Thermometer thermometers[MAX_THERMOMETERS];
+uint8_t thermometer_count = 0;
+int8_t outdoor_index = -1;
+int8_t indoor_index = -1;
+uint8_t temp_read_index = 0;
+
+const DeviceAddress defaultOutdoorAddress = { 0x28, 0x09, 0x8A, 0xC0, 0x00, 0x00, 0x00, 0xC7 };
+const DeviceAddress defaultIndoorAddress = { 0x28, 0x07, 0xBB, 0x83, 0x00, 0x00, 0x00, 0xF5 };
+#define DS18B20_RESOLUTION 10
+#define DS18B20_MIN_RESOLUTION 9
+#define DS18B20_MAX_RESOLUTION 12
+#define DS18B20_MAX_CONVERSION_MS 750
+#define DS18B20_WRITE_SCRATCHPAD 0x4E
+#define TEMP_RESOLUTION_AUTO 0
+#define TEMP_FAST_C_PER_MIN 0.5f
+#define TEMP_STABLE_CYCLES 3
+
+uint8_t temp_resolution_mode = DS18B20_RESOLUTION;
+unsigned long temp_budget_ms = DS18B20_MAX_CONVERSION_MS;
+unsigned long temp_conversion_ms = DS18B20_MAX_CONVERSION_MS >> (DS18B20_MAX_RESOLUTION - DS18B20_RESOLUTION);
 
 float voltage_low_cutoff_V = 12.1;
 float voltage_high_on_threshold_V = 13.4;
 float power_on_threshold_mW = 2000.0;
 float power_off_threshold_mW = 500.0;
-unsigned long debounce_delay_ms = 60000;
+float voltage_emergency_cutoff_V = 11.5;
+unsigned long relay_on_delay_ms = 60000;
+unsigned long relay_off_delay_ms = 10000;
+uint8_t relay_filter_mode = RELAY_FILTER_MEDIAN;
+uint8_t relay_filter_depth = 5;
 bool auto_relay_mode = true;
-unsigned long debounce_timer_start = 0;
-int last_stable_state = LOW;
+RelayController relay_controller;
+
+#define INA219_CONVERSION_MARGIN_US 2000
+
+unsigned long control_period_ms = 1000;
+unsigned long solar_tick_ms = 0;
+unsigned long solar_trigger_us = 0;
+unsigned long solar_conversion_us = 0;
+bool solar_conversion_pending = false;
+INA219Raw latest_solar;
+unsigned long solar_sample_ms = 0;
+bool solar_sample_valid = false;
+
+#define STREAM_CHANNEL_OUTDOOR 0x01
+#define STREAM_CHANNEL_INDOOR 0x02
+#define STREAM_CHANNEL_SOLAR 0x04
+#define STREAM_CHANNEL_RELAY 0x08
+#define STREAM_CHANNEL_ALL 0x0F
+#define STREAM_MIN_PERIOD_MS 50
+
+bool streaming = false;
+uint8_t stream_channels = 0;
+unsigned long stream_period_ms = 1000;
+unsigned long stream_tick_ms = 0;
+uint32_t stream_seq = 0;
+
+// Report-by-exception: each new snapshot is checked against per-channel
+// deadbands and only sent when something moved or the heartbeat is due.
+bool reporting = false;
+float report_temp_deadband_C = 0.2;
+float report_voltage_deadband_mV = 100.0;
+float report_current_deadband_mA = 20.0;
+float report_power_deadband_mW = 250.0;
+unsigned long report_heartbeat_ms = 900000;
+ReportFilter report_filter;
+uint32_t report_snapshot_version = 0;
+uint32_t report_seq = 0;
+
+#define CPU_IDLE_MHZ 40
+#define CPU_BUSY_MHZ 160
+
+unsigned long serial_baud = 115200;
+int tx_idle_space = 0;
+uint32_t tx_buffer_size = TX_QUEUE_DEFAULT_SIZE;
+uint8_t tx_policy = TX_POLICY_DROP_OLDEST;
+
+#define UART_WAKE_THRESHOLD 3
+#define LIGHT_SLEEP_MIN_MS 5
+
+bool light_sleep_enabled = false;
+uint32_t light_sleep_count = 0;
+uint32_t uart_wake_count = 0;
+uint64_t light_sleep_total_us = 0;
+unsigned long uart_wake_us = 0;
+bool awaiting_first_byte = false;
+unsigned long wake_latency_us = 0;
+unsigned long wake_latency_max_us = 0;
+
+#define UPLINK_FLAG_RELAY_ON 0x01
+
+// Opt-in ESP-NOW uplink: every period the samples recorded since the last
+// good burst go out as one packet, thinned by a stride if they exceed it.
+bool uplink_enabled = false;
+unsigned long uplink_period_ms = 300000;
+unsigned long last_uplink_ms = 0;
+uint32_t uplink_next_seq = 0;
+uint16_t uplink_batch_seq = 0;
+uint32_t uplink_samples_sent = 0;
+
+#define SETTINGS_VERSION 8
+#define SENSOR_TABLE_VERSION 2
+
+struct PersistedSettings {
+  uint16_t version;
+  uint8_t auto_relay_mode;
+  uint8_t relay_state;
+  float voltage_low_cutoff_V;
+  float voltage_high_on_threshold_V;
+  float power_on_threshold_mW;
+  float power_off_threshold_mW;
+  uint32_t relay_on_delay_ms;
+  uint32_t temp_sample_period_ms;
+  uint32_t sample_period_ms;
+  uint32_t control_period_ms;
+  uint8_t ina_bus_adc;
+  uint8_t ina_shunt_adc;
+  uint8_t light_sleep_enabled;
+  uint8_t cpu_fixed_mhz;
+  uint32_t agg_window_ms;
+  uint32_t log_period_ms;
+  uint8_t temp_resolution_mode;
+  uint32_t temp_budget_ms;
+  uint32_t tx_buffer_size;
+  uint8_t tx_policy;
+  uint8_t uplink_enabled;
+  uint8_t uplink_peer[6];
+  uint8_t uplink_channel;
+  uint32_t uplink_period_ms;
+  uint8_t reporting;
+  float report_temp_deadband_C;
+  float report_voltage_deadband_mV;
+  float report_current_deadband_mA;
+  float report_power_deadband_mW;
+  uint32_t report_heartbeat_ms;
+  uint32_t relay_off_delay_ms;
+  float voltage_emergency_cutoff_V;
+  uint8_t relay_filter_mode;
+  uint8_t relay_filter_depth;
+};
+
+struct PersistedSensorTable {
+  uint16_t version;
+  uint8_t count;
+  struct {
+    DeviceAddress address;
+    char label[THERMOMETER_LABEL_MAX];
+  } entries[MAX_THERMOMETERS];
+};
+
+PersistedSettings persisted_settings;
+PersistedSensorTable persisted_sensors;
+int settings_record = -1;
+int sensors_record = -1;
+bool settings_restored = false;
+bool sensors_fast_path = false;
+unsigned long setup_done_ms = 0;
+unsigned long first_temp_ms = 0;
+unsigned long first_solar_ms = 0;
+
+unsigned long temp_sample_period_ms = 5000;
+unsigned long temp_conversion_start_ms = 0;
+bool temp_conversion_pending = false;
+float cached_outdoor_temp_C = DEVICE_DISCONNECTED_C;
+float cached_indoor_temp_C = DEVICE_DISCONNECTED_C;
+uint8_t cached_outdoor_res = 0;
+uint8_t cached_indoor_res = 0;
+unsigned long temp_sample_ms = 0;
+bool temp_sample_valid = false;
+
+// Sensor acquisition, relay control and command I/O run as separate tasks.
+// Control outranks acquisition, which outranks the Arduino loop task that
+// handles the serial link, so a busy host can only delay replies.
+#define CONTROL_TASK_PRIORITY 4
+#define ACQUISITION_TASK_PRIORITY 3
+#define CONTROL_TASK_STACK 3072
+#define ACQUISITION_TASK_STACK 4096
+#define CONTROL_QUEUE_LENGTH 4
+#define RELAY_EVENT_QUEUE_LENGTH 8
+#define IO_IDLE_WAIT_TICKS 1
+
+// Latest readings as published by the acquisition task.
+struct SensorSnapshot {
+  float outdoor_temp_C;
+  float indoor_temp_C;
+  uint8_t outdoor_res;
+  uint8_t indoor_res;
+  unsigned long temp_ms;
+  bool temp_valid;
+  INA219Raw solar;
+  unsigned long solar_ms;
+  unsigned long solar_conversion_us;
+  bool solar_valid;
+};
 
-void setINA219PowerDown() {
-  uint16_t config_value = 0x399F;
-  config_value &= ~0x0007;
-  Wire.beginTransmission(0x40);
-  Wire.write(0x00);
-  Wire.write((config_value >> 8) & 0xFF);
-  Wire.write(config_value & 0xFF);
-  Wire.endTransmission();
+struct SolarReading {
+  INA219Raw raw;
+  CycleSpan span;
+};
+
+struct RelayEvent {
+  bool on;
+  bool fast_trip;
+  float power_mW;
+  float voltage_V;
+};
+
+Snapshot<SensorSnapshot> sensor_snapshot;
+QueueHandle_t control_queue = NULL;
+QueueHandle_t relay_event_queue = NULL;
+SemaphoreHandle_t onewire_mutex = NULL;
+SemaphoreHandle_t i2c_mutex = NULL;
+TaskHandle_t acquisition_task = NULL;
+TaskHandle_t control_task = NULL;
+portMUX_TYPE shared_state_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#define SAMPLE_BUFFER_SIZE 512
+
+struct Sample {
+  uint32_t seq;
+  uint32_t timestamp_ms;
+  float outdoor_temp_C;
+  float indoor_temp_C;
+  float voltage_V;
+  float current_mA;
+  float power_mW;
+};
+
+Sample sample_buffer[SAMPLE_BUFFER_SIZE];
+uint32_t sample_next_seq = 1;
+unsigned long sample_period_ms = 10000;
+unsigned long last_sample_ms = 0;
+
+unsigned long agg_window_ms = 600000;
+
+#define BACKFILL_BATCH 4
+#define BACKFILL_TX_SPACE 128
+
+bool flash_log_ready = false;
+unsigned long log_period_ms = 60000;
+unsigned long last_log_ms = 0;
+bool time_synced = false;
+uint32_t time_sync_epoch_s = 0;
+unsigned long time_sync_ms = 0;
+bool backfill_active = false;
+uint32_t backfill_from_ts = 0;
+uint32_t backfill_count = 0;
+uint32_t backfill_request_id = RESPONSE_NO_REQUEST_ID;
+
+#define TEMP_CHANNEL_OUTDOOR 0x01
+#define TEMP_CHANNEL_INDOOR 0x02
+
+void updateRawThresholds() {
+  RelayThresholds thresholds;
+  thresholds.voltage_emergency_raw = INA219Driver::busVoltageRawFrom_V(voltage_emergency_cutoff_V);
+  thresholds.voltage_low_cutoff_raw = INA219Driver::busVoltageRawFrom_V(voltage_low_cutoff_V);
+  thresholds.voltage_high_on_raw = INA219Driver::busVoltageRawFrom_V(voltage_high_on_threshold_V);
+  thresholds.power_on_raw = INA219Driver::powerRawFrom_mW(power_on_threshold_mW);
+  thresholds.power_off_raw = INA219Driver::powerRawFrom_mW(power_off_threshold_mW);
+  thresholds.on_delay_ms = relay_on_delay_ms;
+  thresholds.off_delay_ms = relay_off_delay_ms;
+  thresholds.filter = relay_filter_mode;
+  thresholds.filter_depth = relay_filter_depth;
+  portENTER_CRITICAL(&shared_state_mux);
+  relay_controller.setThresholds(thresholds);
+  portEXIT_CRITICAL(&shared_state_mux);
 }
 
-void setINA219Active() {
-  uint16_t config_value = 0x399F;
-  Wire.beginTransmission(0x40);
-  Wire.write(0x00);
-  Wire.write((config_value >> 8) & 0xFF);
-  Wire.write(config_value & 0xFF);
-  Wire.endTransmission();
+void updateReportDeadbands() {
+  ReportDeadbands deadbands;
+  deadbands.temp_C = report_temp_deadband_C;
+  deadbands.voltage_mV = report_voltage_deadband_mV;
+  deadbands.current_mA = report_current_deadband_mA;
+  deadbands.power_mW = report_power_deadband_mW;
+  deadbands.heartbeat_ms = report_heartbeat_ms;
+  report_filter.setDeadbands(deadbands);
 }
 
-void printOutdoorTemp() {
+unsigned long solarPeriodMs() {
+  if (streaming && (stream_channels & STREAM_CHANNEL_SOLAR) && stream_period_ms < control_period_ms) {
+    return stream_period_ms;
+  }
+  return control_period_ms;
+}
+
+unsigned long tempPeriodMs() {
+  if (streaming && (stream_channels & (STREAM_CHANNEL_OUTDOOR | STREAM_CHANNEL_INDOOR)) && stream_period_ms < temp_sample_period_ms) {
+    return stream_period_ms;
+  }
+  return temp_sample_period_ms;
+}
+
+void persistSettings() {
+  persisted_settings.version = SETTINGS_VERSION;
+  persisted_settings.auto_relay_mode = auto_relay_mode;
+  persisted_settings.relay_state = relay_controller.isOn() ? HIGH : LOW;
+  persisted_settings.voltage_low_cutoff_V = voltage_low_cutoff_V;
+  persisted_settings.voltage_high_on_threshold_V = voltage_high_on_threshold_V;
+  persisted_settings.power_on_threshold_mW = power_on_threshold_mW;
+  persisted_settings.power_off_threshold_mW = power_off_threshold_mW;
+  persisted_settings.relay_on_delay_ms = relay_on_delay_ms;
+  persisted_settings.temp_sample_period_ms = temp_sample_period_ms;
+  persisted_settings.sample_period_ms = sample_period_ms;
+  persisted_settings.control_period_ms = control_period_ms;
+  persisted_settings.ina_bus_adc = ina219.busAdc();
+  persisted_settings.ina_shunt_adc = ina219.shuntAdc();
+  persisted_settings.light_sleep_enabled = light_sleep_enabled;
+  persisted_settings.cpu_fixed_mhz = governor.isAuto() ? 0 : governor.currentMhz();
+  persisted_settings.agg_window_ms = agg_window_ms;
+  persisted_settings.log_period_ms = log_period_ms;
+  persisted_settings.temp_resolution_mode = temp_resolution_mode;
+  persisted_settings.temp_budget_ms = temp_budget_ms;
+  persisted_settings.tx_buffer_size = tx_buffer_size;
+  persisted_settings.tx_policy = tx_policy;
+  persisted_settings.uplink_enabled = uplink_enabled;
+  memcpy(persisted_settings.uplink_peer, uplink.peer(), sizeof(persisted_settings.uplink_peer));
+  persisted_settings.uplink_channel = uplink.channel();
+  persisted_settings.uplink_period_ms = uplink_period_ms;
+  persisted_settings.reporting = reporting;
+  persisted_settings.report_temp_deadband_C = report_temp_deadband_C;
+  persisted_settings.report_voltage_deadband_mV = report_voltage_deadband_mV;
+  persisted_settings.report_current_deadband_mA = report_current_deadband_mA;
+  persisted_settings.report_power_deadband_mW = report_power_deadband_mW;
+  persisted_settings.report_heartbeat_ms = report_heartbeat_ms;
+  persisted_settings.relay_off_delay_ms = relay_off_delay_ms;
+  persisted_settings.voltage_emergency_cutoff_V = voltage_emergency_cutoff_V;
+  persisted_settings.relay_filter_mode = relay_filter_mode;
+  persisted_settings.relay_filter_depth = relay_filter_depth;
+  store.markDirty(settings_record);
+}
+
+bool restoreSettings() {
+  if (!store.load(settings_record) || persisted_settings.version != SETTINGS_VERSION) {
+    return false;
+  }
+  auto_relay_mode = persisted_settings.auto_relay_mode;
+  relay_controller.setState(persisted_settings.relay_state == HIGH, millis());
+  voltage_low_cutoff_V = persisted_settings.voltage_low_cutoff_V;
+  voltage_high_on_threshold_V = persisted_settings.voltage_high_on_threshold_V;
+  power_on_threshold_mW = persisted_settings.power_on_threshold_mW;
+  power_off_threshold_mW = persisted_settings.power_off_threshold_mW;
+  relay_on_delay_ms = persisted_settings.relay_on_delay_ms;
+  temp_sample_period_ms = persisted_settings.temp_sample_period_ms;
+  sample_period_ms = persisted_settings.sample_period_ms;
+  control_period_ms = persisted_settings.control_period_ms;
+  ina219.setAdcModes(persisted_settings.ina_bus_adc, persisted_settings.ina_shunt_adc);
+  light_sleep_enabled = persisted_settings.light_sleep_enabled;
+  agg_window_ms = persisted_settings.agg_window_ms;
+  log_period_ms = persisted_settings.log_period_ms;
+  temp_resolution_mode = persisted_settings.temp_resolution_mode;
+  temp_budget_ms = persisted_settings.temp_budget_ms;
+  tx_buffer_size = persisted_settings.tx_buffer_size;
+  tx_policy = persisted_settings.tx_policy;
+  uplink_enabled = persisted_settings.uplink_enabled;
+  uplink.setPeer(persisted_settings.uplink_peer, persisted_settings.uplink_channel);
+  uplink_period_ms = persisted_settings.uplink_period_ms;
+  reporting = persisted_settings.reporting;
+  report_temp_deadband_C = persisted_settings.report_temp_deadband_C;
+  report_voltage_deadband_mV = persisted_settings.report_voltage_deadband_mV;
+  report_current_deadband_mA = persisted_settings.report_current_deadband_mA;
+  report_power_deadband_mW = persisted_settings.report_power_deadband_mW;
+  report_heartbeat_ms = persisted_settings.report_heartbeat_ms;
+  relay_off_delay_ms = persisted_settings.relay_off_delay_ms;
+  voltage_emergency_cutoff_V = persisted_settings.voltage_emergency_cutoff_V;
+  relay_filter_mode = persisted_settings.relay_filter_mode;
+  relay_filter_depth = persisted_settings.relay_filter_depth;
+  return true;
+}
+
+void configureThermometer(const uint8_t *address) {
+  if (sensors.getResolution(address) != DS18B20_RESOLUTION) {
+    sensors.setResolution(address, DS18B20_RESOLUTION);
+  }
+}
+
+void resetThermometerState(Thermometer &thermometer) {
+  thermometer.temp_C = DEVICE_DISCONNECTED_C;
+  thermometer.read_errors = 0;
+  thermometer.resolution = DS18B20_RESOLUTION;
+  thermometer.target_resolution = DS18B20_RESOLUTION;
+  thermometer.last_temp_C = DEVICE_DISCONNECTED_C;
+  thermometer.last_temp_ms = 0;
+  thermometer.stable_cycles = 0;
+}
+
+int8_t findThermometer(const char *label) {
+  for (uint8_t i = 0; i < thermometer_count; i++) {
+    if (strcmp(thermometers[i].label, label) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// publishSnapshot also runs from the solar path, which does not hold
+// onewire_mutex, so it reads these copies instead of the table. They are
+// refreshed with the mutex held whenever roles, readings or resolutions change.
+void cacheThermometerReadings() {
+  float outdoor_C = outdoor_index >= 0 ? thermometers[outdoor_index].temp_C : DEVICE_DISCONNECTED_C;
+  float indoor_C = indoor_index >= 0 ? thermometers[indoor_index].temp_C : DEVICE_DISCONNECTED_C;
+  uint8_t outdoor_res = outdoor_index >= 0 ? thermometers[outdoor_index].resolution : 0;
+  uint8_t indoor_res = indoor_index >= 0 ? thermometers[indoor_index].resolution : 0;
+  portENTER_CRITICAL(&shared_state_mux);
+  cached_outdoor_temp_C = outdoor_C;
+  cached_indoor_temp_C = indoor_C;
+  cached_outdoor_res = outdoor_res;
+  cached_indoor_res = indoor_res;
+  portEXIT_CRITICAL(&shared_state_mux);
+}
+
+void updateThermometerRoles() {
+  outdoor_index = findThermometer("outdoor");
+  indoor_index = findThermometer("indoor");
+  cacheThermometerReadings();
+}
+
+void saveSensorTable() {
+  persisted_sensors.version = SENSOR_TABLE_VERSION;
+  persisted_sensors.count = thermometer_count;
+  for (uint8_t i = 0; i < thermometer_count; i++) {
+    memcpy(persisted_sensors.entries[i].address, thermometers[i].address, 8);
+    memcpy(persisted_sensors.entries[i].label, thermometers[i].label, THERMOMETER_LABEL_MAX);
+  }
+  store.markDirty(sensors_record);
+}
+
+bool restoreSensorTable() {
+  if (!store.load(sensors_record) || persisted_sensors.version != SENSOR_TABLE_VERSION ||
+      persisted_sensors.count == 0 || persisted_sensors.count > MAX_THERMOMETERS) {
+    return false;
+  }
+  for (uint8_t i = 0; i < persisted_sensors.count; i++) {
+    if (!sensors.isConnected(persisted_sensors.entries[i].address)) {
+      return false;
+    }
+  }
+  thermometer_count = persisted_sensors.count;
+  for (uint8_t i = 0; i < thermometer_count; i++) {
+    memcpy(thermometers[i].address, persisted_sensors.entries[i].address, 8);
+    memcpy(thermometers[i].label, persisted_sensors.entries[i].label, THERMOMETER_LABEL_MAX);
+    thermometers[i].label[THERMOMETER_LABEL_MAX - 1] = '\0';
+    resetThermometerState(thermometers[i]);
+  }
+  updateThermometerRoles();
+  return true;
+}
+
+bool addressEquals(const uint8_t *a, const uint8_t *b) {
+  return memcmp(a, b, 8) == 0;
+}
+
+// Rebuilds the table from a bus search. Known addresses keep their labels,
+// the two default probes are labelled outdoor/indoor, and when either role
+// is still missing the first newly found probes take it.
+bool discoverSensors() {
+  Thermometer previous[MAX_THERMOMETERS];
+  uint8_t previous_count = thermometer_count;
+  memcpy(previous, thermometers, sizeof(previous));
+
+  sensors.begin();
+  uint8_t count = sensors.getDeviceCount();
+  thermometer_count = 0;
+  for (uint8_t i = 0; i < count && thermometer_count < MAX_THERMOMETERS; i++) {
+    Thermometer &entry = thermometers[thermometer_count];
+    if (!sensors.getAddress(entry.address, i)) {
+      continue;
+    }
+    snprintf(entry.label, THERMOMETER_LABEL_MAX, "probe%u", (unsigned)thermometer_count + 1);
+    for (uint8_t j = 0; j < previous_count; j++) {
+      if (addressEquals(entry.address, previous[j].address)) {
+        memcpy(entry.label, previous[j].label, THERMOMETER_LABEL_MAX);
+      }
+    }
+    if (addressEquals(entry.address, defaultOutdoorAddress)) {
+      strcpy(entry.label, "outdoor");
+    } else if (addressEquals(entry.address, defaultIndoorAddress)) {
+      strcpy(entry.label, "indoor");
+    }
+    resetThermometerState(entry);
+    thermometer_count++;
+  }
+
+  updateThermometerRoles();
+  for (uint8_t i = 0; i < thermometer_count && (outdoor_index < 0 || indoor_index < 0); i++) {
+    if (strncmp(thermometers[i].label, "probe", 5) != 0) {
+      continue;
+    }
+    strcpy(thermometers[i].label, outdoor_index < 0 ? "outdoor" : "indoor");
+    updateThermometerRoles();
+  }
+
+  saveSensorTable();
+  return thermometer_count > 0;
+}
+
+void configureThermometers() {
+  for (uint8_t i = 0; i < thermometer_count; i++) {
+    configureThermometer(thermometers[i].address);
+  }
+}
+
+// Reads one probe's scratchpad after the shared conversion. The CRC and the
+// fixed low bits of the configuration register reject bus glitches and
+// all-zero reads from a shorted line.
+float readThermometer(Thermometer &thermometer) {
+  uint8_t scratchpad[9];
+  for (uint8_t attempt = 0; attempt <= SCRATCHPAD_RETRIES; attempt++) {
+    CycleSpan span = startCycleSpan();
+    bool present = sensors.readScratchPad(thermometer.address, scratchpad);
+    recordCycleSpan(scratchpad_stats, span);
+    bool crc_ok = present && OneWire::crc8(scratchpad, 8) == scratchpad[8];
+    if (present && !crc_ok) {
+      temp_crc_errors++;
+    }
+    if (crc_ok && (scratchpad[4] & 0x1F) == 0x1F) {
+      thermometer.resolution = ((scratchpad[4] >> 5) & 0x03) + DS18B20_MIN_RESOLUTION;
+      thermometer.alarm_high = scratchpad[2];
+      thermometer.alarm_low = scratchpad[3];
+      int16_t raw = (int16_t)((scratchpad[1] << 8) | scratchpad[0]);
+      raw &= ~((1 << (DS18B20_MAX_RESOLUTION - thermometer.resolution)) - 1);
+      return raw * 0.0625f;
+    }
+    thermometer.read_errors++;
+  }
+  temp_disconnected_reads++;
+  return DEVICE_DISCONNECTED_C;
+}
+
+unsigned long conversionMsFor(uint8_t resolution) {
+  return DS18B20_MAX_CONVERSION_MS >> (DS18B20_MAX_RESOLUTION - resolution);
+}
+
+// Highest resolution whose conversion time fits the per-cycle budget.
+uint8_t budgetResolution() {
+  uint8_t resolution = DS18B20_MAX_RESOLUTION;
+  while (resolution > DS18B20_MIN_RESOLUTION && conversionMsFor(resolution) > temp_budget_ms) {
+    resolution--;
+  }
+  return resolution;
+}
+
+// Changes only the configuration register in the scratchpad; the EEPROM
+// copy keeps the boot resolution, so adaptive steps cause no wear.
+bool writeThermometerResolution(Thermometer &thermometer, uint8_t resolution) {
+  if (!oneWireBus.reset()) {
+    return false;
+  }
+  oneWireBus.select(thermometer.address);
+  oneWireBus.write(DS18B20_WRITE_SCRATCHPAD);
+  oneWireBus.write(thermometer.alarm_high);
+  oneWireBus.write(thermometer.alarm_low);
+  oneWireBus.write(((resolution - DS18B20_MIN_RESOLUTION) << 5) | 0x1F);
+  thermometer.resolution = resolution;
+  return true;
+}
+
+// Adaptive mode drops a probe to 9-bit as soon as it moves by more than one
+// step at a rate above TEMP_FAST_C_PER_MIN, then climbs one bit after every
+// TEMP_STABLE_CYCLES readings that stay within one step.
+void updateTargetResolution(Thermometer &thermometer, unsigned long now) {
+  if (temp_resolution_mode != TEMP_RESOLUTION_AUTO) {
+    thermometer.target_resolution = temp_resolution_mode;
+  } else if (thermometer.temp_C != DEVICE_DISCONNECTED_C && thermometer.last_temp_C != DEVICE_DISCONNECTED_C &&
+             now != thermometer.last_temp_ms) {
+    float step_C = 0.0625f * (1 << (DS18B20_MAX_RESOLUTION - thermometer.resolution));
+    float delta_C = fabsf(thermometer.temp_C - thermometer.last_temp_C);
+    float rate = delta_C * 60000.0f / (now - thermometer.last_temp_ms);
+    if (delta_C > step_C && rate >= TEMP_FAST_C_PER_MIN) {
+      thermometer.target_resolution = DS18B20_MIN_RESOLUTION;
+      thermometer.stable_cycles = 0;
+    } else if (delta_C <= step_C && ++thermometer.stable_cycles >= TEMP_STABLE_CYCLES) {
+      thermometer.stable_cycles = 0;
+      if (thermometer.target_resolution < DS18B20_MAX_RESOLUTION) {
+        thermometer.target_resolution++;
+      }
+    }
+  }
+  if (thermometer.target_resolution > budgetResolution()) {
+    thermometer.target_resolution = budgetResolution();
+  }
+  if (thermometer.target_resolution < DS18B20_MIN_RESOLUTION) {
+    thermometer.target_resolution = DS18B20_MIN_RESOLUTION;
+  }
+  thermometer.last_temp_C = thermometer.temp_C;
+  thermometer.last_temp_ms = now;
+}
+
+void applyThermometerResolutions() {
+  for (uint8_t i = 0; i < thermometer_count; i++) {
+    Thermometer &thermometer = thermometers[i];
+    if (thermometer.temp_C != DEVICE_DISCONNECTED_C && thermometer.resolution != thermometer.target_resolution) {
+      writeThermometerResolution(thermometer, thermometer.target_resolution);
+    }
+  }
+  cacheThermometerReadings();
+}
+
+// The shared conversion lasts as long as the slowest probe needs.
+unsigned long cycleConversionMs() {
+  uint8_t resolution = DS18B20_MIN_RESOLUTION;
+  for (uint8_t i = 0; i < thermometer_count; i++) {
+    if (thermometers[i].resolution > resolution) {
+      resolution = thermometers[i].resolution;
+    }
+  }
+  return conversionMsFor(thermometer_count ? resolution : DS18B20_RESOLUTION);
+}
+
+void publishSnapshot() {
+  SensorSnapshot snapshot;
+  portENTER_CRITICAL(&shared_state_mux);
+  snapshot.outdoor_temp_C = cached_outdoor_temp_C;
+  snapshot.indoor_temp_C = cached_indoor_temp_C;
+  snapshot.outdoor_res = cached_outdoor_res;
+  snapshot.indoor_res = cached_indoor_res;
+  portEXIT_CRITICAL(&shared_state_mux);
+  snapshot.temp_ms = temp_sample_ms;
+  snapshot.temp_valid = temp_sample_valid;
+  snapshot.solar = latest_solar;
+  snapshot.solar_ms = solar_sample_ms;
+  snapshot.solar_conversion_us = solar_conversion_us;
+  snapshot.solar_valid = ina219_found && solar_sample_valid;
+  sensor_snapshot.publish(snapshot);
+}
+
+void startTemperatureConversion() {
+  temp_conversion_ms = cycleConversionMs();
+  CycleSpan span = startCycleSpan();
   sensors.requestTemperatures();
-  float outdoor_temp_C = sensors.getTempC(outdoorThermometer);
-  Serial.print("{ \"sensor\": \"o_temp\", \"value\": ");
-  if (outdoor_temp_C != DEVICE_DISCONNECTED_C) {
-    Serial.print(outdoor_temp_C);
+  recordCycleSpan(temp_request_stats, span);
+  temp_conversion_start_ms = millis();
+  temp_conversion_pending = true;
+  temp_read_index = 0;
+}
+
+void serviceTemperatureConversion() {
+  unsigned long now = millis();
+  if (temp_conversion_pending) {
+    if (now - temp_conversion_start_ms < temp_conversion_ms) {
+      return;
+    }
+    if (temp_read_index < thermometer_count) {
+      Thermometer &thermometer = thermometers[temp_read_index++];
+      thermometer.temp_C = readThermometer(thermometer);
+      updateTargetResolution(thermometer, now);
+      return;
+    }
+    applyThermometerResolutions();
+    if (first_temp_ms == 0 && cached_outdoor_temp_C != DEVICE_DISCONNECTED_C && cached_indoor_temp_C != DEVICE_DISCONNECTED_C) {
+      first_temp_ms = now;
+    }
+    portENTER_CRITICAL(&shared_state_mux);
+    if (cached_outdoor_temp_C != DEVICE_DISCONNECTED_C) {
+      aggregator.addSample(AGG_OUTDOOR, cached_outdoor_temp_C, now);
+    }
+    if (cached_indoor_temp_C != DEVICE_DISCONNECTED_C) {
+      aggregator.addSample(AGG_INDOOR, cached_indoor_temp_C, now);
+    }
+    portEXIT_CRITICAL(&shared_state_mux);
+    temp_sample_ms = now;
+    temp_sample_valid = true;
+    temp_conversion_pending = false;
+    publishSnapshot();
+  } else if (now - temp_conversion_start_ms >= tempPeriodMs()) {
+    startTemperatureConversion();
+  }
+}
+
+void addTemp(const char *name, float temp_C) {
+  if (temp_C != DEVICE_DISCONNECTED_C) {
+    response.addFloat(name, temp_C);
   } else {
-    Serial.print("\"error\"");
+    response.addError(name);
+  }
+}
+
+void addTempAge(const SensorSnapshot &snapshot) {
+  if (snapshot.temp_valid) {
+    response.addUnsigned("age_ms", millis() - snapshot.temp_ms);
+  }
+  response.addUnsigned("conversion_ms", temp_conversion_ms);
+}
+
+// The table belongs to the acquisition task; everyone else works on a copy.
+uint8_t copyThermometers(Thermometer *copy) {
+  xSemaphoreTake(onewire_mutex, portMAX_DELAY);
+  uint8_t count = thermometer_count;
+  memcpy(copy, thermometers, count * sizeof(Thermometer));
+  xSemaphoreGive(onewire_mutex);
+  return count;
+}
+
+void sendTempFrame(uint8_t channels) {
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  response.beginFrame(FRAME_TEMP);
+  response.putU8(channels);
+  response.putFloat(snapshot.outdoor_temp_C);
+  response.putFloat(snapshot.indoor_temp_C);
+  response.putU32(snapshot.temp_valid ? millis() - snapshot.temp_ms : 0xFFFFFFFF);
+  response.putU8(snapshot.outdoor_res);
+  response.putU8(snapshot.indoor_res);
+  response.putU16(temp_conversion_ms);
+  response.send();
+}
+
+void printOutdoorTemp() {
+  if (response.isBinary()) {
+    sendTempFrame(TEMP_CHANNEL_OUTDOOR);
+    return;
   }
-  Serial.println(" }");
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  response.beginJson();
+  response.addString("sensor", "o_temp");
+  addTemp("value", snapshot.outdoor_temp_C);
+  response.addUnsigned("res", snapshot.outdoor_res);
+  addTempAge(snapshot);
+  response.send();
 }
 
 void printIndoorTemp() {
-  sensors.requestTemperatures();
-  float indoor_temp_C = sensors.getTempC(indoorThermometer);
-  Serial.print("{ \"sensor\": \"i_temp\", \"value\": ");
-  if (indoor_temp_C != DEVICE_DISCONNECTED_C) {
-    Serial.print(indoor_temp_C);
-  } else {
-    Serial.print("\"error\"");
+  if (response.isBinary()) {
+    sendTempFrame(TEMP_CHANNEL_INDOOR);
+    return;
   }
-  Serial.println(" }");
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  response.beginJson();
+  response.addString("sensor", "i_temp");
+  addTemp("value", snapshot.indoor_temp_C);
+  response.addUnsigned("res", snapshot.indoor_res);
+  addTempAge(snapshot);
+  response.send();
 }
 
 void printSolarData() {
-  setINA219Active();
-  delay(50);
-  Serial.print("{ \"sensor\": \"solar_pwr\", ");
-  if (!ina219_found) {
-    Serial.println("\"status\": \"error\" }");
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  float ina219_voltage_V = snapshot.solar_valid ? INA219Driver::busVoltage_V(snapshot.solar) : NAN;
+  float ina219_current_mA = snapshot.solar_valid ? INA219Driver::current_mA(snapshot.solar) : NAN;
+  float ina219_power_mW = snapshot.solar_valid ? INA219Driver::power_mW(snapshot.solar) : NAN;
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_SOLAR);
+    response.putFloat(ina219_voltage_V);
+    response.putFloat(ina219_current_mA);
+    response.putFloat(ina219_power_mW);
+    response.putU32(snapshot.solar_valid ? millis() - snapshot.solar_ms : 0xFFFFFFFF);
+    response.putU32(snapshot.solar_conversion_us);
+    response.send();
+    return;
+  }
+  response.beginJson();
+  response.addString("sensor", "solar_pwr");
+  if (!snapshot.solar_valid) {
+    response.addString("status", "error");
   } else {
-    float ina219_voltage_V = ina219.getBusVoltage_V();
-    float ina219_current_mA = ina219.getCurrent_mA();
-    float ina219_power_mW = ina219.getPower_mW();
-    Serial.print("\"voltage_V\": ");
-    Serial.print(ina219_voltage_V);
-    Serial.print(", \"current_mA\": ");
-    Serial.print(ina219_current_mA);
-    Serial.print(", \"power_mW\": ");
-    Serial.print(ina219_power_mW);
-    Serial.println(" }");
+    response.addFloat("voltage_V", ina219_voltage_V);
+    response.addFloat("current_mA", ina219_current_mA);
+    response.addFloat("power_mW", ina219_power_mW);
+    response.addUnsigned("age_ms", millis() - snapshot.solar_ms);
+    response.addUnsigned("conversion_us", snapshot.solar_conversion_us);
   }
-  setINA219PowerDown();
+  response.send();
 }
 
 void printBothTemps() {
-  sensors.requestTemperatures();
-  float outdoor_temp_C = sensors.getTempC(outdoorThermometer);
-  float indoor_temp_C = sensors.getTempC(indoorThermometer);
-  Serial.print("{ \"o_temp\": ");
-  if (outdoor_temp_C != DEVICE_DISCONNECTED_C) {
-    Serial.print(outdoor_temp_C);
+  if (response.isBinary()) {
+    sendTempFrame(TEMP_CHANNEL_OUTDOOR | TEMP_CHANNEL_INDOOR);
+    return;
+  }
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  response.beginJson();
+  addTemp("o_temp", snapshot.outdoor_temp_C);
+  addTemp("i_temp", snapshot.indoor_temp_C);
+  response.addUnsigned("o_res", snapshot.outdoor_res);
+  response.addUnsigned("i_res", snapshot.indoor_res);
+  addTempAge(snapshot);
+  response.send();
+}
+
+void printAllTemps() {
+  Thermometer table[MAX_THERMOMETERS];
+  uint8_t count = copyThermometers(table);
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_TEMPS);
+    response.putU8(count);
+    for (uint8_t i = 0; i < count; i++) {
+      uint8_t length = strlen(table[i].label);
+      response.putU8(length);
+      for (uint8_t j = 0; j < length; j++) {
+        response.putU8(table[i].label[j]);
+      }
+      response.putFloat(table[i].temp_C);
+      response.putU8(table[i].resolution);
+    }
+    response.putU32(snapshot.temp_valid ? millis() - snapshot.temp_ms : 0xFFFFFFFF);
+    response.putU16(temp_conversion_ms);
+    response.send();
+    return;
+  }
+  response.beginJson();
+  for (uint8_t i = 0; i < count; i++) {
+    addTemp(table[i].label, table[i].temp_C);
+  }
+  response.beginObject("res");
+  for (uint8_t i = 0; i < count; i++) {
+    response.addUnsigned(table[i].label, table[i].resolution);
+  }
+  response.endObject();
+  addTempAge(snapshot);
+  response.send();
+}
+
+void printSensorTable() {
+  Thermometer table[MAX_THERMOMETERS];
+  uint8_t count = copyThermometers(table);
+  response.beginJson();
+  response.beginObject("sensors");
+  for (uint8_t i = 0; i < count; i++) {
+    char address[17];
+    for (uint8_t j = 0; j < 8; j++) {
+      snprintf(address + 2 * j, 3, "%02X", table[i].address[j]);
+    }
+    response.beginObject(table[i].label);
+    response.addUnsigned("index", i);
+    response.addString("addr", address);
+    addTemp("temp", table[i].temp_C);
+    response.addUnsigned("res", table[i].resolution);
+    response.addUnsigned("errors", table[i].read_errors);
+    response.endObject();
+  }
+  response.endObject();
+  response.addUnsigned("count", count);
+  response.addString("resolution", temp_resolution_mode == TEMP_RESOLUTION_AUTO ? "auto" : "fixed");
+  response.addUnsigned("budget_ms", temp_budget_ms);
+  response.addUnsigned("conversion_ms", temp_conversion_ms);
+  response.send();
+}
+
+uint32_t oldestSampleSeq() {
+  if (sample_next_seq > SAMPLE_BUFFER_SIZE) {
+    return sample_next_seq - SAMPLE_BUFFER_SIZE;
+  }
+  return 1;
+}
+
+void recordSample() {
+  Sample &sample = sample_buffer[sample_next_seq % SAMPLE_BUFFER_SIZE];
+  sample.seq = sample_next_seq;
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  sample.timestamp_ms = millis();
+  sample.outdoor_temp_C = snapshot.outdoor_temp_C;
+  sample.indoor_temp_C = snapshot.indoor_temp_C;
+  if (snapshot.solar_valid) {
+    sample.voltage_V = INA219Driver::busVoltage_V(snapshot.solar);
+    sample.current_mA = INA219Driver::current_mA(snapshot.solar);
+    sample.power_mW = INA219Driver::power_mW(snapshot.solar);
   } else {
-    Serial.print("\"error\"");
+    sample.voltage_V = NAN;
+    sample.current_mA = NAN;
+    sample.power_mW = NAN;
   }
-  Serial.print(", \"i_temp\": ");
-  if (indoor_temp_C != DEVICE_DISCONNECTED_C) {
-    Serial.print(indoor_temp_C);
+  sample_next_seq++;
+}
+
+void serviceSampling() {
+  if (millis() - last_sample_ms >= sample_period_ms) {
+    last_sample_ms = millis();
+    recordSample();
+  }
+}
+
+void addSolar(const char *name, float value) {
+  if (!isnan(value)) {
+    response.addFloat(name, value);
   } else {
-    Serial.print("\"error\"");
+    response.addError(name);
   }
-  Serial.println(" }");
 }
 
-void printRelayStatus() {
-  int relayStatus = digitalRead(RELAY_PIN);
-  if (relayStatus == HIGH) {
-    Serial.println("{\"sensor\": \"relay\", \"value\": \"ON\"}");
+void printSample(const Sample &sample) {
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_SAMPLE);
+    response.putU32(sample.seq);
+    response.putU32(sample.timestamp_ms);
+    response.putFloat(sample.outdoor_temp_C);
+    response.putFloat(sample.indoor_temp_C);
+    response.putFloat(sample.voltage_V);
+    response.putFloat(sample.current_mA);
+    response.putFloat(sample.power_mW);
+    response.send();
+    return;
+  }
+  response.beginJson();
+  response.addUnsigned("seq", sample.seq);
+  response.addUnsigned("ts_ms", sample.timestamp_ms);
+  addTemp("o_temp", sample.outdoor_temp_C);
+  addTemp("i_temp", sample.indoor_temp_C);
+  addSolar("voltage_V", sample.voltage_V);
+  addSolar("current_mA", sample.current_mA);
+  addSolar("power_mW", sample.power_mW);
+  response.send();
+}
+
+float uplinkTemp(float temp_C) {
+  return temp_C == DEVICE_DISCONNECTED_C ? NAN : temp_C;
+}
+
+void serviceUplink() {
+  if (!uplink_enabled || millis() - last_uplink_ms < uplink_period_ms) {
+    return;
+  }
+  last_uplink_ms = millis();
+  uint32_t first_seq = max(uplink_next_seq, oldestSampleSeq());
+  if (first_seq >= sample_next_seq) {
+    return;
+  }
+  uint32_t count = sample_next_seq - first_seq;
+  uint16_t stride = (count + UPLINK_MAX_ENTRIES - 1) / UPLINK_MAX_ENTRIES;
+
+  UplinkBatch batch;
+  batch.begin((uint32_t)ESP.getEfuseMac(), first_seq, stride, uplink_batch_seq,
+              digitalRead(RELAY_PIN) == HIGH ? UPLINK_FLAG_RELAY_ON : 0);
+  for (uint32_t seq = first_seq; seq < sample_next_seq; seq += stride) {
+    const Sample &sample = sample_buffer[seq % SAMPLE_BUFFER_SIZE];
+    batch.add(sample.timestamp_ms, uplinkTemp(sample.outdoor_temp_C), uplinkTemp(sample.indoor_temp_C),
+              sample.voltage_V, sample.current_mA, sample.power_mW);
+  }
+  // Wi-Fi needs at least 80 MHz while the radio is on, even when the
+  // governor would otherwise idle or sit on a lower fixed clock.
+  governor.acquire(UPLINK_MIN_CPU_MHZ);
+  bool sent = uplink.send(batch.data(), batch.length());
+  governor.release();
+  if (sent) {
+    uplink_next_seq = sample_next_seq;
+    uplink_batch_seq++;
+    uplink_samples_sent += batch.count();
+  }
+}
+
+void dumpSamples(uint32_t since_seq) {
+  governor.acquire();
+  uint32_t first_seq = since_seq + 1;
+  if (first_seq < oldestSampleSeq()) {
+    first_seq = oldestSampleSeq();
+  }
+  uint32_t count = 0;
+  if (first_seq < sample_next_seq) {
+    count = sample_next_seq - first_seq;
+  }
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_DUMP_BEGIN);
+    response.putU32(first_seq);
+    response.putU32(count);
+    response.putU32(millis());
   } else {
-    Serial.println("{\"sensor\": \"relay\", \"value\": \"OFF\"}");
+    response.beginJson();
+    response.addString("dump", "begin");
+    response.addUnsigned("first_seq", first_seq);
+    response.addUnsigned("count", count);
+    response.addUnsigned("now_ms", millis());
   }
+  response.send();
+  for (uint32_t seq = first_seq; seq < first_seq + count; seq++) {
+    tx_queue.waitForSpace(RESPONSE_MAX_BYTES);
+    printSample(sample_buffer[seq % SAMPLE_BUFFER_SIZE]);
+  }
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_DUMP_END);
+    response.putU32(sample_next_seq - 1);
+  } else {
+    response.beginJson();
+    response.addString("dump", "end");
+    response.addUnsigned("last_seq", sample_next_seq - 1);
+  }
+  response.send();
+  governor.release();
+}
+
+void addChannelStats(const char *name, const ChannelStats &stats) {
+  response.beginObject(name);
+  response.addFloat("min", stats.count ? stats.min : NAN);
+  response.addFloat("max", stats.count ? stats.max : NAN);
+  response.addFloat("mean", Aggregator::mean(stats));
+  response.addUnsigned("count", stats.count);
+  response.endObject();
 }
 
-void checkAndControlRelay() {
-  if (!ina219_found || !auto_relay_mode) {
+void printAggWindow(const AggWindow &window) {
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_AGG);
+    response.putU32(window.seq);
+    response.putU32(window.start_ms);
+    response.putU32(window.duration_ms);
+    response.putFloat(window.energy_mWh);
+    for (uint8_t i = 0; i < AGG_CHANNEL_COUNT; i++) {
+      const ChannelStats &stats = window.channels[i];
+      response.putFloat(stats.count ? stats.min : NAN);
+      response.putFloat(stats.count ? stats.max : NAN);
+      response.putFloat(Aggregator::mean(stats));
+      response.putU32(stats.count);
+    }
+    response.send();
     return;
   }
-  
-  setINA219Active();
-  delay(50);
-  float current_power_mW = ina219.getPower_mW();
-  float current_voltage_V = ina219.getBusVoltage_V();
-  setINA219PowerDown();
-
-  int desired_state = last_stable_state;
-
-  if ((current_voltage_V >= voltage_high_on_threshold_V) || ((current_power_mW >= power_on_threshold_mW) && (current_voltage_V > voltage_low_cutoff_V))) {
-    desired_state = HIGH;
-  } else if ((current_power_mW <= power_off_threshold_mW) || (current_voltage_V <= voltage_low_cutoff_V)) {
-    desired_state = LOW;
-  }
-
-  if (desired_state != last_stable_state) {
-    if (debounce_timer_start == 0) {
-      debounce_timer_start = millis();
-    }
-    
-    if (millis() - debounce_timer_start >= debounce_delay_ms) {
-      digitalWrite(RELAY_PIN, desired_state);
-      last_stable_state = desired_state;
-      debounce_timer_start = 0;
-      
-      if (desired_state == HIGH) {
-        Serial.println("{\"relay_event\": \"auto_on\", \"power_mW\": " + String(current_power_mW) + "}");
-      } else {
-        Serial.println("{\"relay_event\": \"auto_off\", \"power_mW\": " + String(current_power_mW) + ", \"voltage_V\": " + String(current_voltage_V) + "}");
-      }
+  response.beginJson();
+  response.addUnsigned("window", window.seq);
+  response.addUnsigned("start_ms", window.start_ms);
+  response.addUnsigned("duration_ms", window.duration_ms);
+  response.addFloat("energy_mWh", window.energy_mWh);
+  addChannelStats("voltage_V", window.channels[AGG_VOLTAGE]);
+  addChannelStats("current_mA", window.channels[AGG_CURRENT]);
+  addChannelStats("power_mW", window.channels[AGG_POWER]);
+  addChannelStats("o_temp", window.channels[AGG_OUTDOOR]);
+  addChannelStats("i_temp", window.channels[AGG_INDOOR]);
+  response.send();
+}
+
+void printAggregates(uint32_t since_seq) {
+  portENTER_CRITICAL(&shared_state_mux);
+  aggregator.service(millis());
+  uint32_t first_seq = since_seq + 1;
+  if (first_seq < aggregator.oldestSeq()) {
+    first_seq = aggregator.oldestSeq();
+  }
+  uint32_t next_seq = aggregator.nextSeq();
+  uint32_t window_ms = aggregator.windowMs();
+  double energy_total_mWh = aggregator.totalEnergy_mWh();
+  portEXIT_CRITICAL(&shared_state_mux);
+  uint32_t count = 0;
+  if (first_seq < next_seq) {
+    count = next_seq - first_seq;
+  }
+
+  response.beginJson();
+  response.addString("agg", "begin");
+  response.addUnsigned("first_seq", first_seq);
+  response.addUnsigned("count", count);
+  response.addUnsigned("window_ms", window_ms);
+  response.addFloat("energy_total_mWh", energy_total_mWh);
+  response.send();
+  for (uint32_t seq = first_seq; seq < next_seq; seq++) {
+    AggWindow window;
+    portENTER_CRITICAL(&shared_state_mux);
+    const AggWindow *closed = aggregator.closed(seq);
+    if (closed) {
+      window = *closed;
+    }
+    portEXIT_CRITICAL(&shared_state_mux);
+    if (closed) {
+      tx_queue.waitForSpace(RESPONSE_MAX_BYTES);
+      printAggWindow(window);
     }
-  } else {
-    debounce_timer_start = 0;
   }
+  response.beginJson();
+  response.addString("agg", "end");
+  response.addUnsigned("last_seq", next_seq - 1);
+  response.send();
 }
 
-void printRelaySettings() {
-  Serial.print("{ \"relay_settings\": { \"mode\": \"");
-  if (auto_relay_mode) {
-    Serial.print("auto");
-  } else {
-    Serial.print("manual");
+uint32_t deviceTimeS() {
+  if (time_synced) {
+    return time_sync_epoch_s + (millis() - time_sync_ms) / 1000;
   }
-  Serial.print("\", \"power_on_threshold_mW\": ");
-  Serial.print(power_on_threshold_mW);
-  Serial.print(", \"power_off_threshold_mW\": ");
-  Serial.print(power_off_threshold_mW);
-  Serial.print(", \"voltage_low_cutoff_V\": ");
-  Serial.print(voltage_low_cutoff_V);
-  Serial.print(", \"voltage_high_on_threshold_V\": ");
-  Serial.print(voltage_high_on_threshold_V);
-  Serial.print(", \"debounce_delay_ms\": ");
-  Serial.print(debounce_delay_ms);
-  Serial.println(" } }");
+  return millis() / 1000;
 }
 
-void setup() {
-  Serial.begin(115200);
-  setCpuFrequencyMhz(80);
-  
-  WiFi.mode(WIFI_OFF);
-  btStop();
+void serviceLogging() {
+  if (!flash_log_ready || millis() - last_log_ms < log_period_ms) {
+    return;
+  }
+  last_log_ms = millis();
+  LogRecord record;
+  memset(&record, 0, sizeof(record));
+  record.ts_s = deviceTimeS();
+  record.synced = time_synced;
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  if (snapshot.outdoor_temp_C != DEVICE_DISCONNECTED_C) {
+    record.flags |= LOG_OUTDOOR_VALID;
+    record.outdoor_cC = lroundf(snapshot.outdoor_temp_C * 100);
+  }
+  if (snapshot.indoor_temp_C != DEVICE_DISCONNECTED_C) {
+    record.flags |= LOG_INDOOR_VALID;
+    record.indoor_cC = lroundf(snapshot.indoor_temp_C * 100);
+  }
+  if (snapshot.solar_valid) {
+    record.flags |= LOG_SOLAR_VALID;
+    record.bus_raw = INA219Driver::busVoltageRaw(snapshot.solar);
+    record.current_raw = snapshot.solar.current;
+    record.power_raw = snapshot.solar.power;
+  }
+  if (digitalRead(RELAY_PIN) == HIGH) {
+    record.flags |= LOG_RELAY_ON;
+  }
+  flash_log.append(record);
+}
 
-  Wire.begin(6, 7);
-  
-  ina219_found = ina219.begin();
-  if (!ina219_found) {
-    Serial.println("Error: INA219 not found!");
+void printLogRecord(const LogRecord &record) {
+  uint32_t ts_s = record.ts_s;
+  bool synced = record.synced;
+  if (!synced && time_synced && record.session == flash_log.session()) {
+    ts_s = time_sync_epoch_s - (time_sync_ms / 1000 - ts_s);
+    synced = true;
   }
+  INA219Raw raw;
+  raw.bus = record.bus_raw << 3;
+  raw.current = record.current_raw;
+  raw.power = record.power_raw;
+  bool solar_valid = record.flags & LOG_SOLAR_VALID;
+  float outdoor_C = (record.flags & LOG_OUTDOOR_VALID) ? record.outdoor_cC * 0.01f : DEVICE_DISCONNECTED_C;
+  float indoor_C = (record.flags & LOG_INDOOR_VALID) ? record.indoor_cC * 0.01f : DEVICE_DISCONNECTED_C;
 
-  sensors.begin();
-  if (sensors.getDeviceCount() < 2) {
-    Serial.println("Error: Not enough DS18B20 sensors found!");
-  } else {
-    const DeviceAddress outdoorAddress = { 0x28, 0x09, 0x8A, 0xC0, 0x00, 0x00, 0x00, 0xC7 };
-    const DeviceAddress indoorAddress = { 0x28, 0x07, 0xBB, 0x83, 0x00, 0x00, 0x00, 0xF5 };
-    
-    memcpy(outdoorThermometer, outdoorAddress, 8);
-    memcpy(indoorThermometer, indoorAddress, 8);
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_LOG);
+    response.putU32(ts_s);
+    response.putU16(record.session);
+    response.putU8(record.flags | (synced ? 0x80 : 0));
+    response.putFloat(outdoor_C);
+    response.putFloat(indoor_C);
+    response.putFloat(solar_valid ? INA219Driver::busVoltage_V(raw) : NAN);
+    response.putFloat(solar_valid ? INA219Driver::current_mA(raw) : NAN);
+    response.putFloat(solar_valid ? INA219Driver::power_mW(raw) : NAN);
+    response.send();
+    return;
+  }
+  response.beginJson();
+  response.addUnsigned("log", ts_s);
+  response.addBool("synced", synced);
+  response.addUnsigned("session", record.session);
+  addTemp("o_temp", outdoor_C);
+  addTemp("i_temp", indoor_C);
+  addSolar("voltage_V", solar_valid ? INA219Driver::busVoltage_V(raw) : NAN);
+  addSolar("current_mA", solar_valid ? INA219Driver::current_mA(raw) : NAN);
+  addSolar("power_mW", solar_valid ? INA219Driver::power_mW(raw) : NAN);
+  response.addString("relay", (record.flags & LOG_RELAY_ON) ? "ON" : "OFF");
+  response.send();
+}
 
-    sensors.setResolution(outdoorThermometer, 10);
-    sensors.setResolution(indoorThermometer, 10);
+void startBackfill(uint32_t from_ts) {
+  response.beginJson();
+  response.addString("backfill", "begin");
+  response.addUnsigned("from_ts", from_ts);
+  response.addUnsigned("now_ts", deviceTimeS());
+  response.addBool("synced", time_synced);
+  response.addUnsigned("session", flash_log.session());
+  response.send();
+  backfill_active = flash_log_ready;
+  backfill_from_ts = from_ts;
+  backfill_count = 0;
+  backfill_request_id = response.requestId();
+  flash_log.startRead();
+  if (!backfill_active) {
+    response.beginJson();
+    response.addString("backfill", "end");
+    response.addUnsigned("count", 0);
+    response.send();
   }
-  
-  pinMode(RELAY_PIN, OUTPUT);
-  digitalWrite(RELAY_PIN, LOW);
-  setINA219PowerDown();
 }
 
-void loop() {
-  if (auto_relay_mode) {
-    checkAndControlRelay();
+void serviceBackfill() {
+  if (!backfill_active) {
+    return;
   }
-  
-  if (Serial.available() > 0) {
-    String command = Serial.readStringUntil('\n');
-    command.trim();
-
-    if (command == "o") {
-      printOutdoorTemp();
-    } else if (command == "i") {
-      printIndoorTemp();
-    } else if (command == "s") {
-      printSolarData();
-    } else if (command == "r") {
-      printRelayStatus();
-    } else if (command == "auto") {
-      auto_relay_mode = true;
-      Serial.println("{\"mode\": \"auto\", \"status\": \"enabled\"}");
-    } else if (command == "manual") {
-      auto_relay_mode = false;
-      Serial.println("{\"mode\": \"manual\", \"status\": \"enabled\"}");
-    } else if (command.startsWith("set_power_on_mW")) {
-      float new_threshold = command.substring(command.indexOf(' ') + 1).toFloat();
-      if (new_threshold > 0) {
-        power_on_threshold_mW = new_threshold;
-        Serial.println("{\"command\": \"set_power_on_mW\", \"value\": " + String(power_on_threshold_mW) + "}");
-      } else {
-        Serial.println("{\"command\": \"set_power_on_mW\", \"status\": \"error\", \"message\": \"invalid value\"}");
-      }
-    } else if (command.startsWith("set_power_off_mW")) {
-      float new_threshold = command.substring(command.indexOf(' ') + 1).toFloat();
-      if (new_threshold > 0) {
-        power_off_threshold_mW = new_threshold;
-        Serial.println("{\"command\": \"set_power_off_mW\", \"value\": " + String(power_off_threshold_mW) + "}");
-      } else {
-        Serial.println("{\"command\": \"set_power_off_mW\", \"status\": \"error\", \"message\": \"invalid value\"}");
-      }
-    } else if (command.startsWith("set_voltage_cutoff_V")) {
-      float new_threshold = command.substring(command.indexOf(' ') + 1).toFloat();
-      if (new_threshold > 0) {
-        voltage_low_cutoff_V = new_threshold;
-        Serial.println("{\"command\": \"set_voltage_cutoff_V\", \"value\": " + String(voltage_low_cutoff_V) + "}");
-      } else {
-        Serial.println("{\"command\": \"set_voltage_cutoff_V\", \"status\": \"error\", \"message\": \"invalid value\"}");
-      }
-    } else if (command.startsWith("set_voltage_high_on_V")) {
-      float new_threshold = command.substring(command.indexOf(' ') + 1).toFloat();
-      if (new_threshold > 0) {
-        voltage_high_on_threshold_V = new_threshold;
-        Serial.println("{\"command\": \"set_voltage_high_on_V\", \"value\": " + String(voltage_high_on_threshold_V) + "}");
-      } else {
-        Serial.println("{\"command\": \"set_voltage_high_on_V\", \"status\": \"error\", \"message\": \"invalid value\"}");
-      }
-    } else if (command.startsWith("set_debounce_ms")) {
-      unsigned long new_delay = command.substring(command.indexOf(' ') + 1).toFloat();
-      if (new_delay > 0) {
-        debounce_delay_ms = new_delay;
-        Serial.println("{\"command\": \"set_debounce_ms\", \"value\": " + String(debounce_delay_ms) + "}");
-      } else {
-        Serial.println("{\"command\": \"set_debounce_ms\", \"status\": \"error\", \"message\": \"invalid value\"}");
-      }
-    } else if (command == "get_settings") {
-      printRelaySettings();
-    } else if (command == "t") {
-      printBothTemps();
-    } else {
-      Serial.println("Invalid command.");
+  // Records go out over later loop passes but still answer the request
+  // that started the backfill.
+  response.setRequestId(backfill_request_id);
+  for (uint8_t i = 0; i < BACKFILL_BATCH && tx_queue.availableForWrite() >= BACKFILL_TX_SPACE; i++) {
+    LogRecord record;
+    if (!flash_log.readNext(record)) {
+      backfill_active = false;
+      response.beginJson();
+      response.addString("backfill", "end");
+      response.addUnsigned("count", backfill_count);
+      response.send();
+      break;
+    }
+    if (record.ts_s >= backfill_from_ts) {
+      printLogRecord(record);
+      backfill_count++;
     }
   }
+  response.setRequestId(RESPONSE_NO_REQUEST_ID);
+}
+
+void printFlashLogStatus() {
+  response.beginJson();
+  response.beginObject("flash_log");
+  response.addBool("ready", flash_log_ready);
+  response.addUnsigned("period_ms", log_period_ms);
+  response.addUnsigned("sectors", flash_log.sectorCount());
+  response.addUnsigned("used_bytes", flash_log.usedBytes());
+  response.addUnsigned("records", flash_log.recordCount());
+  response.addUnsigned("dropped", flash_log.droppedCount());
+  response.addUnsigned("erases", flash_log.eraseCount());
+  response.addUnsigned("session", flash_log.session());
+  response.addBool("time_synced", time_synced);
+  response.addUnsigned("now_ts", deviceTimeS());
+  response.endObject();
+  response.send();
+}
+
+void printRelayStatus() {
+  int relayStatus = digitalRead(RELAY_PIN);
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_RELAY);
+    response.putU8(relayStatus == HIGH ? 1 : 0);
+    response.putU8(auto_relay_mode ? 1 : 0);
+  } else {
+    response.beginJson();
+    response.addString("sensor", "relay");
+    response.addString("value", relayStatus == HIGH ? "ON" : "OFF");
+    response.addString("mode", auto_relay_mode ? "auto" : "manual");
+  }
+  response.send();
+}
+
+// Runs in the control task; reporting and persistence are left to the I/O
+// task so a slow serial link never holds up the relay.
+// The emergency cutoff is a safety trip and runs in manual mode too; only
+// the normal on/off decision is left to the host there.
+void checkAndControlRelay(const INA219Raw &reading) {
+  uint16_t voltage_raw = INA219Driver::busVoltageRaw(reading);
+  portENTER_CRITICAL(&shared_state_mux);
+  bool changed = auto_relay_mode ? relay_controller.update(voltage_raw, reading.power, millis())
+                                 : relay_controller.emergencyTrip(voltage_raw, millis());
+  bool on = relay_controller.isOn();
+  bool fast_trip = relay_controller.lastSwitchWasTrip();
+  if (changed) {
+    digitalWrite(RELAY_PIN, on ? HIGH : LOW);
+  }
+  portEXIT_CRITICAL(&shared_state_mux);
+  if (!changed) {
+    return;
+  }
+
+  RelayEvent event;
+  event.on = on;
+  event.fast_trip = fast_trip;
+  event.power_mW = INA219Driver::power_mW(reading);
+  event.voltage_V = INA219Driver::busVoltage_V(reading);
+  if (xQueueSend(relay_event_queue, &event, 0) != pdTRUE) {
+    relay_event_drops++;
+  }
+}
+
+void serviceRelayEvents(TickType_t wait) {
+  RelayEvent event;
+  while (xQueueReceive(relay_event_queue, &event, wait) == pdTRUE) {
+    wait = 0;
+    persistSettings();
+    response.beginEvent("relay");
+    if (event.on) {
+      response.addString("relay_event", "auto_on");
+      response.addFloat("power_mW", event.power_mW);
+    } else {
+      response.addString("relay_event", event.fast_trip ? "fast_trip" : "auto_off");
+      response.addFloat("power_mW", event.power_mW);
+      response.addFloat("voltage_V", event.voltage_V);
+    }
+    response.send();
+  }
+}
+
+void serviceSolarAcquisition() {
+  if (!ina219_found) {
+    return;
+  }
+  unsigned long now = millis();
+  if (solar_conversion_pending) {
+    unsigned long elapsed_us = micros() - solar_trigger_us;
+    if (elapsed_us < ina219.conversionTimeUs()) {
+      return;
+    }
+    bool ready;
+    CycleSpan span = startCycleSpan();
+    bool ok = ina219.poll(latest_solar, ready);
+    recordCycleSpan(ina219_stats, span);
+    if (ok && ready) {
+      solar_conversion_pending = false;
+      solar_conversion_us = micros() - solar_trigger_us;
+      solar_sample_ms = now;
+      solar_sample_valid = true;
+      if (first_solar_ms == 0) {
+        first_solar_ms = now;
+      }
+      SolarReading reading;
+      reading.raw = latest_solar;
+      reading.span = startCycleSpan();
+      if (xQueueSend(control_queue, &reading, 0) != pdTRUE) {
+        control_queue_drops++;
+      }
+      publishSnapshot();
+      portENTER_CRITICAL(&shared_state_mux);
+      aggregator.addSample(AGG_VOLTAGE, INA219Driver::busVoltage_V(latest_solar), now);
+      aggregator.addSample(AGG_CURRENT, INA219Driver::current_mA(latest_solar), now);
+      aggregator.addPower(INA219Driver::power_mW(latest_solar), now, 2 * solarPeriodMs());
+      portEXIT_CRITICAL(&shared_state_mux);
+    } else if (elapsed_us >= 2 * ina219.conversionTimeUs() + INA219_CONVERSION_MARGIN_US) {
+      solar_conversion_pending = false;
+      portENTER_CRITICAL(&shared_state_mux);
+      aggregator.breakPower();
+      portEXIT_CRITICAL(&shared_state_mux);
+    }
+  } else if (now - solar_tick_ms >= solarPeriodMs()) {
+    solar_tick_ms += solarPeriodMs();
+    if (now - solar_tick_ms >= solarPeriodMs()) {
+      solar_tick_ms = now;
+    }
+    solar_trigger_us = micros();
+    CycleSpan span = startCycleSpan();
+    solar_conversion_pending = ina219.trigger();
+    recordCycleSpan(ina219_stats, span);
+  }
+}
+
+const char *relayFilterName(uint8_t mode) {
+  switch (mode) {
+    case RELAY_FILTER_EMA: return "ema";
+    case RELAY_FILTER_MEDIAN: return "median";
+    default: return "none";
+  }
+}
+
+void printRelaySettings() {
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_SETTINGS);
+    response.putU8(auto_relay_mode ? 1 : 0);
+    response.putFloat(power_on_threshold_mW);
+    response.putFloat(power_off_threshold_mW);
+    response.putFloat(voltage_low_cutoff_V);
+    response.putFloat(voltage_high_on_threshold_V);
+    response.putU32(relay_on_delay_ms);
+    response.putU32(temp_sample_period_ms);
+    response.putU32(sample_period_ms);
+    response.putU32(control_period_ms);
+    response.putU8(ina219.busAdc());
+    response.putU8(ina219.shuntAdc());
+    response.putU32(ina219.conversionTimeUs());
+    response.putU32(agg_window_ms);
+    response.putU32(log_period_ms);
+    response.putU8(temp_resolution_mode);
+    response.putU32(temp_budget_ms);
+    response.putU32(relay_off_delay_ms);
+    response.putFloat(voltage_emergency_cutoff_V);
+    response.putU8(relay_filter_mode);
+    response.putU8(relay_filter_depth);
+    response.send();
+    return;
+  }
+  response.beginJson();
+  response.beginObject("relay_settings");
+  response.addString("mode", auto_relay_mode ? "auto" : "manual");
+  response.addFloat("power_on_threshold_mW", power_on_threshold_mW);
+  response.addFloat("power_off_threshold_mW", power_off_threshold_mW);
+  response.addFloat("voltage_low_cutoff_V", voltage_low_cutoff_V);
+  response.addFloat("voltage_high_on_threshold_V", voltage_high_on_threshold_V);
+  response.addFloat("voltage_emergency_cutoff_V", voltage_emergency_cutoff_V);
+  response.addUnsigned("on_delay_ms", relay_on_delay_ms);
+  response.addUnsigned("off_delay_ms", relay_off_delay_ms);
+  response.addString("relay_filter", relayFilterName(relay_filter_mode));
+  response.addUnsigned("filter_depth", relay_filter_depth);
+  response.addUnsigned("temp_period_ms", temp_sample_period_ms);
+  response.addUnsigned("sample_period_ms", sample_period_ms);
+  response.addUnsigned("control_period_ms", control_period_ms);
+  response.addString("ina_bus_adc", INA219Driver::adcModeName(ina219.busAdc()));
+  response.addString("ina_shunt_adc", INA219Driver::adcModeName(ina219.shuntAdc()));
+  response.addUnsigned("ina_conversion_us", ina219.conversionTimeUs());
+  response.addUnsigned("agg_window_ms", agg_window_ms);
+  response.addUnsigned("log_period_ms", log_period_ms);
+  if (temp_resolution_mode == TEMP_RESOLUTION_AUTO) {
+    response.addString("temp_resolution", "auto");
+  } else {
+    response.addUnsigned("temp_resolution", temp_resolution_mode);
+  }
+  response.addUnsigned("temp_budget_ms", temp_budget_ms);
+  response.endObject();
+  response.send();
+}
+
+// Every channel, the relay and its thresholds in one reply, all taken from
+// the acquisition snapshot so nothing touches the sensors.
+void printAll() {
+  unsigned long now = millis();
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  bool relay_on = digitalRead(RELAY_PIN) == HIGH;
+  float voltage_V = snapshot.solar_valid ? INA219Driver::busVoltage_V(snapshot.solar) : NAN;
+  float current_mA = snapshot.solar_valid ? INA219Driver::current_mA(snapshot.solar) : NAN;
+  float power_mW = snapshot.solar_valid ? INA219Driver::power_mW(snapshot.solar) : NAN;
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_ALL);
+    response.putU32(now);
+    response.putFloat(snapshot.outdoor_temp_C);
+    response.putFloat(snapshot.indoor_temp_C);
+    response.putU32(snapshot.temp_valid ? now - snapshot.temp_ms : 0xFFFFFFFF);
+    response.putFloat(voltage_V);
+    response.putFloat(current_mA);
+    response.putFloat(power_mW);
+    response.putU32(snapshot.solar_valid ? now - snapshot.solar_ms : 0xFFFFFFFF);
+    response.putU8(relay_on ? 1 : 0);
+    response.putU8(auto_relay_mode ? 1 : 0);
+    response.putFloat(power_on_threshold_mW);
+    response.putFloat(power_off_threshold_mW);
+    response.putFloat(voltage_low_cutoff_V);
+    response.putFloat(voltage_high_on_threshold_V);
+    response.putU32(relay_on_delay_ms);
+    response.putU32(relay_off_delay_ms);
+    response.putFloat(voltage_emergency_cutoff_V);
+    response.send();
+    return;
+  }
+  response.beginJson();
+  response.addUnsigned("ts_ms", now);
+  addTemp("o_temp", snapshot.outdoor_temp_C);
+  addTemp("i_temp", snapshot.indoor_temp_C);
+  if (snapshot.temp_valid) {
+    response.addUnsigned("temp_age_ms", now - snapshot.temp_ms);
+  }
+  addSolar("voltage_V", voltage_V);
+  addSolar("current_mA", current_mA);
+  addSolar("power_mW", power_mW);
+  if (snapshot.solar_valid) {
+    response.addUnsigned("solar_age_ms", now - snapshot.solar_ms);
+  }
+  response.addString("relay", relay_on ? "ON" : "OFF");
+  response.addString("mode", auto_relay_mode ? "auto" : "manual");
+  response.addFloat("power_on_threshold_mW", power_on_threshold_mW);
+  response.addFloat("power_off_threshold_mW", power_off_threshold_mW);
+  response.addFloat("voltage_low_cutoff_V", voltage_low_cutoff_V);
+  response.addFloat("voltage_high_on_threshold_V", voltage_high_on_threshold_V);
+  response.addUnsigned("on_delay_ms", relay_on_delay_ms);
+  response.addUnsigned("off_delay_ms", relay_off_delay_ms);
+  response.addFloat("voltage_emergency_cutoff_V", voltage_emergency_cutoff_V);
+  response.send();
+}
+
+void emitStreamSample() {
+  unsigned long now = millis();
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  bool solar_valid = snapshot.solar_valid;
+  stream_seq++;
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_STREAM);
+    response.putU32(stream_seq);
+    response.putU32(now);
+    response.putU8(stream_channels);
+    if (stream_channels & STREAM_CHANNEL_OUTDOOR) {
+      response.putFloat(snapshot.outdoor_temp_C);
+    }
+    if (stream_channels & STREAM_CHANNEL_INDOOR) {
+      response.putFloat(snapshot.indoor_temp_C);
+    }
+    if (stream_channels & STREAM_CHANNEL_SOLAR) {
+      response.putFloat(solar_valid ? INA219Driver::busVoltage_V(snapshot.solar) : NAN);
+      response.putFloat(solar_valid ? INA219Driver::current_mA(snapshot.solar) : NAN);
+      response.putFloat(solar_valid ? INA219Driver::power_mW(snapshot.solar) : NAN);
+    }
+    if (stream_channels & STREAM_CHANNEL_RELAY) {
+      response.putU8(digitalRead(RELAY_PIN) == HIGH ? 1 : 0);
+    }
+    response.send();
+    return;
+  }
+  response.beginEvent("stream");
+  response.addUnsigned("stream", stream_seq);
+  response.addUnsigned("ts_ms", now);
+  if (stream_channels & STREAM_CHANNEL_OUTDOOR) {
+    addTemp("o_temp", snapshot.outdoor_temp_C);
+  }
+  if (stream_channels & STREAM_CHANNEL_INDOOR) {
+    addTemp("i_temp", snapshot.indoor_temp_C);
+  }
+  if (stream_channels & STREAM_CHANNEL_SOLAR) {
+    addSolar("voltage_V", solar_valid ? INA219Driver::busVoltage_V(snapshot.solar) : NAN);
+    addSolar("current_mA", solar_valid ? INA219Driver::current_mA(snapshot.solar) : NAN);
+    addSolar("power_mW", solar_valid ? INA219Driver::power_mW(snapshot.solar) : NAN);
+  }
+  if (stream_channels & STREAM_CHANNEL_RELAY) {
+    response.addString("relay", digitalRead(RELAY_PIN) == HIGH ? "ON" : "OFF");
+  }
+  response.send();
+}
+
+void serviceStreaming() {
+  if (!streaming) {
+    return;
+  }
+  unsigned long now = millis();
+  if (now - stream_tick_ms >= stream_period_ms) {
+    stream_tick_ms += stream_period_ms;
+    if (now - stream_tick_ms >= stream_period_ms) {
+      stream_tick_ms = now;
+    }
+    emitStreamSample();
+  }
+}
+
+void emitReport(uint8_t changed, const SensorSnapshot &snapshot) {
+  bool solar_valid = snapshot.solar_valid;
+  float voltage_V = solar_valid ? INA219Driver::busVoltage_V(snapshot.solar) : NAN;
+  float current_mA = solar_valid ? INA219Driver::current_mA(snapshot.solar) : NAN;
+  float power_mW = solar_valid ? INA219Driver::power_mW(snapshot.solar) : NAN;
+  report_seq++;
+  if (response.isBinary()) {
+    response.beginFrame(FRAME_REPORT);
+    response.putU32(report_seq);
+    response.putU32(millis());
+    response.putU8(changed);
+    response.putFloat(snapshot.outdoor_temp_C);
+    response.putFloat(snapshot.indoor_temp_C);
+    response.putFloat(voltage_V);
+    response.putFloat(current_mA);
+    response.putFloat(power_mW);
+    response.send();
+    return;
+  }
+  response.beginEvent("report");
+  response.addUnsigned("report", report_seq);
+  response.addUnsigned("ts_ms", millis());
+  response.addUnsigned("changed", changed);
+  addTemp("o_temp", snapshot.outdoor_temp_C);
+  addTemp("i_temp", snapshot.indoor_temp_C);
+  addSolar("voltage_V", voltage_V);
+  addSolar("current_mA", current_mA);
+  addSolar("power_mW", power_mW);
+  response.send();
+}
+
+void serviceReporting() {
+  uint32_t version = sensor_snapshot.version();
+  if (!reporting || version == report_snapshot_version) {
+    return;
+  }
+  report_snapshot_version = version;
+  SensorSnapshot snapshot = sensor_snapshot.read();
+  bool solar_valid = snapshot.solar_valid;
+  ReportSample sample;
+  sample.outdoor_C = uplinkTemp(snapshot.outdoor_temp_C);
+  sample.indoor_C = uplinkTemp(snapshot.indoor_temp_C);
+  sample.voltage_mV = solar_valid ? INA219Driver::busVoltage_V(snapshot.solar) * 1000.0f : NAN;
+  sample.current_mA = solar_valid ? INA219Driver::current_mA(snapshot.solar) : NAN;
+  sample.power_mW = solar_valid ? INA219Driver::power_mW(snapshot.solar) : NAN;
+  uint8_t changed = report_filter.update(sample, millis());
+  if (changed) {
+    emitReport(changed, snapshot);
+  }
+}
+
+#define RX_LINE_MAX 96
+
+char rx_line[RX_LINE_MAX];
+size_t rx_length = 0;
+bool rx_overflow = false;
+
+bool parseLabel(const char *text, CommandArg &arg) {
+  char *end;
+  unsigned long index = strtoul(text, &end, 10);
+  if (end == text || *end != ' ' || index >= thermometer_count) {
+    return false;
+  }
+  while (*end == ' ') {
+    end++;
+  }
+  size_t length = strlen(end);
+  if (length == 0 || length >= THERMOMETER_LABEL_MAX) {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++) {
+    if (!isalnum((unsigned char)end[i]) && end[i] != '_' && end[i] != '-') {
+      return false;
+    }
+  }
+  int8_t existing = findThermometer(end);
+  if (existing >= 0 && existing != (int8_t)index) {
+    return false;
+  }
+  arg.label.index = index;
+  memcpy(arg.label.name, end, length + 1);
+  return true;
+}
+
+bool parseTempResolution(const char *text, CommandArg &arg) {
+  if (strcmp(text, "auto") == 0) {
+    arg.u = TEMP_RESOLUTION_AUTO;
+    return true;
+  }
+  char *end;
+  arg.u = strtoul(text, &end, 10);
+  return end != text && *end == '\0' && arg.u >= DS18B20_MIN_RESOLUTION && arg.u <= DS18B20_MAX_RESOLUTION;
+}
+
+bool parseBaud(const char *text, CommandArg &arg) {
+  static const unsigned long rates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600 };
+  char *end;
+  arg.u = strtoul(text, &end, 10);
+  if (end == text || *end != '\0') {
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+    if (arg.u == rates[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parseTxPolicy(const char *text, CommandArg &arg) {
+  if (strcmp(text, "drop") == 0) {
+    arg.u = TX_POLICY_DROP_OLDEST;
+  } else if (strcmp(text, "block") == 0) {
+    arg.u = TX_POLICY_BLOCK;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// "none", "ema <shift>" (alpha = 1/2^shift) or "median <window>".
+bool parseRelayFilter(const char *text, CommandArg &arg) {
+  if (strcmp(text, "none") == 0) {
+    arg.codes[0] = RELAY_FILTER_NONE;
+    arg.codes[1] = 0;
+    return true;
+  }
+  char *end;
+  unsigned long depth;
+  if (strncmp(text, "ema ", 4) == 0) {
+    arg.codes[0] = RELAY_FILTER_EMA;
+    depth = strtoul(text + 4, &end, 10);
+    if (end == text + 4 || *end != '\0' || depth < 1 || depth > RELAY_EMA_MAX_SHIFT) {
+      return false;
+    }
+  } else if (strncmp(text, "median ", 7) == 0) {
+    arg.codes[0] = RELAY_FILTER_MEDIAN;
+    depth = strtoul(text + 7, &end, 10);
+    if (end == text + 7 || *end != '\0' || depth < 1 || depth > RELAY_MEDIAN_MAX) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+  arg.codes[1] = depth;
+  return true;
+}
+
+bool parseUplinkPeer(const char *text, CommandArg &arg) {
+  unsigned int mac[6];
+  unsigned int channel = 1;
+  int fields = sscanf(text, "%2x:%2x:%2x:%2x:%2x:%2x %u", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &channel);
+  if (fields < 6 || channel < 1 || channel > 13) {
+    return false;
+  }
+  for (uint8_t i = 0; i < 6; i++) {
+    arg.peer.mac[i] = mac[i];
+  }
+  arg.peer.channel = channel;
+  return true;
+}
+
+bool parseCpuMode(const char *text, CommandArg &arg) {
+  if (strcmp(text, "auto") == 0) {
+    arg.u = 0;
+    return true;
+  }
+  char *end;
+  arg.u = strtoul(text, &end, 10);
+  return end != text && *end == '\0' && CpuGovernor::isSupported(arg.u);
+}
+
+bool parseStream(const char *text, CommandArg &arg) {
+  char *end;
+  arg.stream.period_ms = strtoul(text, &end, 10);
+  if (end == text || arg.stream.period_ms < STREAM_MIN_PERIOD_MS) {
+    return false;
+  }
+  while (*end == ' ') {
+    end++;
+  }
+  arg.stream.channels = 0;
+  if (*end == '\0' || strcmp(end, "all") == 0) {
+    arg.stream.channels = STREAM_CHANNEL_ALL;
+    return true;
+  }
+  for (const char *p = end; *p; p++) {
+    switch (*p) {
+      case 'o': arg.stream.channels |= STREAM_CHANNEL_OUTDOOR; break;
+      case 'i': arg.stream.channels |= STREAM_CHANNEL_INDOOR; break;
+      case 't': arg.stream.channels |= STREAM_CHANNEL_OUTDOOR | STREAM_CHANNEL_INDOOR; break;
+      case 's': arg.stream.channels |= STREAM_CHANNEL_SOLAR; break;
+      case 'r': arg.stream.channels |= STREAM_CHANNEL_RELAY; break;
+      case ',': break;
+      default: return false;
+    }
+  }
+  return arg.stream.channels != 0;
+}
+
+bool parseAdcModes(const char *text, CommandArg &arg) {
+  char bus_name[8];
+  char shunt_name[8];
+  char extra;
+  return sscanf(text, "%7s %7s %c", bus_name, shunt_name, &extra) == 2 &&
+         INA219Driver::adcModeFromName(bus_name, arg.codes[0]) &&
+         INA219Driver::adcModeFromName(shunt_name, arg.codes[1]);
+}
+
+void sendFloatAck(const char *name, float value) {
+  response.beginJson();
+  response.addString("command", name);
+  response.addFloat("value", value);
+  response.send();
+}
+
+void sendUnsignedAck(const char *name, uint32_t value) {
+  response.beginJson();
+  response.addString("command", name);
+  response.addUnsigned("value", value);
+  response.send();
+}
+
+void sendCommandError(const char *name) {
+  response.beginJson();
+  response.addString("command", name);
+  response.addString("status", "error");
+  response.addString("message", "invalid value");
+  response.send();
+}
+
+void sendModeAck(const char *mode) {
+  response.beginJson();
+  response.addString("mode", mode);
+  response.addString("status", "enabled");
+  response.send();
+}
+
+// Settings accepted by "set key=value ...". Each value goes through the
+// same parser as the matching set_* command.
+struct SettingField {
+  const char *key;
+  ArgParser parse;
+  float *float_value;
+  unsigned long *unsigned_value;
+};
+
+const SettingField setting_fields[] = {
+  { "power_on_mW", parsePositiveFloat, &power_on_threshold_mW, NULL },
+  { "power_off_mW", parsePositiveFloat, &power_off_threshold_mW, NULL },
+  { "voltage_cutoff_V", parsePositiveFloat, &voltage_low_cutoff_V, NULL },
+  { "voltage_high_on_V", parsePositiveFloat, &voltage_high_on_threshold_V, NULL },
+  { "voltage_emergency_V", parsePositiveFloat, &voltage_emergency_cutoff_V, NULL },
+  { "on_delay_ms", parsePositiveUnsigned, NULL, &relay_on_delay_ms },
+  { "off_delay_ms", parsePositiveUnsigned, NULL, &relay_off_delay_ms },
+  { "temp_period_ms", parsePositiveUnsigned, NULL, &temp_sample_period_ms },
+  { "sample_period_ms", parsePositiveUnsigned, NULL, &sample_period_ms },
+  { "control_period_ms", parsePositiveUnsigned, NULL, &control_period_ms },
+  { "agg_window_ms", parsePositiveUnsigned, NULL, &agg_window_ms },
+  { "log_period_ms", parsePositiveUnsigned, NULL, &log_period_ms },
+  { "temp_budget_ms", parsePositiveUnsigned, NULL, &temp_budget_ms },
+  { "db_temp_C", parsePositiveFloat, &report_temp_deadband_C, NULL },
+  { "db_voltage_mV", parsePositiveFloat, &report_voltage_deadband_mV, NULL },
+  { "db_current_mA", parsePositiveFloat, &report_current_deadband_mA, NULL },
+  { "db_power_mW", parsePositiveFloat, &report_power_deadband_mW, NULL },
+  { "heartbeat_ms", parsePositiveUnsigned, NULL, &report_heartbeat_ms },
+};
+
+#define SETTING_FIELD_COUNT (sizeof(setting_fields) / sizeof(setting_fields[0]))
+#define SETTING_TEXT_MAX 16
+
+void sendSettingError(const char *key, const char *message) {
+  response.beginJson();
+  response.addString("command", "set");
+  response.addString("status", "error");
+  response.addString("message", message);
+  if (key) {
+    response.addString("key", key);
+  }
+  response.send();
+}
+
+int8_t findSettingField(const char *key, size_t length) {
+  for (uint8_t i = 0; i < SETTING_FIELD_COUNT; i++) {
+    if (strlen(setting_fields[i].key) == length && strncmp(setting_fields[i].key, key, length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void stageSettings(CommandArg *staged) {
+  for (uint8_t i = 0; i < SETTING_FIELD_COUNT; i++) {
+    if (setting_fields[i].float_value) {
+      staged[i].f = *setting_fields[i].float_value;
+    } else {
+      staged[i].u = *setting_fields[i].unsigned_value;
+    }
+  }
+}
+
+// Thresholds that must stay ordered: low below high, or at most equal to it
+// for the power hysteresis.
+struct ThresholdPair {
+  const char *low;
+  const char *high;
+  bool allow_equal;
+};
+
+const ThresholdPair threshold_pairs[] = {
+  { "power_off_mW", "power_on_mW", true },
+  { "voltage_cutoff_V", "voltage_high_on_V", false },
+  { "voltage_emergency_V", "voltage_cutoff_V", false },
+};
+
+// Only pairs with a changed side are checked, so a command that leaves the
+// thresholds alone is not rejected because of values stored earlier.
+const ThresholdPair *findInconsistentPair(const CommandArg *staged, const bool *present) {
+  for (const ThresholdPair &pair : threshold_pairs) {
+    int8_t low = findSettingField(pair.low, strlen(pair.low));
+    int8_t high = findSettingField(pair.high, strlen(pair.high));
+    if (!present[low] && !present[high]) {
+      continue;
+    }
+    float low_value = staged[low].f;
+    float high_value = staged[high].f;
+    if (pair.allow_equal ? low_value > high_value : low_value >= high_value) {
+      return &pair;
+    }
+  }
+  return NULL;
+}
+
+void sendThresholdError(const char *command, const ThresholdPair &pair) {
+  response.beginJson();
+  response.addString("command", command);
+  response.addString("status", "error");
+  response.addString("message", "inconsistent thresholds");
+  response.addString("low", pair.low);
+  response.addString("high", pair.high);
+  response.send();
+}
+
+// Single-key threshold setters go through the same ordering check as "set".
+bool applyThreshold(const char *command, const char *key, float value) {
+  CommandArg staged[SETTING_FIELD_COUNT];
+  bool present[SETTING_FIELD_COUNT] = {};
+  stageSettings(staged);
+  int8_t field = findSettingField(key, strlen(key));
+  staged[field].f = value;
+  present[field] = true;
+  const ThresholdPair *pair = findInconsistentPair(staged, present);
+  if (pair) {
+    sendThresholdError(command, *pair);
+    return false;
+  }
+  *setting_fields[field].float_value = value;
+  updateRawThresholds();
+  sendFloatAck(command, value);
+  return true;
+}
+
+void setRelayManual(bool on) {
+  portENTER_CRITICAL(&shared_state_mux);
+  auto_relay_mode = false;
+  relay_controller.setState(on, millis());
+  digitalWrite(RELAY_PIN, on ? HIGH : LOW);
+  portEXIT_CRITICAL(&shared_state_mux);
+}
+
+void handleOutdoorTemp(const CommandArg &arg) {
+  printOutdoorTemp();
+}
+
+void handleIndoorTemp(const CommandArg &arg) {
+  printIndoorTemp();
+}
+
+void handleBothTemps(const CommandArg &arg) {
+  printBothTemps();
+}
+
+void handleAllTemps(const CommandArg &arg) {
+  printAllTemps();
+}
+
+void handleSensors(const CommandArg &arg) {
+  printSensorTable();
+}
+
+void handleDiscover(const CommandArg &arg) {
+  xSemaphoreTake(onewire_mutex, portMAX_DELAY);
+  discoverSensors();
+  configureThermometers();
+  startTemperatureConversion();
+  xSemaphoreGive(onewire_mutex);
+  printSensorTable();
+}
+
+void handleLabel(const CommandArg &arg) {
+  xSemaphoreTake(onewire_mutex, portMAX_DELAY);
+  memcpy(thermometers[arg.label.index].label, arg.label.name, THERMOMETER_LABEL_MAX);
+  updateThermometerRoles();
+  saveSensorTable();
+  xSemaphoreGive(onewire_mutex);
+  response.beginJson();
+  response.addString("command", "label");
+  response.addUnsigned("index", arg.label.index);
+  response.addString("value", arg.label.name);
+  response.send();
+}
+
+void handleSolar(const CommandArg &arg) {
+  printSolarData();
+}
+
+void handleRelayStatus(const CommandArg &arg) {
+  printRelayStatus();
+}
+
+// Switching by hand leaves auto mode so the controller does not undo it;
+// "auto" later resumes from the current state with fresh on/off delays.
+void handleRelayOn(const CommandArg &arg) {
+  setRelayManual(true);
+  printRelayStatus();
+}
+
+void handleRelayOff(const CommandArg &arg) {
+  setRelayManual(false);
+  printRelayStatus();
+}
+
+// Auto mode picks up from whatever the relay is doing now, with an empty
+// filter and no half-finished on/off delay left over from before.
+void handleAuto(const CommandArg &arg) {
+  portENTER_CRITICAL(&shared_state_mux);
+  relay_controller.setState(digitalRead(RELAY_PIN) == HIGH, millis());
+  relay_controller.resetFilter();
+  auto_relay_mode = true;
+  portEXIT_CRITICAL(&shared_state_mux);
+  sendModeAck("auto");
+}
+
+void handleManual(const CommandArg &arg) {
+  portENTER_CRITICAL(&shared_state_mux);
+  auto_relay_mode = false;
+  portEXIT_CRITICAL(&shared_state_mux);
+  sendModeAck("manual");
+}
+
+void handleSetPowerOn(const CommandArg &arg) {
+  applyThreshold("set_power_on_mW", "power_on_mW", arg.f);
+}
+
+void handleSetPowerOff(const CommandArg &arg) {
+  applyThreshold("set_power_off_mW", "power_off_mW", arg.f);
+}
+
+void handleSetVoltageCutoff(const CommandArg &arg) {
+  applyThreshold("set_voltage_cutoff_V", "voltage_cutoff_V", arg.f);
+}
+
+void handleSetVoltageHighOn(const CommandArg &arg) {
+  applyThreshold("set_voltage_high_on_V", "voltage_high_on_V", arg.f);
+}
+
+// Kept from before the separate delays: sets both of them.
+void handleSetDebounce(const CommandArg &arg) {
+  relay_on_delay_ms = arg.u;
+  relay_off_delay_ms = arg.u;
+  updateRawThresholds();
+  sendUnsignedAck("set_debounce_ms", arg.u);
+}
+
+void handleRelayFilter(const CommandArg &arg) {
+  relay_filter_mode = arg.codes[0];
+  relay_filter_depth = arg.codes[1];
+  updateRawThresholds();
+  printRelaySettings();
+}
+
+// Stages every key=value pair and applies them only if all of them parse
+// and the threshold pairs they touch stay consistent.
+void handleSet(const CommandArg &arg) {
+  CommandArg staged[SETTING_FIELD_COUNT];
+  bool present[SETTING_FIELD_COUNT] = {};
+  stageSettings(staged);
+
+  const char *cursor = arg.text;
+  while (*cursor) {
+    const char *end = strchr(cursor, ' ');
+    size_t length = end ? end - cursor : strlen(cursor);
+    const char *equals = (const char *)memchr(cursor, '=', length);
+    int8_t field = equals ? findSettingField(cursor, equals - cursor) : -1;
+    if (field < 0) {
+      char key[SETTING_TEXT_MAX];
+      size_t key_length = min((size_t)(equals ? equals - cursor : length), sizeof(key) - 1);
+      memcpy(key, cursor, key_length);
+      key[key_length] = '\0';
+      sendSettingError(key, "unknown key");
+      return;
+    }
+    char value[SETTING_TEXT_MAX];
+    size_t value_length = length - (equals - cursor) - 1;
+    if (value_length >= sizeof(value)) {
+      sendSettingError(setting_fields[field].key, "invalid value");
+      return;
+    }
+    memcpy(value, equals + 1, value_length);
+    value[value_length] = '\0';
+    if (!setting_fields[field].parse(value, staged[field])) {
+      sendSettingError(setting_fields[field].key, "invalid value");
+      return;
+    }
+    present[field] = true;
+    cursor += length;
+    while (*cursor == ' ') {
+      cursor++;
+    }
+  }
+
+  const ThresholdPair *pair = findInconsistentPair(staged, present);
+  if (pair) {
+    sendThresholdError("set", *pair);
+    return;
+  }
+  int8_t budget = findSettingField("temp_budget_ms", strlen("temp_budget_ms"));
+  if (present[budget] && staged[budget].u < conversionMsFor(DS18B20_MIN_RESOLUTION)) {
+    sendSettingError("temp_budget_ms", "invalid value");
+    return;
+  }
+
+  for (uint8_t i = 0; i < SETTING_FIELD_COUNT; i++) {
+    if (!present[i]) {
+      continue;
+    }
+    if (setting_fields[i].float_value) {
+      *setting_fields[i].float_value = staged[i].f;
+    } else {
+      *setting_fields[i].unsigned_value = staged[i].u;
+    }
+  }
+  updateRawThresholds();
+  updateReportDeadbands();
+  portENTER_CRITICAL(&shared_state_mux);
+  if (aggregator.windowMs() != agg_window_ms) {
+    aggregator.setWindow(agg_window_ms, millis());
+  }
+  portEXIT_CRITICAL(&shared_state_mux);
+  xTaskNotifyGive(acquisition_task);
+  printRelaySettings();
+}
+
+void handleSetTempPeriod(const CommandArg &arg) {
+  temp_sample_period_ms = arg.u;
+  xTaskNotifyGive(acquisition_task);
+  sendUnsignedAck("set_temp_period_ms", temp_sample_period_ms);
+}
+
+void handleTempResolution(const CommandArg &arg) {
+  xSemaphoreTake(onewire_mutex, portMAX_DELAY);
+  temp_resolution_mode = arg.u;
+  // A fixed resolution goes straight to the probes; the adaptive rate
+  // history is left for the next reading rather than rewritten here.
+  for (uint8_t i = 0; i < thermometer_count; i++) {
+    if (temp_resolution_mode == TEMP_RESOLUTION_AUTO) {
+      thermometers[i].stable_cycles = 0;
+    } else {
+      thermometers[i].target_resolution = min(temp_resolution_mode, budgetResolution());
+    }
+  }
+  if (!temp_conversion_pending) {
+    applyThermometerResolutions();
+  }
+  xSemaphoreGive(onewire_mutex);
+  printSensorTable();
+}
+
+void handleSetTempBudget(const CommandArg &arg) {
+  if (arg.u < conversionMsFor(DS18B20_MIN_RESOLUTION)) {
+    sendCommandError("set_temp_budget_ms");
+    return;
+  }
+  temp_budget_ms = arg.u;
+  sendUnsignedAck("set_temp_budget_ms", temp_budget_ms);
+}
+
+void handleSetSamplePeriod(const CommandArg &arg) {
+  sample_period_ms = arg.u;
+  sendUnsignedAck("set_sample_period_ms", sample_period_ms);
+}
+
+void handleSetControlPeriod(const CommandArg &arg) {
+  control_period_ms = arg.u;
+  xTaskNotifyGive(acquisition_task);
+  sendUnsignedAck("set_control_period_ms", control_period_ms);
+}
+
+void handleSetAggWindow(const CommandArg &arg) {
+  agg_window_ms = arg.u;
+  portENTER_CRITICAL(&shared_state_mux);
+  aggregator.setWindow(agg_window_ms, millis());
+  portEXIT_CRITICAL(&shared_state_mux);
+  sendUnsignedAck("set_agg_window_ms", agg_window_ms);
+}
+
+void handleSetLogPeriod(const CommandArg &arg) {
+  log_period_ms = arg.u;
+  sendUnsignedAck("set_log_period_ms", log_period_ms);
+}
+
+void handleSetInaAdc(const CommandArg &arg) {
+  xSemaphoreTake(i2c_mutex, portMAX_DELAY);
+  ina219.setAdcModes(arg.codes[0], arg.codes[1]);
+  xSemaphoreGive(i2c_mutex);
+  response.beginJson();
+  response.addString("command", "set_ina_adc");
+  response.addString("bus", INA219Driver::adcModeName(ina219.busAdc()));
+  response.addString("shunt", INA219Driver::adcModeName(ina219.shuntAdc()));
+  response.addUnsigned("conversion_us", ina219.conversionTimeUs());
+  response.send();
+}
+
+void printPowerStatus() {
+  response.beginJson();
+  response.beginObject("power");
+  response.addBool("light_sleep", light_sleep_enabled);
+  response.addUnsigned("cpu_mhz", getCpuFrequencyMhz());
+  response.addString("governor", governor.isAuto() ? "auto" : "fixed");
+  response.addUnsigned("cpu_idle_mhz", governor.idleMhz());
+  response.addUnsigned("cpu_busy_mhz", governor.busyMhz());
+  response.addUnsigned("cpu_switches", governor.switchCount());
+  response.beginObject("mhz_ms");
+  for (uint8_t i = 0; i < GOVERNOR_FREQ_COUNT; i++) {
+    char name[4];
+    snprintf(name, sizeof(name), "%lu", (unsigned long)CpuGovernor::frequencyAt(i));
+    response.addUnsigned(name, governor.millisAt(i));
+  }
+  response.endObject();
+  response.addUnsigned("sleeps", light_sleep_count);
+  response.addUnsigned("uart_wakes", uart_wake_count);
+  response.addUnsigned("sleep_ms", light_sleep_total_us / 1000);
+  response.addUnsigned("awake_ms", millis() - light_sleep_total_us / 1000);
+  response.addUnsigned("wake_latency_us", wake_latency_us);
+  response.addUnsigned("wake_latency_max_us", wake_latency_max_us);
+  response.endObject();
+  response.send();
+}
+
+void addHistogram(const char *name, const Histogram &histogram) {
+  response.beginObject(name);
+  response.addUnsigned("count", histogram.count());
+  response.addUnsigned("min", histogram.min());
+  response.addUnsigned("mean", histogram.mean());
+  response.addUnsigned("p99", histogram.percentile(STATS_PERCENTILE));
+  response.addUnsigned("max", histogram.max());
+  response.endObject();
+}
+
+void printUplinkStatus() {
+  const uint8_t *peer = uplink.peer();
+  char mac[18];
+  snprintf(mac, sizeof(mac), "%02X:%02X:%02X:%02X:%02X:%02X", peer[0], peer[1], peer[2], peer[3], peer[4], peer[5]);
+  response.beginJson();
+  response.beginObject("uplink");
+  response.addBool("enabled", uplink_enabled);
+  response.addString("transport", "espnow");
+  response.addString("peer", mac);
+  response.addUnsigned("channel", uplink.channel());
+  response.addUnsigned("period_ms", uplink_period_ms);
+  response.addUnsigned("max_entries", UPLINK_MAX_ENTRIES);
+  response.addUnsigned("bursts", uplink.burstCount());
+  response.addUnsigned("failures", uplink.failureCount());
+  response.addUnsigned("bytes", uplink.bytesSent());
+  response.addUnsigned("samples", uplink_samples_sent);
+  response.addFloat("bytes_per_sample", uplink_samples_sent ? (float)uplink.bytesSent() / uplink_samples_sent : 0);
+  response.addUnsigned("radio_on_ms", uplink.radioOnTotalUs() / 1000);
+  addHistogram("radio_on_us", uplink.radioOnStats());
+  addHistogram("airtime_us", uplink.airtimeStats());
+  response.endObject();
+  response.send();
+}
+
+void printReportStatus() {
+  response.beginJson();
+  response.beginObject("report");
+  response.addBool("enabled", reporting);
+  response.addFloat("temp_deadband_C", report_temp_deadband_C);
+  response.addFloat("voltage_deadband_mV", report_voltage_deadband_mV);
+  response.addFloat("current_deadband_mA", report_current_deadband_mA);
+  response.addFloat("power_deadband_mW", report_power_deadband_mW);
+  response.addUnsigned("heartbeat_ms", report_heartbeat_ms);
+  response.addUnsigned("emitted", report_filter.emittedCount());
+  response.addUnsigned("suppressed", report_filter.suppressedCount());
+  response.addUnsigned("heartbeats", report_filter.heartbeatCount());
+  response.endObject();
+  response.send();
+}
+
+void printStats() {
+  response.beginJson();
+  response.beginObject("stats");
+  response.addUnsigned("window_ms", millis() - stats_reset_ms);
+  addHistogram("loop_us", loop_stats);
+  addHistogram("temp_request_us", temp_request_stats);
+  addHistogram("scratchpad_us", scratchpad_stats);
+  addHistogram("ina219_us", ina219_stats);
+  addHistogram("command_us", command_stats);
+  addHistogram("tx_backlog_bytes", tx_backlog_stats);
+  addHistogram("control_us", control_stats);
+  portENTER_CRITICAL(&shared_state_mux);
+  RelayStats relay_stats = relay_controller.stats(millis());
+  portEXIT_CRITICAL(&shared_state_mux);
+  response.beginObject("relay");
+  response.addUnsigned("switches", relay_stats.switches);
+  response.addUnsigned("fast_trips", relay_stats.fast_trips);
+  response.addUnsigned("on_ms", relay_stats.on_ms);
+  response.addUnsigned("off_ms", relay_stats.off_ms);
+  response.endObject();
+  response.addUnsigned("heap_free", ESP.getFreeHeap());
+  response.addUnsigned("heap_min", ESP.getMinFreeHeap());
+  response.beginObject("errors");
+  response.addUnsigned("temp_crc", temp_crc_errors);
+  response.addUnsigned("temp_disconnected", temp_disconnected_reads);
+  response.addUnsigned("i2c", ina219.errorCount());
+  response.addUnsigned("i2c_recoveries", ina219.recoveryCount());
+  response.addUnsigned("rx_overflow", rx_overflow_count);
+  response.addUnsigned("flash_log_dropped", flash_log.droppedCount());
+  response.addUnsigned("tx_dropped", tx_queue.droppedMessages());
+  response.addUnsigned("control_queue_dropped", control_queue_drops);
+  response.addUnsigned("relay_event_dropped", relay_event_drops);
+  response.endObject();
+  response.endObject();
+  response.send();
+}
+
+void resetStats() {
+  loop_stats.reset();
+  temp_request_stats.reset();
+  scratchpad_stats.reset();
+  ina219_stats.reset();
+  command_stats.reset();
+  tx_backlog_stats.reset();
+  control_stats.reset();
+  temp_crc_errors = 0;
+  temp_disconnected_reads = 0;
+  rx_overflow_count = 0;
+  control_queue_drops = 0;
+  relay_event_drops = 0;
+  tx_queue.resetCounters();
+  uplink.resetCounters();
+  report_filter.resetCounters();
+  portENTER_CRITICAL(&shared_state_mux);
+  relay_controller.resetStats(millis());
+  portEXIT_CRITICAL(&shared_state_mux);
+  xSemaphoreTake(i2c_mutex, portMAX_DELAY);
+  ina219.resetCounters();
+  xSemaphoreGive(i2c_mutex);
+  stats_reset_ms = millis();
+}
+
+void handleStats(const CommandArg &arg) {
+  printStats();
+}
+
+void handleStatsReset(const CommandArg &arg) {
+  resetStats();
+  printStats();
+}
+
+void handleSleep(const CommandArg &arg) {
+  light_sleep_enabled = arg.u;
+  if (light_sleep_enabled) {
+    uart_set_wakeup_threshold(UART_NUM_0, UART_WAKE_THRESHOLD);
+    esp_sleep_enable_uart_wakeup(UART_NUM_0);
+  }
+  printPowerStatus();
+}
+
+void handleCpu(const CommandArg &arg) {
+  if (arg.u == 0) {
+    governor.setAuto();
+  } else {
+    governor.setFixed(arg.u);
+  }
+  printPowerStatus();
+}
+
+void handlePower(const CommandArg &arg) {
+  printPowerStatus();
+}
+
+void handleBoot(const CommandArg &arg) {
+  response.beginJson();
+  response.beginObject("boot");
+  response.addBool("settings_restored", settings_restored);
+  response.addBool("sensors_fast_path", sensors_fast_path);
+  response.addUnsigned("setup_ms", setup_done_ms);
+  response.addUnsigned("first_temp_ms", first_temp_ms);
+  response.addUnsigned("first_solar_ms", first_solar_ms);
+  response.addUnsigned("nvs_writes", store.writeCount());
+  response.endObject();
+  response.send();
+}
+
+// Identifies the board to a host that manages several of them. The node id
+// is the one ESP-NOW uplink batches carry, so both paths agree.
+void handleHello(const CommandArg &arg) {
+  // The six factory MAC bytes fill the low 48 bits of the eFuse word, first
+  // byte lowest. Bits 47..32 and 31..0 print as a fixed 12-digit id, which
+  // is byte-reversed from the usual colon-separated MAC.
+  uint64_t mac = ESP.getEfuseMac();
+  char device[13];
+  snprintf(device, sizeof(device), "%04" PRIX16 "%08" PRIX32, (uint16_t)(mac >> 32), (uint32_t)mac);
+  response.beginJson();
+  response.addString("command", "hello");
+  response.addString("device", device);
+  response.addUnsigned("node", (uint32_t)mac);
+  response.addUnsigned("session", flash_log.session());
+  response.addUnsigned("uptime_ms", millis());
+  response.addBool("time_synced", time_synced);
+  response.send();
+}
+
+void handleStream(const CommandArg &arg) {
+  streaming = true;
+  stream_period_ms = arg.stream.period_ms;
+  stream_channels = arg.stream.channels;
+  stream_seq = 0;
+  stream_tick_ms = millis() - stream_period_ms;
+  xTaskNotifyGive(acquisition_task);
+  response.beginJson();
+  response.addString("command", "stream");
+  response.addUnsigned("period_ms", stream_period_ms);
+  response.addUnsigned("channels", stream_channels);
+  response.send();
+}
+
+void handleStop(const CommandArg &arg) {
+  streaming = false;
+  response.beginJson();
+  response.addString("command", "stop");
+  response.addUnsigned("samples", stream_seq);
+  response.send();
+}
+
+void handleDump(const CommandArg &arg) {
+  dumpSamples(arg.u);
+}
+
+void handleAgg(const CommandArg &arg) {
+  printAggregates(arg.u);
+}
+
+void handleTime(const CommandArg &arg) {
+  time_sync_epoch_s = arg.epoch_s;
+  time_sync_ms = millis();
+  time_synced = true;
+  sendUnsignedAck("time", time_sync_epoch_s);
+}
+
+void handleBackfill(const CommandArg &arg) {
+  startBackfill(arg.u);
+}
+
+void handleFlashLog(const CommandArg &arg) {
+  printFlashLogStatus();
+}
+
+void printTxStatus() {
+  response.beginJson();
+  response.beginObject("tx");
+  response.addUnsigned("baud", serial_baud);
+  response.addUnsigned("buffer", tx_queue.capacity());
+  response.addString("policy", TxQueue::policyName(tx_queue.policy()));
+  response.addUnsigned("pending", tx_queue.pending());
+  response.addUnsigned("high_water", tx_queue.highWater());
+  response.addUnsigned("dropped", tx_queue.droppedMessages());
+  response.addUnsigned("dropped_bytes", tx_queue.droppedBytes());
+  response.addUnsigned("blocked", tx_queue.blockedCount());
+  response.addUnsigned("blocked_ms", tx_queue.blockedMs());
+  response.endObject();
+  response.send();
+}
+
+void handleTx(const CommandArg &arg) {
+  printTxStatus();
+}
+
+void handleSetTxBuffer(const CommandArg &arg) {
+  if (arg.u < TX_QUEUE_MIN_SIZE || arg.u > TX_QUEUE_MAX_SIZE || !tx_queue.begin(arg.u)) {
+    sendCommandError("set_tx_buffer");
+    return;
+  }
+  tx_buffer_size = arg.u;
+  printTxStatus();
+}
+
+void handleTxPolicy(const CommandArg &arg) {
+  tx_policy = arg.u;
+  tx_queue.setPolicy(tx_policy);
+  printTxStatus();
+}
+
+// The ack goes out at the old rate, then the link switches once it has
+// drained. The rate is not persisted, so after a reset the host can always
+// find the device at the default again.
+void handleBaud(const CommandArg &arg) {
+  sendUnsignedAck("baud", arg.u);
+  tx_queue.flush();
+  serial_baud = arg.u;
+  Serial.updateBaudRate(serial_baud);
+}
+
+void handleUplink(const CommandArg &arg) {
+  uplink_enabled = arg.u;
+  last_uplink_ms = millis();
+  printUplinkStatus();
+}
+
+void handleUplinkPeer(const CommandArg &arg) {
+  uplink.setPeer(arg.peer.mac, arg.peer.channel);
+  printUplinkStatus();
+}
+
+void handleUplinkStatus(const CommandArg &arg) {
+  printUplinkStatus();
+}
+
+void handleSetUplinkPeriod(const CommandArg &arg) {
+  uplink_period_ms = arg.u;
+  sendUnsignedAck("set_uplink_period_ms", uplink_period_ms);
+}
+
+void handleReport(const CommandArg &arg) {
+  reporting = arg.u;
+  report_filter.reset();
+  printReportStatus();
+}
+
+void handleReportStatus(const CommandArg &arg) {
+  printReportStatus();
+}
+
+void handleProtocol(const CommandArg &arg) {
+  response.beginJson();
+  response.addString("command", "proto");
+  response.addString("value", arg.u ? "bin" : "text");
+  response.send();
+  response.setBinary(arg.u);
+}
+
+void handleAll(const CommandArg &arg) {
+  printAll();
+}
+
+void handleGetSettings(const CommandArg &arg) {
+  printRelaySettings();
+}
+
+const Command commands[] = {
+  { "o", parseNone, handleOutdoorTemp },
+  { "i", parseNone, handleIndoorTemp },
+  { "t", parseNone, handleBothTemps },
+  { "temps", parseNone, handleAllTemps },
+  { "sensors", parseNone, handleSensors },
+  { "discover", parseNone, handleDiscover },
+  { "label", parseLabel, handleLabel },
+  { "s", parseNone, handleSolar },
+  { "r", parseNone, handleRelayStatus },
+  { "r1", parseNone, handleRelayOn, true },
+  { "r0", parseNone, handleRelayOff, true },
+  { "auto", parseNone, handleAuto, true },
+  { "manual", parseNone, handleManual, true },
+  { "set", parseText, handleSet, true },
+  { "set_power_on_mW", parsePositiveFloat, handleSetPowerOn, true },
+  { "set_power_off_mW", parsePositiveFloat, handleSetPowerOff, true },
+  { "set_voltage_cutoff_V", parsePositiveFloat, handleSetVoltageCutoff, true },
+  { "set_voltage_high_on_V", parsePositiveFloat, handleSetVoltageHighOn, true },
+  { "set_debounce_ms", parsePositiveUnsigned, handleSetDebounce, true },
+  { "relay_filter", parseRelayFilter, handleRelayFilter, true },
+  { "set_temp_period_ms", parsePositiveUnsigned, handleSetTempPeriod, true },
+  { "set_sample_period_ms", parsePositiveUnsigned, handleSetSamplePeriod, true },
+  { "temp_res", parseTempResolution, handleTempResolution, true },
+  { "set_temp_budget_ms", parsePositiveUnsigned, handleSetTempBudget, true },
+  { "set_control_period_ms", parsePositiveUnsigned, handleSetControlPeriod, true },
+  { "set_agg_window_ms", parsePositiveUnsigned, handleSetAggWindow, true },
+  { "set_log_period_ms", parsePositiveUnsigned, handleSetLogPeriod, true },
+  { "set_ina_adc", parseAdcModes, handleSetInaAdc, true },
+  { "dump", parseOptionalUnsigned, handleDump },
+  { "agg", parseOptionalUnsigned, handleAgg },
+  { "time", parseEpochSeconds, handleTime },
+  { "backfill", parseOptionalUnsigned, handleBackfill },
+  { "flash_log", parseNone, handleFlashLog },
+  { "stream", parseStream, handleStream },
+  { "stop", parseNone, handleStop },
+  { "proto", parseProtocol, handleProtocol },
+  { "baud", parseBaud, handleBaud },
+  { "tx", parseNone, handleTx },
+  { "set_tx_buffer", parsePositiveUnsigned, handleSetTxBuffer, true },
+  { "tx_policy", parseTxPolicy, handleTxPolicy, true },
+  { "uplink", parseOnOff, handleUplink, true },
+  { "uplink_peer", parseUplinkPeer, handleUplinkPeer, true },
+  { "uplink_status", parseNone, handleUplinkStatus },
+  { "set_uplink_period_ms", parsePositiveUnsigned, handleSetUplinkPeriod, true },
+  { "report", parseOnOff, handleReport, true },
+  { "report_status", parseNone, handleReportStatus },
+  { "sleep", parseOnOff, handleSleep, true },
+  { "cpu", parseCpuMode, handleCpu, true },
+  { "power", parseNone, handlePower },
+  { "boot", parseNone, handleBoot },
+  { "hello", parseNone, handleHello },
+  { "stats", parseNone, handleStats },
+  { "stats_reset", parseNone, handleStatsReset },
+  { "get_settings", parseNone, handleGetSettings },
+  { "all", parseNone, handleAll },
+};
+
+void dispatchCommand(char *line) {
+  bool has_id;
+  uint16_t id;
+  if (!splitRequestId(line, has_id, id)) {
+    response.beginJson();
+    response.addString("status", "error");
+    response.addString("message", "invalid request id");
+    response.send();
+    return;
+  }
+  char *name;
+  char *args;
+  if (!splitCommandLine(line, name, args)) {
+    return;
+  }
+
+  response.setRequestId(has_id ? id : RESPONSE_NO_REQUEST_ID);
+  const Command *command = findCommand(commands, sizeof(commands) / sizeof(commands[0]), name);
+  if (!command) {
+    response.sendLine("Invalid command.");
+  } else {
+    CommandArg arg;
+    if (command->parse(args, arg)) {
+      CycleSpan span = startCycleSpan();
+      command->handler(arg);
+      if (command->persists) {
+        persistSettings();
+      }
+      recordCycleSpan(command_stats, span);
+    } else {
+      sendCommandError(command->name);
+    }
+  }
+  response.setRequestId(RESPONSE_NO_REQUEST_ID);
+}
+
+void pollSerialCommand() {
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (awaiting_first_byte) {
+      awaiting_first_byte = false;
+      wake_latency_us = micros() - uart_wake_us;
+      if (wake_latency_us > wake_latency_max_us) {
+        wake_latency_max_us = wake_latency_us;
+      }
+    }
+    if (c == '\n') {
+      bool overflow = rx_overflow;
+      rx_line[rx_length] = '\0';
+      rx_length = 0;
+      rx_overflow = false;
+      if (overflow) {
+        rx_overflow_count++;
+        response.beginJson();
+        response.addString("status", "error");
+        response.addString("message", "line too long");
+        response.send();
+      } else {
+        dispatchCommand(rx_line);
+      }
+      return;
+    }
+    if (rx_length < RX_LINE_MAX - 1) {
+      rx_line[rx_length++] = c;
+    } else {
+      rx_overflow = true;
+    }
+  }
+}
+
+// The I2C timing and the UART baud divider both derive from the APB clock
+// and are only reprogrammed once the new frequency runs, so no INA219
+// transaction may be in flight and the TX FIFO must be empty meanwhile.
+void beforeCpuFrequencyChange() {
+  xSemaphoreTake(i2c_mutex, portMAX_DELAY);
+  Serial.flush();
+  cpu_clock_epoch++;
+}
+
+void afterCpuFrequencyChange() {
+  Serial.updateBaudRate(serial_baud);
+  ina219.refreshClock();
+  cpu_clock_epoch++;
+  xSemaphoreGive(i2c_mutex);
+}
+
+unsigned long millisUntil(unsigned long start, unsigned long period, unsigned long now) {
+  unsigned long elapsed = now - start;
+  return elapsed >= period ? 0 : period - elapsed;
+}
+
+unsigned long millisUntilNextAcquisition() {
+  unsigned long now = millis();
+  unsigned long wait;
+  if (temp_conversion_pending) {
+    wait = millisUntil(temp_conversion_start_ms, temp_conversion_ms, now);
+  } else {
+    wait = millisUntil(temp_conversion_start_ms, tempPeriodMs(), now);
+  }
+  if (ina219_found) {
+    if (solar_conversion_pending) {
+      return 0;
+    }
+    wait = min(wait, millisUntil(solar_tick_ms, solarPeriodMs(), now));
+  }
+  return wait;
+}
+
+unsigned long millisUntilNextTick() {
+  unsigned long now = millis();
+  unsigned long wait = millisUntilNextAcquisition();
+  if (streaming) {
+    wait = min(wait, millisUntil(stream_tick_ms, stream_period_ms, now));
+  }
+  if (backfill_active) {
+    return 0;
+  }
+  if (flash_log_ready) {
+    wait = min(wait, millisUntil(last_log_ms, log_period_ms, now));
+  }
+  if (uplink_enabled) {
+    wait = min(wait, millisUntil(last_uplink_ms, uplink_period_ms, now));
+  }
+  return min(wait, millisUntil(last_sample_ms, sample_period_ms, now));
+}
+
+void serviceLightSleep() {
+  if (!light_sleep_enabled || rx_length > 0 || Serial.available() > 0) {
+    return;
+  }
+  unsigned long sleep_ms = millisUntilNextTick();
+  if (sleep_ms < LIGHT_SLEEP_MIN_MS) {
+    return;
+  }
+  tx_queue.flush();
+  esp_sleep_enable_timer_wakeup((uint64_t)sleep_ms * 1000);
+  unsigned long sleep_start_us = micros();
+  esp_light_sleep_start();
+  light_sleep_total_us += micros() - sleep_start_us;
+  light_sleep_count++;
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UART) {
+    uart_wake_count++;
+    uart_wake_us = micros();
+    awaiting_first_byte = true;
+  }
+}
+
+// A host command holding the OneWire bus (discover, temp_res) only skips
+// the temperature step; solar sampling, and so relay control, carries on.
+void acquisitionTaskMain(void *param) {
+  for (;;) {
+    if (xSemaphoreTake(onewire_mutex, 0) == pdTRUE) {
+      serviceTemperatureConversion();
+      xSemaphoreGive(onewire_mutex);
+    }
+    xSemaphoreTake(i2c_mutex, portMAX_DELAY);
+    serviceSolarAcquisition();
+    xSemaphoreGive(i2c_mutex);
+    TickType_t wait = pdMS_TO_TICKS(millisUntilNextAcquisition());
+    ulTaskNotifyTake(pdTRUE, wait > 0 ? wait : 1);
+  }
+}
+
+void controlTaskMain(void *param) {
+  SolarReading reading;
+  for (;;) {
+    if (xQueueReceive(control_queue, &reading, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    checkAndControlRelay(reading.raw);
+    recordCycleSpan(control_stats, reading.span);
+  }
+}
+
+void startTasks() {
+  publishSnapshot();
+  xTaskCreate(controlTaskMain, "control", CONTROL_TASK_STACK, NULL, CONTROL_TASK_PRIORITY, &control_task);
+  xTaskCreate(acquisitionTaskMain, "acquisition", ACQUISITION_TASK_STACK, NULL, ACQUISITION_TASK_PRIORITY, &acquisition_task);
+}
+
+void setup() {
+  onewire_mutex = xSemaphoreCreateMutex();
+  i2c_mutex = xSemaphoreCreateMutex();
+  control_queue = xQueueCreate(CONTROL_QUEUE_LENGTH, sizeof(SolarReading));
+  relay_event_queue = xQueueCreate(RELAY_EVENT_QUEUE_LENGTH, sizeof(RelayEvent));
+  Serial.setTxBufferSize(TX_UART_BUFFER_SIZE);
+  Serial.begin(serial_baud);
+  setCpuFrequencyMhz(80);
+  
+  WiFi.mode(WIFI_OFF);
+  btStop();
+
+  store.begin("esp32");
+  settings_record = store.addRecord("settings", &persisted_settings, sizeof(persisted_settings));
+  sensors_record = store.addRecord("sensors", &persisted_sensors, sizeof(persisted_sensors));
+  settings_restored = restoreSettings();
+  tx_queue.setPolicy(tx_policy);
+  if (!tx_queue.begin(tx_buffer_size)) {
+    tx_buffer_size = TX_QUEUE_DEFAULT_SIZE;
+    tx_queue.begin(tx_buffer_size);
+  }
+
+  pinMode(RELAY_PIN, OUTPUT);
+  digitalWrite(RELAY_PIN, relay_controller.isOn() ? HIGH : LOW);
+
+  ina219_found = ina219.begin(I2C_SDA_PIN, I2C_SCL_PIN, I2C_CLOCK_HZ);
+  if (!ina219_found) {
+    response.sendLine("Error: INA219 not found!");
+  }
+
+  sensors_fast_path = restoreSensorTable();
+  if (!sensors_fast_path && !discoverSensors()) {
+    response.sendLine("Error: No DS18B20 sensors found!");
+  }
+  sensors.setResolution(DS18B20_RESOLUTION);
+  configureThermometers();
+  sensors.setWaitForConversion(false);
+  startTemperatureConversion();
+  
+  updateRawThresholds();
+  updateReportDeadbands();
+  aggregator.begin(agg_window_ms, millis());
+  flash_log_ready = flash_log.begin();
+
+  tx_idle_space = Serial.availableForWrite();
+  governor.begin(CPU_IDLE_MHZ, CPU_BUSY_MHZ, beforeCpuFrequencyChange, afterCpuFrequencyChange);
+  if (settings_restored && persisted_settings.cpu_fixed_mhz != 0) {
+    governor.setFixed(persisted_settings.cpu_fixed_mhz);
+  }
+  if (light_sleep_enabled) {
+    uart_set_wakeup_threshold(UART_NUM_0, UART_WAKE_THRESHOLD);
+    esp_sleep_enable_uart_wakeup(UART_NUM_0);
+  }
+  setup_done_ms = millis();
+  startTasks();
+}
+
+void loop() {
+  CycleSpan loop_span = startCycleSpan();
+  serviceRelayEvents(0);
+  serviceSampling();
+  serviceStreaming();
+  serviceReporting();
+  serviceLogging();
+  serviceBackfill();
+  serviceUplink();
+
+  pollSerialCommand();
+  tx_queue.service();
+  store.service();
+  flash_log.service(millisUntilNextTick());
+  int tx_free = Serial.availableForWrite();
+  size_t tx_pending = tx_queue.pending();
+  governor.update(backfill_active || rx_length > 0 || Serial.available() > 0 || tx_pending > 0 || tx_free < tx_idle_space);
+  tx_backlog_stats.record(tx_pending + (tx_free < tx_idle_space ? tx_idle_space - tx_free : 0));
+  recordCycleSpan(loop_stats, loop_span);
+  serviceLightSleep();
+  serviceRelayEvents(backfill_active || Serial.available() > 0 ? 0 : IO_IDLE_WAIT_TICKS);
 }
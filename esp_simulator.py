@@ -0,0 +1,341 @@
+"""Serial-loopback simulator of the ESP32 firmware, for running app.py and benchmark.py without hardware.
+
+Opens a pseudo-terminal and answers the esp.cpp command set on it with the same JSON lines or COBS
+frames the firmware sends, paced at the simulated UART baud rate. Run it on its own and point
+SERIAL_PORTS in app.py at the path it prints, or let benchmark.py start one per run.
+"""
+import argparse
+import json
+import os
+import pty
+import random
+import struct
+import sys
+import threading
+import time
+import tty
+
+# --- Wire Format (mirrors response.h) ---
+FRAME_TEMP = 0x01
+FRAME_SOLAR = 0x02
+FRAME_RELAY = 0x03
+FRAME_SETTINGS = 0x04
+FRAME_STREAM = 0x08
+FRAME_ALL = 0x0C
+FRAME_TEXT = 0x7F
+FRAME_TAGGED = 0x80
+STREAM_CHANNELS = {'o': 0x01, 'i': 0x02, 't': 0x03, 's': 0x04, 'r': 0x08, 'all': 0x0F}
+SUPPORTED_BAUDS = (9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600)
+
+def crc16_ccitt(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+def cobs_encode(data):
+    output = bytearray()
+    block = bytearray()
+    for byte in data:
+        if byte == 0:
+            output += bytes([len(block) + 1]) + block
+            block = bytearray()
+            continue
+        block.append(byte)
+        if len(block) == 0xFE:
+            output += b'\xff' + block
+            block = bytearray()
+    output += bytes([len(block) + 1]) + block
+    return bytes(output)
+
+class EspSimulator:
+    def __init__(self, device='51A000000001', baud=115200, latency_ms=1.0):
+        self.device = device
+        self.baud = baud
+        self.latency_s = latency_ms / 1000
+        self.started = time.time()
+        self.binary = False
+        self.frame_seq = 0
+        self.link_lock = threading.Lock()
+        self.link_free_at = 0.0
+        self.streaming = False
+        self.stream_period_ms = 1000
+        self.stream_channels = STREAM_CHANNELS['all']
+        self.stream_seq = 0
+        self.relay_on = False
+        self.auto_mode = True
+        self.settings = {
+            "power_on_threshold_mW": 1500.0, "power_off_threshold_mW": 500.0,
+            "voltage_low_cutoff_V": 12.0, "voltage_high_on_threshold_V": 13.5,
+            "voltage_emergency_cutoff_V": 11.5, "on_delay_ms": 60000, "off_delay_ms": 10000,
+            "temp_period_ms": 1000, "sample_period_ms": 100, "control_period_ms": 100,
+            "agg_window_ms": 60000, "log_period_ms": 60000, "temp_budget_ms": 750
+        }
+        self.outdoor_C = 12.0
+        self.indoor_C = 21.0
+        self.voltage_V = 13.2
+        self.current_mA = 420.0
+        self.master = None
+        self.slave = None
+
+    def millis(self):
+        return int((time.time() - self.started) * 1000) & 0xFFFFFFFF
+
+    def step_sensors(self):
+        self.outdoor_C += random.uniform(-0.05, 0.05)
+        self.indoor_C += random.uniform(-0.02, 0.02)
+        self.voltage_V = min(14.4, max(11.0, self.voltage_V + random.uniform(-0.02, 0.02)))
+        self.current_mA = max(0.0, self.current_mA + random.uniform(-5, 5))
+
+    @property
+    def power_mW(self):
+        return self.voltage_V * self.current_mA
+
+    # --- Link ---
+
+    def open(self):
+        """Opens the pseudo-terminal and returns the path the host should connect to."""
+        self.master, self.slave = pty.openpty()
+        tty.setraw(self.slave)
+        return os.ttyname(self.slave)
+
+    def transmit(self, data):
+        """Delivers bytes once the simulated UART would have shifted them out, 10 bits per byte."""
+        with self.link_lock:
+            start = max(time.time(), self.link_free_at)
+            self.link_free_at = start + len(data) * 10 / self.baud
+            delay = self.link_free_at - time.time()
+            if delay > 0:
+                time.sleep(delay)
+            os.write(self.master, data)
+
+    def send_json(self, fields, request_id=None):
+        reply = {**({"id": request_id} if request_id is not None else {}), **fields}
+        text = json.dumps(reply)
+        if self.binary:
+            self.send_frame(FRAME_TEXT, text.encode('utf-8'))
+        else:
+            self.transmit(text.encode('utf-8') + b'\r\n')
+
+    def send_line(self, text, request_id=None):
+        if request_id is not None:
+            text = f'#{request_id} {text}'
+        if self.binary:
+            self.send_frame(FRAME_TEXT, text.encode('utf-8'))
+        else:
+            self.transmit(text.encode('utf-8') + b'\r\n')
+
+    def send_frame(self, frame_type, payload, request_id=None):
+        if request_id is not None:
+            frame_type |= FRAME_TAGGED
+            payload = struct.pack('<H', request_id) + payload
+        packet = struct.pack('<BH', frame_type, self.frame_seq & 0xFFFF) + payload
+        packet += struct.pack('<H', crc16_ccitt(packet))
+        self.frame_seq += 1
+        self.transmit(cobs_encode(packet) + b'\x00')
+
+    # --- Replies ---
+
+    def send_temps(self, channels, request_id):
+        if self.binary:
+            payload = struct.pack('<BffIBBH', channels, self.outdoor_C, self.indoor_C, 250, 12, 12, 750)
+            self.send_frame(FRAME_TEMP, payload, request_id)
+        elif channels == 0x01:
+            self.send_json({"sensor": "o_temp", "value": round(self.outdoor_C, 2), "res": 12, "age_ms": 250,
+                            "conversion_ms": 750}, request_id)
+        elif channels == 0x02:
+            self.send_json({"sensor": "i_temp", "value": round(self.indoor_C, 2), "res": 12, "age_ms": 250,
+                            "conversion_ms": 750}, request_id)
+        else:
+            self.send_json({"o_temp": round(self.outdoor_C, 2), "i_temp": round(self.indoor_C, 2), "o_res": 12,
+                            "i_res": 12, "age_ms": 250, "conversion_ms": 750}, request_id)
+
+    def send_solar(self, request_id):
+        if self.binary:
+            payload = struct.pack('<fffII', self.voltage_V, self.current_mA, self.power_mW, 40, 532)
+            self.send_frame(FRAME_SOLAR, payload, request_id)
+        else:
+            self.send_json({"sensor": "solar_pwr", "voltage_V": round(self.voltage_V, 2),
+                            "current_mA": round(self.current_mA, 2), "power_mW": round(self.power_mW, 2),
+                            "age_ms": 40, "conversion_us": 532}, request_id)
+
+    def send_relay(self, request_id):
+        if self.binary:
+            self.send_frame(FRAME_RELAY, struct.pack('<BB', self.relay_on, self.auto_mode), request_id)
+        else:
+            self.send_json({"sensor": "relay", "value": "ON" if self.relay_on else "OFF",
+                            "mode": "auto" if self.auto_mode else "manual"}, request_id)
+
+    def send_settings(self, request_id):
+        s = self.settings
+        if self.binary:
+            payload = struct.pack('<BffffIIIIBBIIIBIIfBB', self.auto_mode, s["power_on_threshold_mW"],
+                                  s["power_off_threshold_mW"], s["voltage_low_cutoff_V"],
+                                  s["voltage_high_on_threshold_V"], s["on_delay_ms"], s["temp_period_ms"],
+                                  s["sample_period_ms"], s["control_period_ms"], 0x3, 0x3, 532, s["agg_window_ms"],
+                                  s["log_period_ms"], 0, s["temp_budget_ms"], s["off_delay_ms"],
+                                  s["voltage_emergency_cutoff_V"], 2, 5)
+            self.send_frame(FRAME_SETTINGS, payload, request_id)
+        else:
+            self.send_json({"relay_settings": {"mode": "auto" if self.auto_mode else "manual", **s,
+                                               "relay_filter": "median", "filter_depth": 5}}, request_id)
+
+    def send_all(self, request_id):
+        s = self.settings
+        if self.binary:
+            payload = struct.pack('<IffIfffIBBffffIIf', self.millis(), self.outdoor_C, self.indoor_C, 250,
+                                  self.voltage_V, self.current_mA, self.power_mW, 40, self.relay_on,
+                                  self.auto_mode, s["power_on_threshold_mW"], s["power_off_threshold_mW"],
+                                  s["voltage_low_cutoff_V"], s["voltage_high_on_threshold_V"], s["on_delay_ms"],
+                                  s["off_delay_ms"], s["voltage_emergency_cutoff_V"])
+            self.send_frame(FRAME_ALL, payload, request_id)
+            return
+        self.send_json({"ts_ms": self.millis(), "o_temp": round(self.outdoor_C, 2), "i_temp": round(self.indoor_C, 2),
+                        "temp_age_ms": 250, "voltage_V": round(self.voltage_V, 2),
+                        "current_mA": round(self.current_mA, 2), "power_mW": round(self.power_mW, 2),
+                        "solar_age_ms": 40, "relay": "ON" if self.relay_on else "OFF",
+                        "mode": "auto" if self.auto_mode else "manual",
+                        **{key: s[key] for key in ("power_on_threshold_mW", "power_off_threshold_mW",
+                                                   "voltage_low_cutoff_V", "voltage_high_on_threshold_V",
+                                                   "on_delay_ms", "off_delay_ms", "voltage_emergency_cutoff_V")}},
+                       request_id)
+
+    def send_stream_sample(self):
+        self.stream_seq += 1
+        channels = self.stream_channels
+        if self.binary:
+            payload = struct.pack('<IIB', self.stream_seq, self.millis(), channels)
+            if channels & 0x01:
+                payload += struct.pack('<f', self.outdoor_C)
+            if channels & 0x02:
+                payload += struct.pack('<f', self.indoor_C)
+            if channels & 0x04:
+                payload += struct.pack('<fff', self.voltage_V, self.current_mA, self.power_mW)
+            if channels & 0x08:
+                payload += struct.pack('<B', self.relay_on)
+            self.send_frame(FRAME_STREAM, payload)
+            return
+        event = {"event": "stream", "stream": self.stream_seq, "ts_ms": self.millis()}
+        if channels & 0x01:
+            event["o_temp"] = round(self.outdoor_C, 2)
+        if channels & 0x02:
+            event["i_temp"] = round(self.indoor_C, 2)
+        if channels & 0x04:
+            event.update({"voltage_V": round(self.voltage_V, 2), "current_mA": round(self.current_mA, 2),
+                          "power_mW": round(self.power_mW, 2)})
+        if channels & 0x08:
+            event["relay"] = "ON" if self.relay_on else "OFF"
+        self.send_json(event)
+
+    # --- Commands ---
+
+    def handle(self, line):
+        request_id = None
+        if line.startswith('#'):
+            tag, _, line = line[1:].partition(' ')
+            if not tag.isdigit() or int(tag) > 0xFFFF:
+                self.send_json({"status": "error", "message": "invalid request id"})
+                return
+            request_id = int(tag)
+        name, _, arg = line.strip().partition(' ')
+        if not name:
+            return
+        time.sleep(self.latency_s)
+        self.step_sensors()
+        if name == 'hello':
+            self.send_json({"command": "hello", "device": self.device, "node": int(self.device[-8:], 16),
+                            "session": 1, "uptime_ms": self.millis(), "time_synced": True}, request_id)
+        elif name == 'proto' and arg in ('bin', 'text'):
+            self.send_json({"command": "proto", "value": arg}, request_id)
+            self.binary = arg == 'bin'
+        elif name == 'baud' and arg.isdigit() and int(arg) in SUPPORTED_BAUDS:
+            self.send_json({"command": "baud", "value": int(arg)}, request_id)
+            with self.link_lock:
+                self.baud = int(arg)
+        elif name == 'time' and arg.isdigit():
+            self.send_json({"command": "time", "value": int(arg)}, request_id)
+        elif name == 'report' and arg in ('on', 'off'):
+            self.send_json({"report": {"enabled": arg == 'on'}}, request_id)
+        elif name == 'stream':
+            period, _, channels = arg.partition(' ')
+            if not period.isdigit() or int(period) == 0 or (channels and channels not in STREAM_CHANNELS):
+                self.send_json({"command": "stream", "status": "error", "message": "invalid value"}, request_id)
+                return
+            self.stream_period_ms = int(period)
+            self.stream_channels = STREAM_CHANNELS[channels or 'all']
+            self.stream_seq = 0
+            self.streaming = True
+            self.send_json({"command": "stream", "period_ms": self.stream_period_ms,
+                            "channels": self.stream_channels}, request_id)
+        elif name == 'stop':
+            self.streaming = False
+            self.send_json({"command": "stop", "samples": self.stream_seq}, request_id)
+        elif name in ('o', 'i', 't'):
+            self.send_temps({'o': 0x01, 'i': 0x02, 't': 0x03}[name], request_id)
+        elif name == 's':
+            self.send_solar(request_id)
+        elif name in ('r', 'r1', 'r0'):
+            if name != 'r':
+                self.auto_mode = False
+                self.relay_on = name == 'r1'
+            self.send_relay(request_id)
+        elif name in ('auto', 'manual'):
+            self.auto_mode = name == 'auto'
+            self.send_json({"mode": name, "status": "enabled"}, request_id)
+        elif name == 'all':
+            self.send_all(request_id)
+        elif name == 'get_settings':
+            self.send_settings(request_id)
+        elif name.startswith('set_') and arg:
+            self.send_json({"command": name, "value": float(arg) if '.' in arg else int(arg)}, request_id)
+        elif name == 'set' and arg:
+            self.send_settings(request_id)
+        else:
+            self.send_line("Invalid command.", request_id)
+
+    def stream_loop(self):
+        next_sample = time.time()
+        while True:
+            if not self.streaming:
+                time.sleep(0.01)
+                next_sample = time.time()
+                continue
+            next_sample += self.stream_period_ms / 1000
+            time.sleep(max(0.0, next_sample - time.time()))
+            if self.streaming:
+                self.send_stream_sample()
+
+    def command_loop(self):
+        buffer = b''
+        while True:
+            try:
+                buffer += os.read(self.master, 4096)
+            except OSError:
+                time.sleep(0.05)
+                continue
+            *lines, buffer = buffer.split(b'\n')
+            for line in lines:
+                self.handle(line.decode('utf-8', errors='replace').strip())
+
+    def run(self):
+        threading.Thread(target=self.stream_loop, name='sim-stream', daemon=True).start()
+        self.command_loop()
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--device', default='51A000000001', help='device id reported by hello')
+    parser.add_argument('--baud', type=int, default=115200, help='initial simulated UART rate')
+    parser.add_argument('--latency-ms', type=float, default=1.0, help='simulated command handling time')
+    args = parser.parse_args()
+    simulator = EspSimulator(args.device, args.baud, args.latency_ms)
+    print(simulator.open(), flush=True)
+    try:
+        simulator.run()
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,340 @@
+#include "flash_log.h"
+
+FlashLog flash_log;
+
+static size_t putVarint(uint8_t *out, uint32_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+static size_t putZigzag(uint8_t *out, int32_t value) {
+  return putVarint(out, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+static bool getVarint(const uint8_t *data, size_t length, size_t &pos, uint32_t &value) {
+  value = 0;
+  for (uint8_t shift = 0; shift < 35; shift += 7) {
+    if (pos >= length) {
+      return false;
+    }
+    uint8_t byte = data[pos++];
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool getZigzag(const uint8_t *data, size_t length, size_t &pos, int32_t &value) {
+  uint32_t raw;
+  if (!getVarint(data, length, pos, raw)) {
+    return false;
+  }
+  value = (int32_t)(raw >> 1) ^ -(int32_t)(raw & 1);
+  return true;
+}
+
+FlashLog::FlashLog()
+  : partition_(NULL), sector_count_(0), head_sector_(0), head_seq_(0), write_offset_(0),
+    erase_pending_(false), need_key_(true), session_(0), record_count_(0), dropped_count_(0),
+    erase_count_(0), read_index_(0), read_seq_(0), read_offset_(0), read_length_(0) {
+  memset(&last_, 0, sizeof(last_));
+}
+
+bool FlashLog::begin() {
+  partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, FLASH_LOG_LABEL);
+  if (!partition_ || partition_->size < 2 * FLASH_LOG_SECTOR_SIZE) {
+    partition_ = NULL;
+    return false;
+  }
+  sector_count_ = partition_->size / FLASH_LOG_SECTOR_SIZE;
+
+  bool found = false;
+  for (uint32_t sector = 0; sector < sector_count_; sector++) {
+    uint32_t seq;
+    if (readHeader(sector, seq) && (!found || seq > head_seq_)) {
+      found = true;
+      head_sector_ = sector;
+      head_seq_ = seq;
+    }
+  }
+  if (!found) {
+    erase_pending_ = true;
+    return eraseSector(0) && openSector(0, 1);
+  }
+
+  esp_partition_read(partition_, sectorAddress(head_sector_), read_buffer_, FLASH_LOG_SECTOR_SIZE);
+  Cursor cursor = {};
+  LogRecord record;
+  size_t offset = FLASH_LOG_HEADER_SIZE;
+  while (decode(read_buffer_, FLASH_LOG_SECTOR_SIZE, offset, cursor, record)) {
+  }
+  session_ = cursor.last.session + 1;
+  write_offset_ = offset;
+  if (offset < FLASH_LOG_SECTOR_SIZE && read_buffer_[offset] != 0xFF) {
+    write_offset_ = FLASH_LOG_SECTOR_SIZE;
+  }
+  erase_pending_ = true;
+  need_key_ = true;
+  return true;
+}
+
+bool FlashLog::append(const LogRecord &record) {
+  if (!partition_) {
+    return false;
+  }
+  LogRecord entry = record;
+  entry.session = session_;
+  if (entry.synced != last_.synced || entry.ts_s < last_.ts_s) {
+    need_key_ = true;
+  }
+
+  uint8_t buffer[FLASH_LOG_MAX_RECORD];
+  size_t length = encode(entry, need_key_, buffer);
+  if (write_offset_ + length > FLASH_LOG_SECTOR_SIZE) {
+    if (erase_pending_) {
+      dropped_count_++;
+      return false;
+    }
+    if (!openSector((head_sector_ + 1) % sector_count_, head_seq_ + 1)) {
+      dropped_count_++;
+      return false;
+    }
+    erase_pending_ = true;
+    need_key_ = true;
+    length = encode(entry, true, buffer);
+  }
+
+  if (esp_partition_write(partition_, sectorAddress(head_sector_) + write_offset_, buffer, length) != ESP_OK) {
+    write_offset_ = FLASH_LOG_SECTOR_SIZE;
+    dropped_count_++;
+    return false;
+  }
+  write_offset_ += length;
+  if (need_key_) {
+    last_.outdoor_cC = 0;
+    last_.indoor_cC = 0;
+    last_.bus_raw = 0;
+    last_.current_raw = 0;
+    last_.power_raw = 0;
+    need_key_ = false;
+  }
+  if (entry.flags & LOG_OUTDOOR_VALID) {
+    last_.outdoor_cC = entry.outdoor_cC;
+  }
+  if (entry.flags & LOG_INDOOR_VALID) {
+    last_.indoor_cC = entry.indoor_cC;
+  }
+  if (entry.flags & LOG_SOLAR_VALID) {
+    last_.bus_raw = entry.bus_raw;
+    last_.current_raw = entry.current_raw;
+    last_.power_raw = entry.power_raw;
+  }
+  last_.ts_s = entry.ts_s;
+  last_.session = entry.session;
+  last_.synced = entry.synced;
+  last_.flags = entry.flags;
+  record_count_++;
+  return true;
+}
+
+void FlashLog::service(unsigned long budget_ms) {
+  if (partition_ && erase_pending_ && budget_ms >= FLASH_LOG_ERASE_BUDGET_MS) {
+    if (eraseSector((head_sector_ + 1) % sector_count_)) {
+      erase_pending_ = false;
+    }
+  }
+}
+
+void FlashLog::startRead() {
+  read_index_ = 0;
+  read_length_ = 0;
+}
+
+bool FlashLog::readNext(LogRecord &record) {
+  if (!partition_) {
+    return false;
+  }
+  while (read_index_ < sector_count_) {
+    if (read_length_ == 0 && !loadReadSector()) {
+      read_index_++;
+      continue;
+    }
+    if (decode(read_buffer_, read_length_, read_offset_, read_cursor_, record)) {
+      return true;
+    }
+    read_index_++;
+    read_length_ = 0;
+  }
+  return false;
+}
+
+uint16_t FlashLog::session() const {
+  return session_;
+}
+
+uint32_t FlashLog::sectorCount() const {
+  return sector_count_;
+}
+
+uint32_t FlashLog::usedBytes() const {
+  uint32_t full = head_seq_ - 1;
+  if (full > sector_count_ - 2) {
+    full = sector_count_ - 2;
+  }
+  return full * FLASH_LOG_SECTOR_SIZE + write_offset_;
+}
+
+uint32_t FlashLog::recordCount() const {
+  return record_count_;
+}
+
+uint32_t FlashLog::droppedCount() const {
+  return dropped_count_;
+}
+
+uint32_t FlashLog::eraseCount() const {
+  return erase_count_;
+}
+
+uint32_t FlashLog::sectorAddress(uint32_t sector) const {
+  return sector * FLASH_LOG_SECTOR_SIZE;
+}
+
+bool FlashLog::readHeader(uint32_t sector, uint32_t &seq) {
+  uint32_t header[2];
+  if (esp_partition_read(partition_, sectorAddress(sector), header, sizeof(header)) != ESP_OK) {
+    return false;
+  }
+  seq = header[1];
+  return header[0] == FLASH_LOG_MAGIC && seq != 0xFFFFFFFF;
+}
+
+bool FlashLog::openSector(uint32_t sector, uint32_t seq) {
+  uint32_t header[2] = { FLASH_LOG_MAGIC, seq };
+  if (esp_partition_write(partition_, sectorAddress(sector), header, sizeof(header)) != ESP_OK) {
+    return false;
+  }
+  head_sector_ = sector;
+  head_seq_ = seq;
+  write_offset_ = FLASH_LOG_HEADER_SIZE;
+  return true;
+}
+
+bool FlashLog::eraseSector(uint32_t sector) {
+  erase_count_++;
+  return esp_partition_erase_range(partition_, sectorAddress(sector), FLASH_LOG_SECTOR_SIZE) == ESP_OK;
+}
+
+size_t FlashLog::encode(const LogRecord &record, bool key, uint8_t *out) {
+  LogRecord base;
+  memset(&base, 0, sizeof(base));
+  if (!key) {
+    base = last_;
+  }
+  size_t n = 0;
+  out[n++] = (key ? LOG_TAG_KEY : LOG_TAG_DELTA) | (record.flags & 0x0F);
+  if (key) {
+    n += putVarint(out + n, record.ts_s);
+    n += putVarint(out + n, ((uint32_t)record.session << 1) | (record.synced ? 1 : 0));
+  } else {
+    n += putVarint(out + n, record.ts_s - base.ts_s);
+  }
+  if (record.flags & LOG_OUTDOOR_VALID) {
+    n += putZigzag(out + n, record.outdoor_cC - base.outdoor_cC);
+  }
+  if (record.flags & LOG_INDOOR_VALID) {
+    n += putZigzag(out + n, record.indoor_cC - base.indoor_cC);
+  }
+  if (record.flags & LOG_SOLAR_VALID) {
+    n += putZigzag(out + n, record.bus_raw - base.bus_raw);
+    n += putZigzag(out + n, record.current_raw - base.current_raw);
+    n += putZigzag(out + n, record.power_raw - base.power_raw);
+  }
+  return n;
+}
+
+bool FlashLog::decode(const uint8_t *data, size_t length, size_t &offset, Cursor &cursor, LogRecord &record) {
+  if (offset >= length) {
+    return false;
+  }
+  uint8_t tag = data[offset];
+  bool key = (tag & 0xF0) == LOG_TAG_KEY;
+  if (!key && ((tag & 0xF0) != LOG_TAG_DELTA || !cursor.have_key)) {
+    return false;
+  }
+
+  LogRecord next;
+  memset(&next, 0, sizeof(next));
+  if (!key) {
+    next = cursor.last;
+  }
+  size_t pos = offset + 1;
+  uint32_t value;
+  if (!getVarint(data, length, pos, value)) {
+    return false;
+  }
+  if (key) {
+    next.ts_s = value;
+    if (!getVarint(data, length, pos, value)) {
+      return false;
+    }
+    next.session = value >> 1;
+    next.synced = value & 1;
+  } else {
+    next.ts_s += value;
+  }
+  next.flags = tag & 0x0F;
+
+  int32_t delta;
+  if (next.flags & LOG_OUTDOOR_VALID) {
+    if (!getZigzag(data, length, pos, delta)) {
+      return false;
+    }
+    next.outdoor_cC += delta;
+  }
+  if (next.flags & LOG_INDOOR_VALID) {
+    if (!getZigzag(data, length, pos, delta)) {
+      return false;
+    }
+    next.indoor_cC += delta;
+  }
+  if (next.flags & LOG_SOLAR_VALID) {
+    if (!getZigzag(data, length, pos, delta)) {
+      return false;
+    }
+    next.bus_raw += delta;
+    if (!getZigzag(data, length, pos, delta)) {
+      return false;
+    }
+    next.current_raw += delta;
+    if (!getZigzag(data, length, pos, delta)) {
+      return false;
+    }
+    next.power_raw += delta;
+  }
+
+  offset = pos;
+  cursor.last = next;
+  cursor.have_key = true;
+  record = next;
+  return true;
+}
+
+bool FlashLog::loadReadSector() {
+  uint32_t sector = (head_sector_ + 1 + read_index_) % sector_count_;
+  if (!readHeader(sector, read_seq_) || read_seq_ > head_seq_) {
+    return false;
+  }
+  read_length_ = sector == head_sector_ ? write_offset_ : FLASH_LOG_SECTOR_SIZE;
+  esp_partition_read(partition_, sectorAddress(sector), read_buffer_, read_length_);
+  read_offset_ = FLASH_LOG_HEADER_SIZE;
+  memset(&read_cursor_, 0, sizeof(read_cursor_));
+  return true;
+}
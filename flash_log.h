@@ -0,0 +1,96 @@
+#ifndef FLASH_LOG_H
+#define FLASH_LOG_H
+
+#include <Arduino.h>
+#include "esp_partition.h"
+
+#define FLASH_LOG_LABEL "tslog"
+#define FLASH_LOG_SECTOR_SIZE 4096
+#define FLASH_LOG_MAGIC 0x314C5354
+#define FLASH_LOG_HEADER_SIZE 8
+#define FLASH_LOG_MAX_RECORD 32
+#define FLASH_LOG_ERASE_BUDGET_MS 60
+
+#define LOG_OUTDOOR_VALID 0x01
+#define LOG_INDOOR_VALID 0x02
+#define LOG_SOLAR_VALID 0x04
+#define LOG_RELAY_ON 0x08
+
+#define LOG_TAG_KEY 0x10
+#define LOG_TAG_DELTA 0x20
+
+// One logged reading in sensor units: centi-degrees for temperatures and
+// the INA219 register values for the solar channel.
+struct LogRecord {
+  uint32_t ts_s;
+  uint16_t session;
+  bool synced;
+  uint8_t flags;
+  int32_t outdoor_cC;
+  int32_t indoor_cC;
+  int32_t bus_raw;
+  int32_t current_raw;
+  int32_t power_raw;
+};
+
+// Append-only circular log in a raw flash partition. Each sector starts
+// with a magic/sequence header and a key record; later records hold
+// zigzag varint deltas against the previous one. Sectors are reused in
+// rotation, and the next one is erased ahead of time from service() so
+// append() only ever programs a few bytes.
+class FlashLog {
+public:
+  FlashLog();
+
+  bool begin();
+  bool append(const LogRecord &record);
+  void service(unsigned long budget_ms);
+
+  void startRead();
+  bool readNext(LogRecord &record);
+
+  uint16_t session() const;
+  uint32_t sectorCount() const;
+  uint32_t usedBytes() const;
+  uint32_t recordCount() const;
+  uint32_t droppedCount() const;
+  uint32_t eraseCount() const;
+
+private:
+  struct Cursor {
+    LogRecord last;
+    bool have_key;
+  };
+
+  uint32_t sectorAddress(uint32_t sector) const;
+  bool readHeader(uint32_t sector, uint32_t &seq);
+  bool openSector(uint32_t sector, uint32_t seq);
+  bool eraseSector(uint32_t sector);
+  size_t encode(const LogRecord &record, bool key, uint8_t *out);
+  static bool decode(const uint8_t *data, size_t length, size_t &offset, Cursor &cursor, LogRecord &record);
+  bool loadReadSector();
+
+  const esp_partition_t *partition_;
+  uint32_t sector_count_;
+  uint32_t head_sector_;
+  uint32_t head_seq_;
+  uint32_t write_offset_;
+  bool erase_pending_;
+  bool need_key_;
+  LogRecord last_;
+  uint16_t session_;
+  uint32_t record_count_;
+  uint32_t dropped_count_;
+  uint32_t erase_count_;
+
+  uint32_t read_index_;
+  uint32_t read_seq_;
+  size_t read_offset_;
+  size_t read_length_;
+  Cursor read_cursor_;
+  uint8_t read_buffer_[FLASH_LOG_SECTOR_SIZE];
+};
+
+extern FlashLog flash_log;
+
+#endif
@@ -0,0 +1,225 @@
+#include "ina219_driver.h"
+
+struct INA219AdcMode {
+  const char *name;
+  uint8_t code;
+  uint32_t conversion_us;
+};
+
+static const INA219AdcMode adc_modes[] = {
+  { "9bit", 0x0, 84 },
+  { "10bit", 0x1, 148 },
+  { "11bit", 0x2, 276 },
+  { "12bit", 0x3, 532 },
+  { "avg2", 0x9, 1060 },
+  { "avg4", 0xA, 2130 },
+  { "avg8", 0xB, 4260 },
+  { "avg16", 0xC, 8510 },
+  { "avg32", 0xD, 17020 },
+  { "avg64", 0xE, 34050 },
+  { "avg128", 0xF, 68100 },
+};
+
+INA219Driver::INA219Driver(TwoWire &wire, uint8_t address)
+  : wire_(wire), address_(address), sda_pin_(-1), scl_pin_(-1), clock_hz_(100000),
+    bus_adc_(INA219_ADC_12BIT), shunt_adc_(INA219_ADC_12BIT),
+    consecutive_errors_(0), error_count_(0), recovery_count_(0) {
+}
+
+bool INA219Driver::begin(int sda_pin, int scl_pin, uint32_t clock_hz) {
+  sda_pin_ = sda_pin;
+  scl_pin_ = scl_pin;
+  clock_hz_ = clock_hz;
+  wire_.begin(sda_pin_, scl_pin_, clock_hz_);
+  wire_.setTimeOut(10);
+  return configure();
+}
+
+void INA219Driver::refreshClock() {
+  wire_.setClock(clock_hz_);
+}
+
+bool INA219Driver::trigger() {
+  bool ok = writeRegister(INA219_REG_CONFIG, configValue(INA219_MODE_TRIGGERED));
+  noteResult(ok);
+  return ok;
+}
+
+bool INA219Driver::powerDown() {
+  bool ok = writeRegister(INA219_REG_CONFIG, configValue(INA219_MODE_POWER_DOWN));
+  noteResult(ok);
+  return ok;
+}
+
+bool INA219Driver::poll(INA219Raw &raw, bool &ready) {
+  ready = false;
+  uint16_t bus;
+  if (!readRegister(INA219_REG_BUS_VOLTAGE, bus)) {
+    noteResult(false);
+    return false;
+  }
+  if (!(bus & INA219_CNVR_BIT)) {
+    noteResult(true);
+    return true;
+  }
+  uint16_t shunt;
+  uint16_t power;
+  uint16_t current;
+  bool ok = readRegister(INA219_REG_SHUNT_VOLTAGE, shunt) &&
+            readRegister(INA219_REG_POWER, power) &&
+            readRegister(INA219_REG_CURRENT, current);
+  noteResult(ok);
+  if (ok) {
+    raw.shunt = (int16_t)shunt;
+    raw.bus = bus;
+    raw.power = power;
+    raw.current = (int16_t)current;
+    ready = true;
+  }
+  return ok;
+}
+
+void INA219Driver::setAdcModes(uint8_t bus_adc, uint8_t shunt_adc) {
+  bus_adc_ = bus_adc & 0xF;
+  shunt_adc_ = shunt_adc & 0xF;
+}
+
+uint8_t INA219Driver::busAdc() const {
+  return bus_adc_;
+}
+
+uint8_t INA219Driver::shuntAdc() const {
+  return shunt_adc_;
+}
+
+uint32_t INA219Driver::conversionTimeUs() const {
+  return adcConversionUs(bus_adc_) + adcConversionUs(shunt_adc_);
+}
+
+uint32_t INA219Driver::errorCount() const {
+  return error_count_;
+}
+
+uint32_t INA219Driver::recoveryCount() const {
+  return recovery_count_;
+}
+
+void INA219Driver::resetCounters() {
+  error_count_ = 0;
+  recovery_count_ = 0;
+}
+
+uint16_t INA219Driver::busVoltageRaw(const INA219Raw &raw) {
+  return raw.bus >> 3;
+}
+
+float INA219Driver::busVoltage_V(const INA219Raw &raw) {
+  return busVoltageRaw(raw) * INA219_BUS_LSB_mV * 0.001f;
+}
+
+float INA219Driver::current_mA(const INA219Raw &raw) {
+  return raw.current * INA219_CURRENT_LSB_mA;
+}
+
+float INA219Driver::power_mW(const INA219Raw &raw) {
+  return (float)raw.power * INA219_POWER_LSB_mW;
+}
+
+uint16_t INA219Driver::busVoltageRawFrom_V(float voltage_V) {
+  float raw = voltage_V * 1000.0f / INA219_BUS_LSB_mV + 0.5f;
+  return raw > 0x1FFF ? 0x1FFF : (uint16_t)raw;
+}
+
+uint16_t INA219Driver::powerRawFrom_mW(float power_mW) {
+  float raw = power_mW / INA219_POWER_LSB_mW + 0.5f;
+  return raw > 0xFFFF ? 0xFFFF : (uint16_t)raw;
+}
+
+bool INA219Driver::adcModeFromName(const char *name, uint8_t &code) {
+  for (size_t i = 0; i < sizeof(adc_modes) / sizeof(adc_modes[0]); i++) {
+    if (strcmp(name, adc_modes[i].name) == 0) {
+      code = adc_modes[i].code;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *INA219Driver::adcModeName(uint8_t code) {
+  for (size_t i = 0; i < sizeof(adc_modes) / sizeof(adc_modes[0]); i++) {
+    if (adc_modes[i].code == code) {
+      return adc_modes[i].name;
+    }
+  }
+  return "9bit";
+}
+
+uint32_t INA219Driver::adcConversionUs(uint8_t code) {
+  for (size_t i = 0; i < sizeof(adc_modes) / sizeof(adc_modes[0]); i++) {
+    if (adc_modes[i].code == code) {
+      return adc_modes[i].conversion_us;
+    }
+  }
+  return adc_modes[0].conversion_us;
+}
+
+bool INA219Driver::writeRegister(uint8_t reg, uint16_t value) {
+  wire_.beginTransmission(address_);
+  wire_.write(reg);
+  wire_.write((value >> 8) & 0xFF);
+  wire_.write(value & 0xFF);
+  return wire_.endTransmission() == 0;
+}
+
+bool INA219Driver::readRegister(uint8_t reg, uint16_t &value) {
+  wire_.beginTransmission(address_);
+  wire_.write(reg);
+  if (wire_.endTransmission(false) != 0 || wire_.requestFrom(address_, (size_t)2) != 2) {
+    return false;
+  }
+  value = ((uint16_t)wire_.read() << 8) | wire_.read();
+  return true;
+}
+
+bool INA219Driver::configure() {
+  return writeRegister(INA219_REG_CALIBRATION, INA219_CALIBRATION_32V_2A) &&
+         writeRegister(INA219_REG_CONFIG, configValue(INA219_MODE_POWER_DOWN));
+}
+
+uint16_t INA219Driver::configValue(uint8_t mode) const {
+  return INA219_CONFIG_32V_GAIN8 | (bus_adc_ << INA219_BADC_SHIFT) | (shunt_adc_ << INA219_SADC_SHIFT) | mode;
+}
+
+void INA219Driver::noteResult(bool ok) {
+  if (ok) {
+    consecutive_errors_ = 0;
+    return;
+  }
+  error_count_++;
+  if (++consecutive_errors_ >= INA219_MAX_CONSECUTIVE_ERRORS) {
+    consecutive_errors_ = 0;
+    recoverBus();
+  }
+}
+
+void INA219Driver::recoverBus() {
+  recovery_count_++;
+  wire_.end();
+  pinMode(sda_pin_, INPUT_PULLUP);
+  pinMode(scl_pin_, OUTPUT_OPEN_DRAIN);
+  digitalWrite(scl_pin_, HIGH);
+  for (uint8_t pulse = 0; pulse < 9 && digitalRead(sda_pin_) == LOW; pulse++) {
+    digitalWrite(scl_pin_, LOW);
+    delayMicroseconds(5);
+    digitalWrite(scl_pin_, HIGH);
+    delayMicroseconds(5);
+  }
+  pinMode(sda_pin_, OUTPUT_OPEN_DRAIN);
+  digitalWrite(sda_pin_, LOW);
+  delayMicroseconds(5);
+  digitalWrite(sda_pin_, HIGH);
+  delayMicroseconds(5);
+  wire_.begin(sda_pin_, scl_pin_, clock_hz_);
+  wire_.setTimeOut(10);
+  configure();
+}
@@ -0,0 +1,89 @@
+#ifndef INA219_DRIVER_H
+#define INA219_DRIVER_H
+
+#include <Arduino.h>
+#include <Wire.h>
+
+#define INA219_REG_CONFIG 0x00
+#define INA219_REG_SHUNT_VOLTAGE 0x01
+#define INA219_REG_BUS_VOLTAGE 0x02
+#define INA219_REG_POWER 0x03
+#define INA219_REG_CURRENT 0x04
+#define INA219_REG_CALIBRATION 0x05
+
+#define INA219_CONFIG_32V_GAIN8 0x3800
+#define INA219_BADC_SHIFT 7
+#define INA219_SADC_SHIFT 3
+#define INA219_ADC_12BIT 0x3
+#define INA219_MODE_POWER_DOWN 0x0
+#define INA219_MODE_TRIGGERED 0x3
+#define INA219_CNVR_BIT 0x0002
+#define INA219_OVF_BIT 0x0001
+
+#define INA219_CALIBRATION_32V_2A 4096
+#define INA219_BUS_LSB_mV 4
+#define INA219_CURRENT_LSB_mA 0.1f
+#define INA219_POWER_LSB_mW 2
+
+#define INA219_MAX_CONSECUTIVE_ERRORS 3
+
+struct INA219Raw {
+  int16_t shunt;
+  uint16_t bus;
+  uint16_t power;
+  int16_t current;
+};
+
+// Register-level INA219 access: one repeated-start transaction per
+// register, fast-mode I2C and SCL clock-out recovery for a stuck bus.
+class INA219Driver {
+public:
+  INA219Driver(TwoWire &wire, uint8_t address);
+
+  bool begin(int sda_pin, int scl_pin, uint32_t clock_hz);
+  void refreshClock();
+  bool trigger();
+  bool powerDown();
+  bool poll(INA219Raw &raw, bool &ready);
+
+  void setAdcModes(uint8_t bus_adc, uint8_t shunt_adc);
+  uint8_t busAdc() const;
+  uint8_t shuntAdc() const;
+  uint32_t conversionTimeUs() const;
+
+  uint32_t errorCount() const;
+  uint32_t recoveryCount() const;
+  void resetCounters();
+
+  static uint16_t busVoltageRaw(const INA219Raw &raw);
+  static float busVoltage_V(const INA219Raw &raw);
+  static float current_mA(const INA219Raw &raw);
+  static float power_mW(const INA219Raw &raw);
+  static uint16_t busVoltageRawFrom_V(float voltage_V);
+  static uint16_t powerRawFrom_mW(float power_mW);
+
+  static bool adcModeFromName(const char *name, uint8_t &code);
+  static const char *adcModeName(uint8_t code);
+  static uint32_t adcConversionUs(uint8_t code);
+
+private:
+  bool writeRegister(uint8_t reg, uint16_t value);
+  bool readRegister(uint8_t reg, uint16_t &value);
+  bool configure();
+  uint16_t configValue(uint8_t mode) const;
+  void noteResult(bool ok);
+  void recoverBus();
+
+  TwoWire &wire_;
+  uint8_t address_;
+  int sda_pin_;
+  int scl_pin_;
+  uint32_t clock_hz_;
+  uint8_t bus_adc_;
+  uint8_t shunt_adc_;
+  uint8_t consecutive_errors_;
+  uint32_t error_count_;
+  uint32_t recovery_count_;
+};
+
+#endif
@@ -0,0 +1,207 @@
+// Host micro-benchmarks for the command path: parsing a received line,
+// dispatching it through a command table the size of the firmware's, and
+// formatting replies as JSON lines and as COBS frames. Replies go through
+// the real TX queue into a mock UART that only counts bytes.
+//
+//   bench [--quick]
+
+#include <stdio.h>
+
+#include <chrono>
+
+#include <Arduino.h>
+
+#include "command_parser.h"
+#include "relay_controller.h"
+#include "response.h"
+#include "tx_queue.h"
+
+#define BENCH_ITERATIONS 2000000
+#define BENCH_QUICK_ITERATIONS 20000
+#define BENCH_LINE_MAX 96
+
+static const char *const bench_lines[] = {
+  "#17 s",
+  "#18 t",
+  "#19 set_power_on_mW 2500",
+  "#20 r",
+  "#21 dump 1024",
+  "#22 set on_delay_ms=60000 off_delay_ms=10000",
+  "#23 proto bin",
+  "#24 uplink off",
+  "#25 all",
+  "hello",
+};
+
+#define BENCH_LINE_COUNT (sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+static volatile uint32_t bench_sink;
+static float bench_voltage_V = 12.84;
+static float bench_current_mA = 187.3;
+static float bench_power_mW = 2404.0;
+
+static void formatSolarJson() {
+  response.beginJson();
+  response.addString("sensor", "solar_pwr");
+  response.addFloat("voltage_V", bench_voltage_V);
+  response.addFloat("current_mA", bench_current_mA);
+  response.addFloat("power_mW", bench_power_mW);
+  response.addUnsigned("age_ms", 12);
+  response.addUnsigned("conversion_us", 532);
+  response.send();
+}
+
+static void formatSolarFrame() {
+  response.beginFrame(FRAME_SOLAR);
+  response.putFloat(bench_voltage_V);
+  response.putFloat(bench_current_mA);
+  response.putFloat(bench_power_mW);
+  response.putU32(12);
+  response.putU32(532);
+  response.send();
+}
+
+static void handleReply(const CommandArg &arg) {
+  bench_sink += arg.u;
+  formatSolarJson();
+}
+
+static void handleAck(const CommandArg &) {
+  response.beginJson();
+  response.addString("status", "ok");
+  response.send();
+}
+
+// Same names in the same order as the firmware table, so findCommand()
+// walks as far as it would on the device; the handlers only format replies.
+static const Command bench_commands[] = {
+  { "o", parseNone, handleReply, false }, { "i", parseNone, handleReply, false }, { "t", parseNone, handleReply, false },
+  { "temps", parseNone, handleReply, false }, { "sensors", parseNone, handleReply, false },
+  { "discover", parseNone, handleAck, false }, { "label", parseText, handleAck, false }, { "s", parseNone, handleReply, false },
+  { "r", parseNone, handleReply, false }, { "r1", parseNone, handleAck, true }, { "r0", parseNone, handleAck, true },
+  { "auto", parseNone, handleAck, true }, { "manual", parseNone, handleAck, true },
+  { "set", parseText, handleAck, true }, { "set_power_on_mW", parsePositiveFloat, handleAck, true },
+  { "set_power_off_mW", parsePositiveFloat, handleAck, true },
+  { "set_voltage_cutoff_V", parsePositiveFloat, handleAck, true },
+  { "set_voltage_high_on_V", parsePositiveFloat, handleAck, true },
+  { "set_debounce_ms", parsePositiveUnsigned, handleAck, true }, { "relay_filter", parseText, handleAck, true },
+  { "set_temp_period_ms", parsePositiveUnsigned, handleAck, true },
+  { "set_sample_period_ms", parsePositiveUnsigned, handleAck, true },
+  { "temp_res", parseText, handleAck, true }, { "set_temp_budget_ms", parsePositiveUnsigned, handleAck, true },
+  { "set_control_period_ms", parsePositiveUnsigned, handleAck, true },
+  { "set_agg_window_ms", parsePositiveUnsigned, handleAck, true },
+  { "set_log_period_ms", parsePositiveUnsigned, handleAck, true }, { "set_ina_adc", parseText, handleAck, true },
+  { "dump", parseOptionalUnsigned, handleReply, false }, { "agg", parseOptionalUnsigned, handleReply, false },
+  { "time", parseEpochSeconds, handleAck, false }, { "backfill", parseOptionalUnsigned, handleReply, false },
+  { "flash_log", parseNone, handleReply, false }, { "stream", parseText, handleAck, false }, { "stop", parseNone, handleAck, false },
+  { "proto", parseProtocol, handleAck, false }, { "baud", parsePositiveUnsigned, handleAck, false },
+  { "tx", parseNone, handleReply, false }, { "set_tx_buffer", parsePositiveUnsigned, handleAck, true },
+  { "tx_policy", parseText, handleAck, true }, { "uplink", parseOnOff, handleAck, true },
+  { "uplink_peer", parseText, handleAck, true }, { "uplink_status", parseNone, handleReply, false },
+  { "set_uplink_period_ms", parsePositiveUnsigned, handleAck, true }, { "report", parseOnOff, handleAck, true },
+  { "report_status", parseNone, handleReply, false }, { "sleep", parseOnOff, handleAck, true },
+  { "cpu", parseOptionalUnsigned, handleAck, true }, { "power", parseNone, handleReply, false },
+  { "boot", parseNone, handleReply, false }, { "hello", parseNone, handleReply, false }, { "stats", parseNone, handleReply, false },
+  { "stats_reset", parseNone, handleAck, false }, { "get_settings", parseNone, handleReply, false },
+  { "all", parseNone, handleReply, false },
+};
+
+#define BENCH_COMMAND_COUNT (sizeof(bench_commands) / sizeof(bench_commands[0]))
+
+// Split and parse only: what the I/O task does before a handler runs.
+static void parseLine(const char *text) {
+  char line[BENCH_LINE_MAX];
+  strcpy(line, text);
+  char *cursor = line;
+  bool has_id;
+  uint16_t id;
+  char *name;
+  char *args;
+  if (!splitRequestId(cursor, has_id, id) || !splitCommandLine(cursor, name, args)) {
+    return;
+  }
+  const Command *command = findCommand(bench_commands, BENCH_COMMAND_COUNT, name);
+  CommandArg arg;
+  if (command && command->parse(args, arg)) {
+    bench_sink += id + (uint32_t)(uintptr_t)command;
+  }
+}
+
+// The firmware's dispatchCommand() minus persistence and timing.
+static void dispatchLine(const char *text) {
+  char line[BENCH_LINE_MAX];
+  strcpy(line, text);
+  char *cursor = line;
+  bool has_id;
+  uint16_t id;
+  char *name;
+  char *args;
+  if (!splitRequestId(cursor, has_id, id)) {
+    return;
+  }
+  if (!splitCommandLine(cursor, name, args)) {
+    return;
+  }
+  response.setRequestId(has_id ? id : RESPONSE_NO_REQUEST_ID);
+  const Command *command = findCommand(bench_commands, BENCH_COMMAND_COUNT, name);
+  CommandArg arg;
+  if (!command) {
+    response.sendLine("Invalid command.");
+  } else if (command->parse(args, arg)) {
+    command->handler(arg);
+  }
+  response.setRequestId(RESPONSE_NO_REQUEST_ID);
+}
+
+static void relayStep(RelayController &relay, uint32_t i) {
+  uint16_t voltage_raw = 3150 + (i * 7919) % 300;
+  uint16_t power_raw = 700 + (i * 104729) % 900;
+  bench_sink += relay.update(voltage_raw, power_raw, i * 100);
+}
+
+template <typename Body>
+static void run(const char *name, uint32_t iterations, Body body) {
+  Serial.resetBytesWritten();
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; i++) {
+    body(i);
+  }
+  double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double ns_per_op = elapsed_s * 1e9 / iterations;
+  printf("%-16s %10lu ops %9.1f ns/op %8.2f Mops/s", name, (unsigned long)iterations, ns_per_op,
+         iterations / elapsed_s / 1e6);
+  if (Serial.bytesWritten() > 0) {
+    printf(" %8.1f MB/s out", Serial.bytesWritten() / elapsed_s / 1e6);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  uint32_t iterations = BENCH_ITERATIONS;
+  if (argc > 1 && strcmp(argv[1], "--quick") == 0) {
+    iterations = BENCH_QUICK_ITERATIONS;
+  } else if (argc > 1) {
+    fprintf(stderr, "usage: %s [--quick]\n", argv[0]);
+    return 2;
+  }
+  tx_queue.begin(TX_QUEUE_DEFAULT_SIZE);
+
+  run("parse", iterations, [](uint32_t i) { parseLine(bench_lines[i % BENCH_LINE_COUNT]); });
+  run("dispatch", iterations, [](uint32_t i) { dispatchLine(bench_lines[i % BENCH_LINE_COUNT]); });
+  response.setBinary(false);
+  run("format_json", iterations, [](uint32_t) { formatSolarJson(); });
+  response.setBinary(true);
+  run("format_frame", iterations, [](uint32_t) { formatSolarFrame(); });
+  response.setBinary(false);
+
+  // The firmware defaults in INA219 register units.
+  RelayThresholds thresholds = { 2875, 3025, 3350, 1000, 250, 60000, 10000, RELAY_FILTER_MEDIAN, 5 };
+  RelayController relay;
+  relay.setThresholds(thresholds);
+  run("relay_median", iterations, [&relay](uint32_t i) { relayStep(relay, i); });
+  thresholds.filter = RELAY_FILTER_EMA;
+  thresholds.filter_depth = 3;
+  relay.setThresholds(thresholds);
+  run("relay_ema", iterations, [&relay](uint32_t i) { relayStep(relay, i); });
+  return 0;
+}
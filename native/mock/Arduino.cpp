@@ -0,0 +1,93 @@
+#include "Arduino.h"
+
+#define MOCK_PIN_COUNT 32
+
+static uint64_t mock_us = 0;
+static uint8_t mock_pins[MOCK_PIN_COUNT];
+
+HardwareSerial Serial;
+
+size_t Print::write(const uint8_t *data, size_t length) {
+  size_t written = 0;
+  while (written < length && write(data[written])) {
+    written++;
+  }
+  return written;
+}
+
+size_t Print::write(const char *text) {
+  return write((const uint8_t *)text, strlen(text));
+}
+
+int Print::availableForWrite() {
+  return 0;
+}
+
+HardwareSerial::HardwareSerial() : bytes_written_(0) {
+}
+
+size_t HardwareSerial::write(uint8_t) {
+  bytes_written_++;
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *, size_t length) {
+  bytes_written_ += length;
+  return length;
+}
+
+// The UART never backs up on the host, so the TX queue always passes
+// messages straight through.
+int HardwareSerial::availableForWrite() {
+  return 0x10000;
+}
+
+size_t HardwareSerial::bytesWritten() const {
+  return bytes_written_;
+}
+
+void HardwareSerial::resetBytesWritten() {
+  bytes_written_ = 0;
+}
+
+unsigned long millis() {
+  return mock_us / 1000;
+}
+
+unsigned long micros() {
+  return mock_us;
+}
+
+void delay(uint32_t ms) {
+  mock_us += (uint64_t)ms * 1000;
+}
+
+void delayMicroseconds(uint32_t us) {
+  mock_us += us;
+}
+
+// Pins read back what was last written; an input pulled up reads HIGH, so
+// the bus-recovery loop in the INA219 driver sees a released SDA line.
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin < MOCK_PIN_COUNT && mode == INPUT_PULLUP) {
+    mock_pins[pin] = HIGH;
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < MOCK_PIN_COUNT) {
+    mock_pins[pin] = value ? HIGH : LOW;
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < MOCK_PIN_COUNT ? mock_pins[pin] : LOW;
+}
+
+void mockSetMillis(unsigned long ms) {
+  mock_us = (uint64_t)ms * 1000;
+}
+
+void mockAdvanceMillis(unsigned long ms) {
+  mock_us += (uint64_t)ms * 1000;
+}
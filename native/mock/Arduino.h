@@ -0,0 +1,66 @@
+#ifndef MOCK_ARDUINO_H
+#define MOCK_ARDUINO_H
+
+// The slice of the Arduino-ESP32 core that the host-built modules use:
+// Print, a HardwareSerial that only counts what is written, GPIO stubs and
+// a clock the test drives with mockSetMillis() / mockAdvanceMillis().
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+#define LOW 0x0
+#define HIGH 0x1
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define OUTPUT_OPEN_DRAIN 0x13
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t byte) = 0;
+  virtual size_t write(const uint8_t *data, size_t length);
+  size_t write(const char *text);
+  virtual int availableForWrite();
+  virtual void flush() {}
+};
+
+class HardwareSerial : public Print {
+public:
+  HardwareSerial();
+
+  size_t write(uint8_t byte) override;
+  size_t write(const uint8_t *data, size_t length) override;
+  int availableForWrite() override;
+
+  size_t bytesWritten() const;
+  void resetBytesWritten();
+
+private:
+  size_t bytes_written_;
+};
+
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+void mockSetMillis(unsigned long ms);
+void mockAdvanceMillis(unsigned long ms);
+
+#endif
@@ -0,0 +1,51 @@
+#include "DallasTemperature.h"
+
+DallasTemperature::DallasTemperature(OneWire *bus) : bus_(bus) {
+  for (uint8_t i = 0; i < MOCK_ONEWIRE_MAX_DEVICES; i++) {
+    resolution_[i] = DS18B20_DEFAULT_RESOLUTION;
+    scratchpad_[i] = 0;
+    valid_[i] = false;
+  }
+}
+
+void DallasTemperature::begin() {
+}
+
+uint8_t DallasTemperature::getDeviceCount() {
+  return bus_->deviceCount();
+}
+
+bool DallasTemperature::getAddress(DeviceAddress address, uint8_t index) {
+  return bus_->address(index, address);
+}
+
+bool DallasTemperature::setResolution(const DeviceAddress address, uint8_t resolution) {
+  if (address[2] >= bus_->deviceCount() || resolution < 9 || resolution > 12) {
+    return false;
+  }
+  resolution_[address[2]] = resolution;
+  return true;
+}
+
+uint8_t DallasTemperature::getResolution(const DeviceAddress address) {
+  return address[2] < bus_->deviceCount() ? resolution_[address[2]] : 0;
+}
+
+// Latches every device at once, like a skip-ROM convert T, so later reads
+// see the values from this conversion.
+void DallasTemperature::requestTemperatures() {
+  for (uint8_t i = 0; i < bus_->deviceCount(); i++) {
+    valid_[i] = bus_->readScratchpad(i, resolution_[i], scratchpad_[i]);
+  }
+}
+
+float DallasTemperature::getTempC(const DeviceAddress address) {
+  return getTempCByIndex(address[2]);
+}
+
+float DallasTemperature::getTempCByIndex(uint8_t index) {
+  if (index >= bus_->deviceCount() || !valid_[index]) {
+    return DEVICE_DISCONNECTED_C;
+  }
+  return scratchpad_[index] / 16.0f;
+}
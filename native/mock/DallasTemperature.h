@@ -0,0 +1,32 @@
+#ifndef MOCK_DALLAS_TEMPERATURE_H
+#define MOCK_DALLAS_TEMPERATURE_H
+
+#include "OneWire.h"
+
+#define DEVICE_DISCONNECTED_C -127
+#define DS18B20_DEFAULT_RESOLUTION 12
+
+// The DallasTemperature calls the firmware makes, answered from the
+// simulated devices on a mock OneWire bus and quantized to the resolution
+// each device is configured with.
+class DallasTemperature {
+public:
+  explicit DallasTemperature(OneWire *bus);
+
+  void begin();
+  uint8_t getDeviceCount();
+  bool getAddress(DeviceAddress address, uint8_t index);
+  bool setResolution(const DeviceAddress address, uint8_t resolution);
+  uint8_t getResolution(const DeviceAddress address);
+  void requestTemperatures();
+  float getTempC(const DeviceAddress address);
+  float getTempCByIndex(uint8_t index);
+
+private:
+  OneWire *bus_;
+  uint8_t resolution_[MOCK_ONEWIRE_MAX_DEVICES];
+  int16_t scratchpad_[MOCK_ONEWIRE_MAX_DEVICES];
+  bool valid_[MOCK_ONEWIRE_MAX_DEVICES];
+};
+
+#endif
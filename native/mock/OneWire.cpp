@@ -0,0 +1,55 @@
+#include "OneWire.h"
+#include "DallasTemperature.h"
+
+#define DS18B20_FAMILY 0x28
+
+OneWire::OneWire(uint8_t pin) : pin_(pin), count_(0) {
+  memset(devices_, 0, sizeof(devices_));
+}
+
+uint8_t OneWire::addDevice(float temp_C) {
+  if (count_ >= MOCK_ONEWIRE_MAX_DEVICES) {
+    return count_ - 1;
+  }
+  devices_[count_].temp_C = temp_C;
+  devices_[count_].connected = true;
+  return count_++;
+}
+
+void OneWire::setTemperature(uint8_t index, float temp_C) {
+  if (index < count_) {
+    devices_[index].temp_C = temp_C;
+  }
+}
+
+void OneWire::setConnected(uint8_t index, bool connected) {
+  if (index < count_) {
+    devices_[index].connected = connected;
+  }
+}
+
+uint8_t OneWire::deviceCount() const {
+  return count_;
+}
+
+bool OneWire::address(uint8_t index, DeviceAddress address) const {
+  if (index >= count_) {
+    return false;
+  }
+  memset(address, 0, sizeof(DeviceAddress));
+  address[0] = DS18B20_FAMILY;
+  address[1] = pin_;
+  address[2] = index;
+  return true;
+}
+
+// The DS18B20 temperature register: sixteenths of a degree, with the bits
+// below the configured resolution left at zero. Fails for a device that
+// does not answer, where the real library would see a CRC error.
+bool OneWire::readScratchpad(uint8_t index, uint8_t resolution, int16_t &raw) const {
+  if (index >= count_ || !devices_[index].connected) {
+    return false;
+  }
+  raw = (int16_t)lroundf(devices_[index].temp_C * 16.0f) & ~((1 << (12 - resolution)) - 1);
+  return true;
+}
@@ -0,0 +1,35 @@
+#ifndef MOCK_ONEWIRE_H
+#define MOCK_ONEWIRE_H
+
+#include "Arduino.h"
+
+#define MOCK_ONEWIRE_MAX_DEVICES 8
+
+typedef uint8_t DeviceAddress[8];
+
+// A OneWire bus populated with simulated DS18B20s. Tests add devices and
+// set what each one would measure; DallasTemperature reads them back.
+class OneWire {
+public:
+  explicit OneWire(uint8_t pin);
+
+  uint8_t addDevice(float temp_C);
+  void setTemperature(uint8_t index, float temp_C);
+  void setConnected(uint8_t index, bool connected);
+
+  uint8_t deviceCount() const;
+  bool address(uint8_t index, DeviceAddress address) const;
+  bool readScratchpad(uint8_t index, uint8_t resolution, int16_t &raw) const;
+
+private:
+  struct Device {
+    float temp_C;
+    bool connected;
+  };
+
+  uint8_t pin_;
+  uint8_t count_;
+  Device devices_[MOCK_ONEWIRE_MAX_DEVICES];
+};
+
+#endif
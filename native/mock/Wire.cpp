@@ -0,0 +1,69 @@
+#include "Wire.h"
+
+TwoWire Wire;
+
+TwoWire::TwoWire()
+  : address_(0), tx_length_(0), rx_length_(0), rx_index_(0), transaction_count_(0) {
+  memset(devices_, 0, sizeof(devices_));
+}
+
+bool TwoWire::begin(int, int, uint32_t) {
+  return true;
+}
+
+bool TwoWire::end() {
+  return true;
+}
+
+bool TwoWire::setClock(uint32_t) {
+  return true;
+}
+
+void TwoWire::setTimeOut(uint16_t) {
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+  address_ = address & 0x7F;
+  tx_length_ = 0;
+}
+
+size_t TwoWire::write(uint8_t byte) {
+  if (tx_length_ >= MOCK_WIRE_BUFFER) {
+    return 0;
+  }
+  tx_[tx_length_++] = byte;
+  return 1;
+}
+
+// Returns the Arduino status codes: 0 on success, 2 for an address NACK.
+uint8_t TwoWire::endTransmission(bool) {
+  transaction_count_++;
+  I2CDevice *device = devices_[address_];
+  if (!device) {
+    return 2;
+  }
+  return device->receive(tx_, tx_length_) ? 0 : 3;
+}
+
+size_t TwoWire::requestFrom(uint8_t address, size_t length) {
+  transaction_count_++;
+  I2CDevice *device = devices_[address & 0x7F];
+  rx_index_ = 0;
+  rx_length_ = 0;
+  if (device) {
+    rx_length_ = device->transmit(rx_, min(length, (size_t)MOCK_WIRE_BUFFER));
+  }
+  return rx_length_;
+}
+
+int TwoWire::read() {
+  return rx_index_ < rx_length_ ? rx_[rx_index_++] : -1;
+}
+
+void TwoWire::attach(uint8_t address, I2CDevice *device) {
+  devices_[address & 0x7F] = device;
+}
+
+uint32_t TwoWire::transactionCount() const {
+  return transaction_count_;
+}
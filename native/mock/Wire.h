@@ -0,0 +1,51 @@
+#ifndef MOCK_WIRE_H
+#define MOCK_WIRE_H
+
+#include "Arduino.h"
+
+#define MOCK_WIRE_BUFFER 32
+
+// A register-addressed I2C target on the mock bus. A write transaction
+// arrives as one call with the register pointer first; a read returns
+// bytes starting at the last register written.
+class I2CDevice {
+public:
+  virtual ~I2CDevice() {}
+  virtual bool receive(const uint8_t *data, size_t length) = 0;
+  virtual size_t transmit(uint8_t *data, size_t length) = 0;
+};
+
+// TwoWire as the INA219 driver uses it, routed to the devices attached
+// with attach(). Transactions to an empty address NACK like real hardware.
+class TwoWire {
+public:
+  TwoWire();
+
+  bool begin(int sda_pin, int scl_pin, uint32_t frequency);
+  bool end();
+  bool setClock(uint32_t frequency);
+  void setTimeOut(uint16_t timeout_ms);
+
+  void beginTransmission(uint8_t address);
+  size_t write(uint8_t byte);
+  uint8_t endTransmission(bool send_stop = true);
+  size_t requestFrom(uint8_t address, size_t length);
+  int read();
+
+  void attach(uint8_t address, I2CDevice *device);
+  uint32_t transactionCount() const;
+
+private:
+  I2CDevice *devices_[128];
+  uint8_t address_;
+  uint8_t tx_[MOCK_WIRE_BUFFER];
+  size_t tx_length_;
+  uint8_t rx_[MOCK_WIRE_BUFFER];
+  size_t rx_length_;
+  size_t rx_index_;
+  uint32_t transaction_count_;
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,6 @@
+#include "task.h"
+#include "Arduino.h"
+
+void vTaskDelay(TickType_t ticks) {
+  mockAdvanceMillis(ticks * portTICK_PERIOD_MS);
+}
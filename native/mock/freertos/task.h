@@ -0,0 +1,9 @@
+#ifndef MOCK_FREERTOS_TASK_H
+#define MOCK_FREERTOS_TASK_H
+
+#include "FreeRTOS.h"
+
+// There is only one task on the host; a delay just moves the mock clock.
+void vTaskDelay(TickType_t ticks);
+
+#endif
@@ -0,0 +1,85 @@
+#include "mock_ina219.h"
+#include "ina219_driver.h"
+
+#define INA219_MODE_MASK 0x0007
+#define INA219_SHUNT_LSB_uV 10
+#define INA219_BUS_MAX_RAW 0x1FFF
+
+static int16_t clampSigned(float value) {
+  value = roundf(value);
+  return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : (int16_t)value;
+}
+
+MockINA219::MockINA219()
+  : bus_V_(0), current_mA_(0), power_mW_(0), failing_(false), pointer_(0), conversion_count_(0) {
+  memset(registers_, 0, sizeof(registers_));
+}
+
+void MockINA219::set(float bus_V, float current_mA, float power_mW) {
+  bus_V_ = bus_V;
+  current_mA_ = current_mA;
+  power_mW_ = power_mW;
+}
+
+void MockINA219::setFailing(bool failing) {
+  failing_ = failing;
+}
+
+uint16_t MockINA219::config() const {
+  return registers_[INA219_REG_CONFIG];
+}
+
+uint16_t MockINA219::calibration() const {
+  return registers_[INA219_REG_CALIBRATION];
+}
+
+uint32_t MockINA219::conversionCount() const {
+  return conversion_count_;
+}
+
+bool MockINA219::receive(const uint8_t *data, size_t length) {
+  if (failing_ || length == 0 || data[0] > INA219_REG_CALIBRATION) {
+    return false;
+  }
+  pointer_ = data[0];
+  if (length < 3) {
+    return true;
+  }
+  uint16_t value = ((uint16_t)data[1] << 8) | data[2];
+  if (pointer_ == INA219_REG_CONFIG) {
+    registers_[INA219_REG_CONFIG] = value;
+    registers_[INA219_REG_BUS_VOLTAGE] &= ~INA219_CNVR_BIT;
+    if ((value & INA219_MODE_MASK) == INA219_MODE_TRIGGERED) {
+      convert();
+    }
+  } else if (pointer_ == INA219_REG_CALIBRATION) {
+    registers_[INA219_REG_CALIBRATION] = value & 0xFFFE;
+  }
+  return true;
+}
+
+size_t MockINA219::transmit(uint8_t *data, size_t length) {
+  if (failing_ || length < 2) {
+    return 0;
+  }
+  uint16_t value = registers_[pointer_];
+  data[0] = value >> 8;
+  data[1] = value & 0xFF;
+  if (pointer_ == INA219_REG_POWER) {
+    registers_[INA219_REG_BUS_VOLTAGE] &= ~INA219_CNVR_BIT;
+  }
+  return 2;
+}
+
+// Without a calibration the chip leaves power and current at zero, so the
+// driver has to program it before the first conversion to read anything.
+void MockINA219::convert() {
+  conversion_count_++;
+  uint16_t bus_raw = INA219Driver::busVoltageRawFrom_V(bus_V_ > 0 ? bus_V_ : 0);
+  registers_[INA219_REG_BUS_VOLTAGE] = (min(bus_raw, (uint16_t)INA219_BUS_MAX_RAW) << 3) | INA219_CNVR_BIT;
+  registers_[INA219_REG_SHUNT_VOLTAGE] =
+    (uint16_t)clampSigned(current_mA_ * MOCK_INA219_SHUNT_mOHM / INA219_SHUNT_LSB_uV);
+  bool calibrated = registers_[INA219_REG_CALIBRATION] == INA219_CALIBRATION_32V_2A;
+  registers_[INA219_REG_CURRENT] = calibrated ? (uint16_t)clampSigned(current_mA_ / INA219_CURRENT_LSB_mA) : 0;
+  registers_[INA219_REG_POWER] = calibrated ? INA219Driver::powerRawFrom_mW(power_mW_ > 0 ? power_mW_ : 0) : 0;
+}
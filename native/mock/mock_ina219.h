@@ -0,0 +1,39 @@
+#ifndef MOCK_INA219_H
+#define MOCK_INA219_H
+
+#include "Wire.h"
+
+#define MOCK_INA219_SHUNT_mOHM 100
+
+// Register model of an INA219 in triggered mode, calibrated as the firmware
+// does for 32 V / 2 A. set() is what the chip would measure; a write of a
+// triggered mode to the config register latches it into the result
+// registers and sets CNVR, which reading the power register clears again.
+// setFailing() makes the chip stop acknowledging, as a loose wire would.
+class MockINA219 : public I2CDevice {
+public:
+  MockINA219();
+
+  void set(float bus_V, float current_mA, float power_mW);
+  void setFailing(bool failing);
+
+  uint16_t config() const;
+  uint16_t calibration() const;
+  uint32_t conversionCount() const;
+
+  bool receive(const uint8_t *data, size_t length) override;
+  size_t transmit(uint8_t *data, size_t length) override;
+
+private:
+  void convert();
+
+  float bus_V_;
+  float current_mA_;
+  float power_mW_;
+  bool failing_;
+  uint8_t pointer_;
+  uint16_t registers_[6];
+  uint32_t conversion_count_;
+};
+
+#endif
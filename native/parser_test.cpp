@@ -0,0 +1,57 @@
+// Checks the numeric argument parsers shared with the firmware: unsigned
+// settings must be whole decimal numbers, and epoch seconds from the host
+// must come back exactly, not rounded the way a float would.
+
+#include <stdio.h>
+#include <time.h>
+
+#include <Arduino.h>
+
+#include "command_parser.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, const char *text) {
+  if (!ok) {
+    printf("FAIL %s: \"%s\"\n", what, text);
+    failures++;
+  }
+}
+
+static void expectUnsigned(const char *text, unsigned long expected) {
+  CommandArg arg;
+  check(parsePositiveUnsigned(text, arg) && arg.u == expected, "parsePositiveUnsigned accepts", text);
+}
+
+static void expectRejected(const char *text) {
+  CommandArg arg;
+  check(!parsePositiveUnsigned(text, arg), "parsePositiveUnsigned rejects", text);
+}
+
+static void expectEpoch(uint32_t epoch_s) {
+  char text[16];
+  snprintf(text, sizeof(text), "%lu", (unsigned long)epoch_s);
+  CommandArg arg;
+  check(parseEpochSeconds(text, arg) && arg.epoch_s == epoch_s, "parseEpochSeconds round-trips", text);
+}
+
+int main() {
+  expectUnsigned("1", 1);
+  expectUnsigned("60000", 60000);
+  expectUnsigned("16777217", 16777217);
+  expectUnsigned("4294967295", 4294967295UL);
+  const char *const rejected[] = { "", "0", "1.5", "1e3", "-5", "+5", " 5", "5 ", "5ms", "4294967296",
+                                   "99999999999999999999999" };
+  for (const char *text : rejected) {
+    expectRejected(text);
+  }
+
+  expectEpoch(1760443201);
+  expectEpoch((uint32_t)time(NULL));
+  expectEpoch(4294967295UL);
+  CommandArg arg;
+  check(!parseEpochSeconds("1760443201.0", arg), "parseEpochSeconds rejects", "1760443201.0");
+
+  printf("%s parser_test\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
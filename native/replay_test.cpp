@@ -0,0 +1,95 @@
+// Replays recorded solar traces through the relay state machine and checks
+// every switch against the trace's expect lines. With --print the switches
+// are written out in expect syntax instead, to seed a newly recorded trace.
+//
+//   replay_test [--print] <trace>...
+
+#include <stdio.h>
+
+#include <Arduino.h>
+
+#include "solar_trace.h"
+
+static const char *eventName(const TraceEvent &event) {
+  return event.trip ? "trip" : event.on ? "on" : "off";
+}
+
+static bool sameEvent(const TraceEvent &a, const TraceEvent &b) {
+  return a.t_ms == b.t_ms && a.on == b.on && a.trip == b.trip;
+}
+
+static void printEvents(const ReplayResult &result) {
+  for (const TraceEvent &event : result.events) {
+    printf("expect %lu %s\n", (unsigned long)event.t_ms, eventName(event));
+  }
+  printf("expect reports %lu\n", (unsigned long)result.reports);
+}
+
+static bool checkTrace(const SolarTrace &trace, const ReplayResult &result) {
+  bool ok = true;
+  size_t count = max(trace.expected.size(), result.events.size());
+  for (size_t i = 0; i < count; i++) {
+    const TraceEvent *expected = i < trace.expected.size() ? &trace.expected[i] : NULL;
+    const TraceEvent *actual = i < result.events.size() ? &result.events[i] : NULL;
+    if (expected && actual && sameEvent(*expected, *actual)) {
+      continue;
+    }
+    ok = false;
+    printf("  switch %zu: expected", i + 1);
+    if (expected) {
+      printf(" %s at %lu ms", eventName(*expected), (unsigned long)expected->t_ms);
+    } else {
+      printf(" none");
+    }
+    printf(", got");
+    if (actual) {
+      printf(" %s at %lu ms\n", eventName(*actual), (unsigned long)actual->t_ms);
+    } else {
+      printf(" none\n");
+    }
+  }
+  if (trace.expected_reports >= 0 && (uint32_t)trace.expected_reports != result.reports) {
+    ok = false;
+    printf("  reports: expected %ld, got %lu\n", trace.expected_reports, (unsigned long)result.reports);
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  bool print = false;
+  int failures = 0;
+  int traces = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--print") == 0) {
+      print = true;
+      continue;
+    }
+    SolarTrace trace;
+    std::string error;
+    traces++;
+    if (!loadTrace(argv[i], trace, error)) {
+      printf("FAIL %s\n", error.c_str());
+      failures++;
+      continue;
+    }
+    ReplayResult result = replayTrace(trace);
+    if (print) {
+      printf("# %s\n", trace.name.c_str());
+      printEvents(result);
+      continue;
+    }
+    bool ok = checkTrace(trace, result);
+    printf("%s %s: %zu samples, %zu switches, %u fast trips, %lu reports, %lu I2C errors, on %lu s, off %lu s\n",
+           ok ? "PASS" : "FAIL", trace.name.c_str(), trace.samples.size(), result.events.size(),
+           (unsigned)result.stats.fast_trips, (unsigned long)result.reports, (unsigned long)result.i2c_errors,
+           (unsigned long)(result.stats.on_ms / 1000), (unsigned long)(result.stats.off_ms / 1000));
+    if (!ok) {
+      failures++;
+    }
+  }
+  if (traces == 0) {
+    fprintf(stderr, "usage: %s [--print] <trace>...\n", argv[0]);
+    return 2;
+  }
+  return failures ? 1 : 0;
+}
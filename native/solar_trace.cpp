@@ -0,0 +1,345 @@
+#include "solar_trace.h"
+
+#include <stdio.h>
+
+#include <Arduino.h>
+#include <DallasTemperature.h>
+#include <Wire.h>
+
+#include "command_parser.h"
+#include "ina219_driver.h"
+#include "mock_ina219.h"
+
+#define TRACE_LINE_MAX 256
+#define TRACE_INA219_ADDRESS 0x40
+#define TRACE_INDOOR_INDEX 0
+#define TRACE_OUTDOOR_INDEX 1
+
+TraceSettings defaultTraceSettings() {
+  TraceSettings settings;
+  settings.power_on_mW = 2000.0;
+  settings.power_off_mW = 500.0;
+  settings.voltage_cutoff_V = 12.1;
+  settings.voltage_high_on_V = 13.4;
+  settings.voltage_emergency_V = 11.5;
+  settings.on_delay_ms = 60000;
+  settings.off_delay_ms = 10000;
+  settings.filter = RELAY_FILTER_MEDIAN;
+  settings.filter_depth = 5;
+  settings.deadbands.temp_C = 0.2;
+  settings.deadbands.voltage_mV = 100.0;
+  settings.deadbands.current_mA = 20.0;
+  settings.deadbands.power_mW = 250.0;
+  settings.deadbands.heartbeat_ms = 900000;
+  settings.start_on = false;
+  settings.manual = false;
+  return settings;
+}
+
+RelayThresholds rawThresholds(const TraceSettings &settings) {
+  RelayThresholds thresholds;
+  thresholds.voltage_emergency_raw = INA219Driver::busVoltageRawFrom_V(settings.voltage_emergency_V);
+  thresholds.voltage_low_cutoff_raw = INA219Driver::busVoltageRawFrom_V(settings.voltage_cutoff_V);
+  thresholds.voltage_high_on_raw = INA219Driver::busVoltageRawFrom_V(settings.voltage_high_on_V);
+  thresholds.power_on_raw = INA219Driver::powerRawFrom_mW(settings.power_on_mW);
+  thresholds.power_off_raw = INA219Driver::powerRawFrom_mW(settings.power_off_mW);
+  thresholds.on_delay_ms = settings.on_delay_ms;
+  thresholds.off_delay_ms = settings.off_delay_ms;
+  thresholds.filter = settings.filter;
+  thresholds.filter_depth = settings.filter_depth;
+  return thresholds;
+}
+
+struct TraceFloatKey {
+  const char *key;
+  float TraceSettings::*value;
+};
+
+struct TraceUnsignedKey {
+  const char *key;
+  unsigned long TraceSettings::*value;
+};
+
+static const TraceFloatKey float_keys[] = {
+  { "power_on_mW", &TraceSettings::power_on_mW },
+  { "power_off_mW", &TraceSettings::power_off_mW },
+  { "voltage_cutoff_V", &TraceSettings::voltage_cutoff_V },
+  { "voltage_high_on_V", &TraceSettings::voltage_high_on_V },
+  { "voltage_emergency_V", &TraceSettings::voltage_emergency_V },
+};
+
+static const TraceUnsignedKey unsigned_keys[] = {
+  { "on_delay_ms", &TraceSettings::on_delay_ms },
+  { "off_delay_ms", &TraceSettings::off_delay_ms },
+};
+
+// The keys of the firmware's set command, plus filter, depth, start and
+// mode for what the relay_filter, r1/r0 and auto/manual commands cover.
+static bool applySetting(TraceSettings &settings, const char *key, const char *value) {
+  CommandArg arg;
+  for (const TraceFloatKey &entry : float_keys) {
+    if (strcmp(key, entry.key) == 0) {
+      if (!parsePositiveFloat(value, arg)) {
+        return false;
+      }
+      settings.*entry.value = arg.f;
+      return true;
+    }
+  }
+  for (const TraceUnsignedKey &entry : unsigned_keys) {
+    if (strcmp(key, entry.key) == 0) {
+      if (!parsePositiveUnsigned(value, arg)) {
+        return false;
+      }
+      settings.*entry.value = arg.u;
+      return true;
+    }
+  }
+  if (strcmp(key, "db_temp_C") == 0 || strcmp(key, "db_voltage_mV") == 0 || strcmp(key, "db_current_mA") == 0
+      || strcmp(key, "db_power_mW") == 0) {
+    if (!parsePositiveFloat(value, arg)) {
+      return false;
+    }
+    float &deadband = key[3] == 't' ? settings.deadbands.temp_C : key[3] == 'v' ? settings.deadbands.voltage_mV
+                    : key[3] == 'c' ? settings.deadbands.current_mA : settings.deadbands.power_mW;
+    deadband = arg.f;
+    return true;
+  }
+  if (strcmp(key, "heartbeat_ms") == 0) {
+    if (!parsePositiveUnsigned(value, arg)) {
+      return false;
+    }
+    settings.deadbands.heartbeat_ms = arg.u;
+    return true;
+  }
+  if (strcmp(key, "filter") == 0) {
+    if (strcmp(value, "none") == 0) {
+      settings.filter = RELAY_FILTER_NONE;
+    } else if (strcmp(value, "ema") == 0) {
+      settings.filter = RELAY_FILTER_EMA;
+    } else if (strcmp(value, "median") == 0) {
+      settings.filter = RELAY_FILTER_MEDIAN;
+    } else {
+      return false;
+    }
+    return true;
+  }
+  if (strcmp(key, "depth") == 0) {
+    if (!parsePositiveUnsigned(value, arg) || arg.u > RELAY_MEDIAN_MAX) {
+      return false;
+    }
+    settings.filter_depth = arg.u;
+    return true;
+  }
+  if (strcmp(key, "mode") == 0) {
+    if (strcmp(value, "auto") == 0) {
+      settings.manual = false;
+    } else if (strcmp(value, "manual") == 0) {
+      settings.manual = true;
+    } else {
+      return false;
+    }
+    return true;
+  }
+  if (strcmp(key, "start") == 0) {
+    if (!parseOnOff(value, arg)) {
+      return false;
+    }
+    settings.start_on = arg.u;
+    return true;
+  }
+  return false;
+}
+
+static bool parseSettings(TraceSettings &settings, char *args) {
+  for (char *pair = strtok(args, " \t"); pair; pair = strtok(NULL, " \t")) {
+    char *value = strchr(pair, '=');
+    if (!value) {
+      return false;
+    }
+    *value++ = '\0';
+    if (!applySetting(settings, pair, value)) {
+      return false;
+    }
+  }
+  if (settings.filter == RELAY_FILTER_EMA && settings.filter_depth > RELAY_EMA_MAX_SHIFT) {
+    return false;
+  }
+  return settings.power_off_mW <= settings.power_on_mW && settings.voltage_cutoff_V < settings.voltage_high_on_V
+      && settings.voltage_emergency_V < settings.voltage_cutoff_V;
+}
+
+static bool parseExpect(SolarTrace &trace, char *args) {
+  char what[8];
+  unsigned long value;
+  if (sscanf(args, "reports %lu", &value) == 1) {
+    trace.expected_reports = value;
+    return true;
+  }
+  if (sscanf(args, "%lu %7s", &value, what) != 2) {
+    return false;
+  }
+  TraceEvent event;
+  event.t_ms = value;
+  event.on = strcmp(what, "on") == 0;
+  event.trip = strcmp(what, "trip") == 0;
+  if (!event.on && !event.trip && strcmp(what, "off") != 0) {
+    return false;
+  }
+  trace.expected.push_back(event);
+  return true;
+}
+
+// "-" stands for a reading that is missing.
+static bool parseReading(const char *text, float &value) {
+  if (strcmp(text, "-") == 0) {
+    value = NAN;
+    return true;
+  }
+  char *end;
+  value = strtof(text, &end);
+  return end != text && *end == '\0';
+}
+
+static bool parseSample(SolarTrace &trace, char *line) {
+  char fields[6][24];
+  char extra;
+  if (sscanf(line, "%23s %23s %23s %23s %23s %23s %c", fields[0], fields[1], fields[2], fields[3], fields[4],
+             fields[5], &extra) != 6) {
+    return false;
+  }
+  CommandArg arg;
+  if (!parseOptionalUnsigned(fields[0], arg)) {
+    return false;
+  }
+  TraceSample sample;
+  sample.t_ms = arg.u;
+  if (!trace.samples.empty() && sample.t_ms <= trace.samples.back().t_ms) {
+    return false;
+  }
+  bool ok = parseReading(fields[1], sample.bus_V) && parseReading(fields[2], sample.current_mA)
+         && parseReading(fields[3], sample.power_mW) && parseReading(fields[4], sample.indoor_C)
+         && parseReading(fields[5], sample.outdoor_C);
+  if (ok) {
+    trace.samples.push_back(sample);
+  }
+  return ok;
+}
+
+bool loadTrace(const char *path, SolarTrace &trace, std::string &error) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    error = std::string("cannot open ") + path;
+    return false;
+  }
+  const char *base = strrchr(path, '/');
+  trace.name = base ? base + 1 : path;
+  trace.settings = defaultTraceSettings();
+  trace.samples.clear();
+  trace.expected.clear();
+  trace.expected_reports = -1;
+
+  char buffer[TRACE_LINE_MAX];
+  unsigned line_number = 0;
+  bool ok = true;
+  while (ok && fgets(buffer, sizeof(buffer), file)) {
+    line_number++;
+    buffer[strcspn(buffer, "\n")] = '\0';
+    char *comment = strchr(buffer, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    char sample_line[TRACE_LINE_MAX];
+    strcpy(sample_line, buffer);
+    char *name;
+    char *args;
+    if (!splitCommandLine(buffer, name, args)) {
+      continue;
+    }
+    if (strcmp(name, "set") == 0) {
+      ok = parseSettings(trace.settings, args);
+    } else if (strcmp(name, "expect") == 0) {
+      ok = parseExpect(trace, args);
+    } else {
+      ok = parseSample(trace, sample_line);
+    }
+  }
+  fclose(file);
+  if (!ok) {
+    error = trace.name + ":" + std::to_string(line_number) + ": malformed line";
+  } else if (trace.samples.empty()) {
+    error = trace.name + ": no samples";
+    ok = false;
+  }
+  return ok;
+}
+
+static float thermometerReading(DallasTemperature &sensors, uint8_t index) {
+  float temp_C = sensors.getTempCByIndex(index);
+  return temp_C == DEVICE_DISCONNECTED_C ? NAN : temp_C;
+}
+
+// The acquisition order of the firmware: a triggered INA219 conversion,
+// the relay decision on the raw registers (only the emergency cutoff in
+// manual mode), then a report-by-exception check on the snapshot
+// including both thermometers.
+ReplayResult replayTrace(const SolarTrace &trace) {
+  TwoWire wire;
+  MockINA219 chip;
+  wire.attach(TRACE_INA219_ADDRESS, &chip);
+  INA219Driver ina219(wire, TRACE_INA219_ADDRESS);
+
+  OneWire bus(0);
+  bus.addDevice(NAN);
+  bus.addDevice(NAN);
+  DallasTemperature sensors(&bus);
+  sensors.begin();
+
+  RelayController relay;
+  relay.setThresholds(rawThresholds(trace.settings));
+  ReportFilter reports;
+  reports.setDeadbands(trace.settings.deadbands);
+
+  uint32_t start_ms = trace.samples.front().t_ms;
+  mockSetMillis(start_ms);
+  ina219.begin(-1, -1, 400000);
+  relay.setState(trace.settings.start_on, start_ms);
+  relay.resetStats(start_ms);
+
+  ReplayResult result;
+  result.reports = 0;
+  for (const TraceSample &sample : trace.samples) {
+    mockSetMillis(sample.t_ms);
+    chip.setFailing(isnan(sample.bus_V));
+    chip.set(sample.bus_V, sample.current_mA, sample.power_mW);
+    bus.setConnected(TRACE_INDOOR_INDEX, !isnan(sample.indoor_C));
+    bus.setTemperature(TRACE_INDOOR_INDEX, sample.indoor_C);
+    bus.setConnected(TRACE_OUTDOOR_INDEX, !isnan(sample.outdoor_C));
+    bus.setTemperature(TRACE_OUTDOOR_INDEX, sample.outdoor_C);
+
+    INA219Raw raw = INA219Raw();
+    bool ready = false;
+    bool solar_valid = ina219.trigger() && ina219.poll(raw, ready) && ready;
+    uint16_t voltage_raw = INA219Driver::busVoltageRaw(raw);
+    bool changed = solar_valid && (trace.settings.manual ? relay.emergencyTrip(voltage_raw, sample.t_ms)
+                                                         : relay.update(voltage_raw, raw.power, sample.t_ms));
+    if (changed) {
+      TraceEvent event = { sample.t_ms, relay.isOn(), relay.lastSwitchWasTrip() };
+      result.events.push_back(event);
+    }
+
+    sensors.requestTemperatures();
+    ReportSample snapshot;
+    snapshot.indoor_C = thermometerReading(sensors, TRACE_INDOOR_INDEX);
+    snapshot.outdoor_C = thermometerReading(sensors, TRACE_OUTDOOR_INDEX);
+    snapshot.voltage_mV = solar_valid ? INA219Driver::busVoltage_V(raw) * 1000.0f : NAN;
+    snapshot.current_mA = solar_valid ? INA219Driver::current_mA(raw) : NAN;
+    snapshot.power_mW = solar_valid ? INA219Driver::power_mW(raw) : NAN;
+    if (reports.update(snapshot, sample.t_ms)) {
+      result.reports++;
+    }
+  }
+  result.i2c_errors = ina219.errorCount();
+  result.stats = relay.stats(trace.samples.back().t_ms);
+  return result;
+}
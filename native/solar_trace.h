@@ -0,0 +1,69 @@
+#ifndef SOLAR_TRACE_H
+#define SOLAR_TRACE_H
+
+#include <string>
+#include <vector>
+
+#include "relay_controller.h"
+#include "report_filter.h"
+
+// Relay and report settings a trace runs with, in the units of the
+// firmware's set command. Defaults match esp.cpp.
+struct TraceSettings {
+  float power_on_mW;
+  float power_off_mW;
+  float voltage_cutoff_V;
+  float voltage_high_on_V;
+  float voltage_emergency_V;
+  unsigned long on_delay_ms;
+  unsigned long off_delay_ms;
+  uint8_t filter;
+  uint8_t filter_depth;
+  ReportDeadbands deadbands;
+  bool start_on;
+  bool manual;
+};
+
+// One acquisition pass. A NAN bus voltage means the INA219 did not answer;
+// a NAN temperature means that DS18B20 dropped off the bus.
+struct TraceSample {
+  uint32_t t_ms;
+  float bus_V;
+  float current_mA;
+  float power_mW;
+  float indoor_C;
+  float outdoor_C;
+};
+
+struct TraceEvent {
+  uint32_t t_ms;
+  bool on;
+  bool trip;
+};
+
+// A recorded solar trace: settings, samples in time order and the relay
+// switches (and optionally the report count) a good build produces.
+struct SolarTrace {
+  std::string name;
+  TraceSettings settings;
+  std::vector<TraceSample> samples;
+  std::vector<TraceEvent> expected;
+  long expected_reports;
+};
+
+struct ReplayResult {
+  std::vector<TraceEvent> events;
+  uint32_t reports;
+  uint32_t i2c_errors;
+  RelayStats stats;
+};
+
+TraceSettings defaultTraceSettings();
+RelayThresholds rawThresholds(const TraceSettings &settings);
+
+bool loadTrace(const char *path, SolarTrace &trace, std::string &error);
+// Feeds every sample through the mocked INA219 and OneWire back-ends, the
+// real INA219 driver, RelayController and ReportFilter.
+ReplayResult replayTrace(const SolarTrace &trace);
+
+#endif
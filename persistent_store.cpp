@@ -0,0 +1,109 @@
+#include "persistent_store.h"
+
+PersistentStore store;
+
+static uint32_t crc32(const uint8_t *data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+PersistentStore::PersistentStore()
+  : record_count_(0), dirty_since_ms_(0), write_count_(0) {
+}
+
+bool PersistentStore::begin(const char *name_space) {
+  return preferences_.begin(name_space, false);
+}
+
+int PersistentStore::addRecord(const char *key, void *data, size_t length) {
+  if (record_count_ >= STORE_MAX_RECORDS) {
+    return -1;
+  }
+  Record &record = records_[record_count_];
+  record.key = key;
+  record.data = data;
+  record.length = length;
+  record.stored_crc = 0;
+  record.dirty = false;
+  return record_count_++;
+}
+
+bool PersistentStore::load(int record) {
+  if (record < 0 || record >= record_count_) {
+    return false;
+  }
+  Record &entry = records_[record];
+  if (preferences_.getBytesLength(entry.key) != entry.length ||
+      preferences_.getBytes(entry.key, entry.data, entry.length) != entry.length) {
+    return false;
+  }
+  entry.stored_crc = crc32((const uint8_t *)entry.data, entry.length);
+  return true;
+}
+
+// The commit clock starts at the first unsaved change and is never pushed
+// back, so a steady stream of marks cannot hold a write off forever.
+void PersistentStore::markDirty(int record) {
+  if (record < 0 || record >= record_count_) {
+    return;
+  }
+  Record &entry = records_[record];
+  if (entry.dirty || crc32((const uint8_t *)entry.data, entry.length) == entry.stored_crc) {
+    return;
+  }
+  if (!anyDirty()) {
+    dirty_since_ms_ = millis();
+  }
+  entry.dirty = true;
+}
+
+void PersistentStore::service() {
+  if (anyDirty() && millis() - dirty_since_ms_ >= STORE_COMMIT_DELAY_MS) {
+    flush();
+  }
+}
+
+bool PersistentStore::anyDirty() const {
+  for (uint8_t i = 0; i < record_count_; i++) {
+    if (records_[i].dirty) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PersistentStore::flush() {
+  for (uint8_t i = 0; i < record_count_; i++) {
+    if (records_[i].dirty) {
+      commit(records_[i]);
+    }
+  }
+  if (anyDirty()) {
+    dirty_since_ms_ = millis();
+  }
+}
+
+uint32_t PersistentStore::writeCount() const {
+  return write_count_;
+}
+
+bool PersistentStore::commit(Record &record) {
+  record.dirty = false;
+  uint32_t crc = crc32((const uint8_t *)record.data, record.length);
+  if (crc == record.stored_crc) {
+    return true;
+  }
+  if (preferences_.putBytes(record.key, record.data, record.length) != record.length) {
+    record.dirty = true;
+    return false;
+  }
+  record.stored_crc = crc;
+  write_count_++;
+  return true;
+}
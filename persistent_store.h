@@ -0,0 +1,47 @@
+#ifndef PERSISTENT_STORE_H
+#define PERSISTENT_STORE_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#define STORE_MAX_RECORDS 4
+#define STORE_COMMIT_DELAY_MS 5000
+
+// Fixed-size NVS blobs owned by the caller. markDirty() only schedules a
+// write, and ignores blobs whose CRC matches what is stored; service()
+// commits STORE_COMMIT_DELAY_MS after the first unsaved change.
+class PersistentStore {
+public:
+  PersistentStore();
+
+  bool begin(const char *name_space);
+  int addRecord(const char *key, void *data, size_t length);
+  bool load(int record);
+  void markDirty(int record);
+  void service();
+  void flush();
+
+  uint32_t writeCount() const;
+
+private:
+  struct Record {
+    const char *key;
+    void *data;
+    size_t length;
+    uint32_t stored_crc;
+    bool dirty;
+  };
+
+  bool anyDirty() const;
+  bool commit(Record &record);
+
+  Preferences preferences_;
+  Record records_[STORE_MAX_RECORDS];
+  uint8_t record_count_;
+  unsigned long dirty_since_ms_;
+  uint32_t write_count_;
+};
+
+extern PersistentStore store;
+
+#endif
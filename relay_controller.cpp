@@ -0,0 +1,166 @@
+#include "relay_controller.h"
+
+#include <string.h>
+
+#define RELAY_EMA_FRACTION_BITS 8
+
+RelayController::RelayController()
+  : thresholds_(), on_(false), pending_(false), pending_since_ms_(0), tripped_(false), history_count_(0), history_index_(0),
+    stats_(), state_since_ms_(0) {
+  resetFilter();
+}
+
+void RelayController::setThresholds(const RelayThresholds &thresholds) {
+  if (thresholds.filter != thresholds_.filter || thresholds.filter_depth != thresholds_.filter_depth) {
+    resetFilter();
+  }
+  thresholds_ = thresholds;
+}
+
+const RelayThresholds &RelayController::thresholds() const {
+  return thresholds_;
+}
+
+void RelayController::setState(bool on, uint32_t now_ms) {
+  if (on != on_) {
+    switchTo(on, now_ms);
+  }
+  pending_ = false;
+}
+
+bool RelayController::isOn() const {
+  return on_;
+}
+
+bool RelayController::desiredState(uint16_t voltage_raw, uint16_t power_raw) const {
+  if (voltage_raw >= thresholds_.voltage_high_on_raw
+      || (power_raw >= thresholds_.power_on_raw && voltage_raw > thresholds_.voltage_low_cutoff_raw)) {
+    return true;
+  }
+  if (power_raw <= thresholds_.power_off_raw || voltage_raw <= thresholds_.voltage_low_cutoff_raw) {
+    return false;
+  }
+  return on_;
+}
+
+bool RelayController::update(uint16_t voltage_raw, uint16_t power_raw, uint32_t now_ms) {
+  uint16_t voltage = filter(voltage_, voltage_raw);
+  uint16_t power = filter(power_, power_raw);
+  if (history_count_ < RELAY_MEDIAN_MAX) {
+    history_count_++;
+  }
+  history_index_ = (history_index_ + 1) % RELAY_MEDIAN_MAX;
+
+  // The emergency cutoff looks at the raw reading so a collapsing battery
+  // is not held up by the filter or the off-delay.
+  if (voltage_raw <= thresholds_.voltage_emergency_raw) {
+    return emergencyTrip(voltage_raw, now_ms);
+  }
+
+  bool desired = desiredState(voltage, power);
+  if (desired == on_) {
+    pending_ = false;
+    return false;
+  }
+  if (!pending_) {
+    pending_ = true;
+    pending_since_ms_ = now_ms;
+  }
+  if (now_ms - pending_since_ms_ < (desired ? thresholds_.on_delay_ms : thresholds_.off_delay_ms)) {
+    return false;
+  }
+  switchTo(desired, now_ms);
+  pending_ = false;
+  return true;
+}
+
+bool RelayController::emergencyTrip(uint16_t voltage_raw, uint32_t now_ms) {
+  if (voltage_raw > thresholds_.voltage_emergency_raw) {
+    return false;
+  }
+  pending_ = false;
+  if (!on_) {
+    return false;
+  }
+  stats_.fast_trips++;
+  switchTo(false, now_ms);
+  tripped_ = true;
+  return true;
+}
+
+bool RelayController::lastSwitchWasTrip() const {
+  return tripped_;
+}
+
+uint16_t RelayController::filteredVoltageRaw() const {
+  return voltage_.value;
+}
+
+uint16_t RelayController::filteredPowerRaw() const {
+  return power_.value;
+}
+
+RelayStats RelayController::stats(uint32_t now_ms) const {
+  RelayStats stats = stats_;
+  if (on_) {
+    stats.on_ms += now_ms - state_since_ms_;
+  } else {
+    stats.off_ms += now_ms - state_since_ms_;
+  }
+  return stats;
+}
+
+void RelayController::resetStats(uint32_t now_ms) {
+  memset(&stats_, 0, sizeof(stats_));
+  state_since_ms_ = now_ms;
+}
+
+void RelayController::resetFilter() {
+  memset(&voltage_, 0, sizeof(voltage_));
+  memset(&power_, 0, sizeof(power_));
+  history_count_ = 0;
+  history_index_ = 0;
+}
+
+uint16_t RelayController::filter(Channel &channel, uint16_t sample) {
+  channel.history[history_index_] = sample;
+  if (thresholds_.filter == RELAY_FILTER_EMA) {
+    int32_t scaled = (int32_t)sample << RELAY_EMA_FRACTION_BITS;
+    if (history_count_ == 0) {
+      channel.ema = scaled;
+    } else {
+      channel.ema += (scaled - channel.ema) >> thresholds_.filter_depth;
+    }
+    channel.value = (channel.ema + (1 << (RELAY_EMA_FRACTION_BITS - 1))) >> RELAY_EMA_FRACTION_BITS;
+  } else if (thresholds_.filter == RELAY_FILTER_MEDIAN) {
+    // Median of the newest filter_depth samples, or of as many as have
+    // arrived since the filter was reset.
+    uint8_t count = history_count_ + 1 < thresholds_.filter_depth ? history_count_ + 1 : thresholds_.filter_depth;
+    uint16_t window[RELAY_MEDIAN_MAX];
+    for (uint8_t i = 0; i < count; i++) {
+      uint16_t value = channel.history[(history_index_ + RELAY_MEDIAN_MAX - i) % RELAY_MEDIAN_MAX];
+      uint8_t j = i;
+      while (j > 0 && window[j - 1] > value) {
+        window[j] = window[j - 1];
+        j--;
+      }
+      window[j] = value;
+    }
+    channel.value = window[count / 2];
+  } else {
+    channel.value = sample;
+  }
+  return channel.value;
+}
+
+void RelayController::switchTo(bool on, uint32_t now_ms) {
+  if (on_) {
+    stats_.on_ms += now_ms - state_since_ms_;
+  } else {
+    stats_.off_ms += now_ms - state_since_ms_;
+  }
+  state_since_ms_ = now_ms;
+  stats_.switches++;
+  tripped_ = false;
+  on_ = on;
+}
@@ -0,0 +1,90 @@
+#ifndef RELAY_CONTROLLER_H
+#define RELAY_CONTROLLER_H
+
+#include <stdint.h>
+
+#define RELAY_FILTER_NONE 0
+#define RELAY_FILTER_EMA 1
+#define RELAY_FILTER_MEDIAN 2
+
+#define RELAY_MEDIAN_MAX 9
+#define RELAY_EMA_MAX_SHIFT 6
+
+// Relay thresholds in INA219 register units so the decision never touches
+// floating point. filter_depth is the EMA shift (alpha = 1/2^depth) or the
+// median window, depending on filter.
+struct RelayThresholds {
+  uint16_t voltage_emergency_raw;
+  uint16_t voltage_low_cutoff_raw;
+  uint16_t voltage_high_on_raw;
+  uint16_t power_on_raw;
+  uint16_t power_off_raw;
+  uint32_t on_delay_ms;
+  uint32_t off_delay_ms;
+  uint8_t filter;
+  uint8_t filter_depth;
+};
+
+struct RelayStats {
+  uint32_t switches;
+  uint32_t fast_trips;
+  uint32_t on_ms;
+  uint32_t off_ms;
+};
+
+// Solar relay state machine with no hardware access, so the same logic can
+// be built and exercised on a host. Voltage and power are filtered before
+// the hysteresis decision, and a new state must hold for the on- or
+// off-delay before it is taken. A raw voltage at or below the emergency
+// cutoff trips the relay off at once. update() reports when the state
+// flips; driving the pin is left to the caller. In manual mode the caller
+// runs only emergencyTrip(), so the safety cutoff still applies.
+class RelayController {
+public:
+  RelayController();
+
+  void setThresholds(const RelayThresholds &thresholds);
+  const RelayThresholds &thresholds() const;
+
+  void setState(bool on, uint32_t now_ms);
+  bool isOn() const;
+
+  bool desiredState(uint16_t voltage_raw, uint16_t power_raw) const;
+  bool update(uint16_t voltage_raw, uint16_t power_raw, uint32_t now_ms);
+  bool emergencyTrip(uint16_t voltage_raw, uint32_t now_ms);
+  bool lastSwitchWasTrip() const;
+
+  uint16_t filteredVoltageRaw() const;
+  uint16_t filteredPowerRaw() const;
+
+  RelayStats stats(uint32_t now_ms) const;
+  void resetStats(uint32_t now_ms);
+
+  void resetFilter();
+
+private:
+  struct Channel {
+    uint16_t history[RELAY_MEDIAN_MAX];
+    int32_t ema;
+    uint16_t value;
+  };
+
+  uint16_t filter(Channel &channel, uint16_t sample);
+  void switchTo(bool on, uint32_t now_ms);
+
+  RelayThresholds thresholds_;
+  bool on_;
+  bool pending_;
+  uint32_t pending_since_ms_;
+  bool tripped_;
+
+  Channel voltage_;
+  Channel power_;
+  uint8_t history_count_;
+  uint8_t history_index_;
+
+  RelayStats stats_;
+  uint32_t state_since_ms_;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "report_filter.h"
+
+#include <math.h>
+
+ReportFilter::ReportFilter()
+  : deadbands_(), last_(), have_last_(false), last_report_ms_(0), emitted_count_(0), suppressed_count_(0),
+    heartbeat_count_(0) {
+}
+
+void ReportFilter::setDeadbands(const ReportDeadbands &deadbands) {
+  deadbands_ = deadbands;
+}
+
+const ReportDeadbands &ReportFilter::deadbands() const {
+  return deadbands_;
+}
+
+void ReportFilter::reset() {
+  have_last_ = false;
+}
+
+uint8_t ReportFilter::update(const ReportSample &sample, uint32_t now_ms) {
+  uint8_t changed = 0;
+  if (!have_last_) {
+    changed = REPORT_CHANNEL_ALL;
+  } else if (now_ms - last_report_ms_ >= deadbands_.heartbeat_ms) {
+    changed = REPORT_CHANNEL_ALL;
+    heartbeat_count_++;
+  } else {
+    if (exceeds(sample.outdoor_C, last_.outdoor_C, deadbands_.temp_C)) {
+      changed |= REPORT_CHANNEL_OUTDOOR;
+    }
+    if (exceeds(sample.indoor_C, last_.indoor_C, deadbands_.temp_C)) {
+      changed |= REPORT_CHANNEL_INDOOR;
+    }
+    if (exceeds(sample.voltage_mV, last_.voltage_mV, deadbands_.voltage_mV)
+        || exceeds(sample.current_mA, last_.current_mA, deadbands_.current_mA)
+        || exceeds(sample.power_mW, last_.power_mW, deadbands_.power_mW)) {
+      changed |= REPORT_CHANNEL_SOLAR;
+    }
+  }
+  if (!changed) {
+    suppressed_count_++;
+    return 0;
+  }
+
+  // Only reported channels move their reference, so a slow drift on a
+  // quiet channel still adds up to a report.
+  if (changed & REPORT_CHANNEL_OUTDOOR) {
+    last_.outdoor_C = sample.outdoor_C;
+  }
+  if (changed & REPORT_CHANNEL_INDOOR) {
+    last_.indoor_C = sample.indoor_C;
+  }
+  if (changed & REPORT_CHANNEL_SOLAR) {
+    last_.voltage_mV = sample.voltage_mV;
+    last_.current_mA = sample.current_mA;
+    last_.power_mW = sample.power_mW;
+  }
+  if (changed == REPORT_CHANNEL_ALL) {
+    last_report_ms_ = now_ms;
+  }
+  have_last_ = true;
+  emitted_count_++;
+  return changed;
+}
+
+uint32_t ReportFilter::emittedCount() const {
+  return emitted_count_;
+}
+
+uint32_t ReportFilter::suppressedCount() const {
+  return suppressed_count_;
+}
+
+uint32_t ReportFilter::heartbeatCount() const {
+  return heartbeat_count_;
+}
+
+void ReportFilter::resetCounters() {
+  emitted_count_ = 0;
+  suppressed_count_ = 0;
+  heartbeat_count_ = 0;
+}
+
+bool ReportFilter::exceeds(float value, float last, float deadband) {
+  if (isnan(value) || isnan(last)) {
+    return isnan(value) != isnan(last);
+  }
+  return fabsf(value - last) > deadband;
+}
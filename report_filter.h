@@ -0,0 +1,60 @@
+#ifndef REPORT_FILTER_H
+#define REPORT_FILTER_H
+
+#include <stdint.h>
+
+#define REPORT_CHANNEL_OUTDOOR 0x01
+#define REPORT_CHANNEL_INDOOR 0x02
+#define REPORT_CHANNEL_SOLAR 0x04
+#define REPORT_CHANNEL_ALL 0x07
+
+struct ReportDeadbands {
+  float temp_C;
+  float voltage_mV;
+  float current_mA;
+  float power_mW;
+  uint32_t heartbeat_ms;
+};
+
+// One reading per channel in deadband units. NAN marks a channel with no
+// valid value; gaining or losing a value always counts as a change.
+struct ReportSample {
+  float outdoor_C;
+  float indoor_C;
+  float voltage_mV;
+  float current_mA;
+  float power_mW;
+};
+
+// Report-by-exception filter. update() returns the channels that moved by
+// more than their deadband since they were last reported, or every channel
+// once the heartbeat interval has passed. Zero means the sample is
+// suppressed. No hardware access, so it builds on a host.
+class ReportFilter {
+public:
+  ReportFilter();
+
+  void setDeadbands(const ReportDeadbands &deadbands);
+  const ReportDeadbands &deadbands() const;
+
+  void reset();
+  uint8_t update(const ReportSample &sample, uint32_t now_ms);
+
+  uint32_t emittedCount() const;
+  uint32_t suppressedCount() const;
+  uint32_t heartbeatCount() const;
+  void resetCounters();
+
+private:
+  static bool exceeds(float value, float last, float deadband);
+
+  ReportDeadbands deadbands_;
+  ReportSample last_;
+  bool have_last_;
+  uint32_t last_report_ms_;
+  uint32_t emitted_count_;
+  uint32_t suppressed_count_;
+  uint32_t heartbeat_count_;
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include "response.h"
+#include "tx_queue.h"
+
+#define FRAME_HEADER_BYTES 3
+
+ResponseBuilder response(tx_queue);
+
+uint16_t crc16Ccitt(const uint8_t *data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+size_t cobsEncode(const uint8_t *input, size_t length, uint8_t *output) {
+  size_t read_index = 0;
+  size_t write_index = 1;
+  size_t code_index = 0;
+  uint8_t code = 1;
+  while (read_index < length) {
+    if (input[read_index] == 0) {
+      output[code_index] = code;
+      code = 1;
+      code_index = write_index++;
+      read_index++;
+    } else {
+      output[write_index++] = input[read_index++];
+      code++;
+      if (code == 0xFF) {
+        output[code_index] = code;
+        code = 1;
+        code_index = write_index++;
+      }
+    }
+  }
+  output[code_index] = code;
+  return write_index;
+}
+
+ResponseBuilder::ResponseBuilder(Print &out)
+  : out_(out), binary_(false), building_frame_(false), need_comma_(false), overflow_(false),
+    frame_type_(FRAME_TEXT), frame_seq_(0), request_id_(RESPONSE_NO_REQUEST_ID), length_(0) {
+}
+
+void ResponseBuilder::setBinary(bool binary) {
+  binary_ = binary;
+}
+
+bool ResponseBuilder::isBinary() const {
+  return binary_;
+}
+
+void ResponseBuilder::setRequestId(uint32_t id) {
+  request_id_ = id;
+}
+
+uint32_t ResponseBuilder::requestId() const {
+  return request_id_;
+}
+
+void ResponseBuilder::beginJson() {
+  startJson();
+  if (request_id_ != RESPONSE_NO_REQUEST_ID) {
+    addUnsigned("id", request_id_);
+  }
+}
+
+void ResponseBuilder::beginEvent(const char *name) {
+  startJson();
+  addString("event", name);
+}
+
+void ResponseBuilder::beginObject(const char *name) {
+  appendKey(name);
+  appendChar('{');
+  need_comma_ = false;
+}
+
+void ResponseBuilder::endObject() {
+  appendChar('}');
+  need_comma_ = true;
+}
+
+void ResponseBuilder::addString(const char *name, const char *value) {
+  appendKey(name);
+  appendChar('"');
+  append(value);
+  appendChar('"');
+}
+
+void ResponseBuilder::addFloat(const char *name, float value) {
+  appendKey(name);
+  appendFixed(value);
+}
+
+void ResponseBuilder::addUnsigned(const char *name, uint32_t value) {
+  appendKey(name);
+  appendUnsigned(value);
+}
+
+void ResponseBuilder::addSigned(const char *name, int32_t value) {
+  appendKey(name);
+  if (value < 0) {
+    appendChar('-');
+    appendUnsigned(0U - (uint32_t)value);
+  } else {
+    appendUnsigned(value);
+  }
+}
+
+void ResponseBuilder::addBool(const char *name, bool value) {
+  appendKey(name);
+  append(value ? "true" : "false");
+}
+
+void ResponseBuilder::addError(const char *name) {
+  addString(name, "error");
+}
+
+void ResponseBuilder::beginFrame(uint8_t type) {
+  building_frame_ = true;
+  overflow_ = false;
+  frame_type_ = type;
+  length_ = 0;
+  if (request_id_ != RESPONSE_NO_REQUEST_ID) {
+    frame_type_ |= FRAME_TAGGED;
+    putU16(request_id_);
+  }
+}
+
+void ResponseBuilder::putU8(uint8_t value) {
+  putBytes(&value, sizeof(value));
+}
+
+void ResponseBuilder::putU16(uint16_t value) {
+  putBytes(&value, sizeof(value));
+}
+
+void ResponseBuilder::putU32(uint32_t value) {
+  putBytes(&value, sizeof(value));
+}
+
+void ResponseBuilder::putFloat(float value) {
+  putBytes(&value, sizeof(value));
+}
+
+size_t ResponseBuilder::send() {
+  if (building_frame_) {
+    building_frame_ = false;
+    return emitFrame(frame_type_);
+  }
+  appendChar('}');
+  if (overflow_) {
+    length_ = 0;
+    overflow_ = false;
+    append("{\"status\": \"error\", \"message\": \"response overflow\"}");
+  }
+  if (binary_) {
+    return emitFrame(FRAME_TEXT);
+  }
+  uint8_t *text = buffer_ + FRAME_HEADER_BYTES;
+  text[length_++] = '\r';
+  text[length_++] = '\n';
+  return out_.write(text, length_);
+}
+
+size_t ResponseBuilder::sendLine(const char *text) {
+  building_frame_ = false;
+  overflow_ = false;
+  length_ = 0;
+  if (request_id_ != RESPONSE_NO_REQUEST_ID) {
+    appendChar('#');
+    appendUnsigned(request_id_);
+    appendChar(' ');
+  }
+  append(text);
+  if (binary_) {
+    return emitFrame(FRAME_TEXT);
+  }
+  uint8_t *line = buffer_ + FRAME_HEADER_BYTES;
+  line[length_++] = '\r';
+  line[length_++] = '\n';
+  return out_.write(line, length_);
+}
+
+void ResponseBuilder::startJson() {
+  building_frame_ = false;
+  overflow_ = false;
+  length_ = 0;
+  appendChar('{');
+  need_comma_ = false;
+}
+
+void ResponseBuilder::append(const char *text) {
+  while (*text) {
+    appendChar(*text++);
+  }
+}
+
+void ResponseBuilder::appendChar(char c) {
+  if (length_ < RESPONSE_MAX_PAYLOAD) {
+    buffer_[FRAME_HEADER_BYTES + length_++] = c;
+  } else {
+    overflow_ = true;
+  }
+}
+
+void ResponseBuilder::appendUnsigned(uint32_t value) {
+  char digits[10];
+  uint8_t count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (count > 0) {
+    appendChar(digits[--count]);
+  }
+}
+
+void ResponseBuilder::appendFixed(float value) {
+  if (isnan(value) || isinf(value)) {
+    append("null");
+    return;
+  }
+  if (value < 0) {
+    appendChar('-');
+    value = -value;
+  }
+  uint64_t hundredths = (uint64_t)(value * 100.0f + 0.5f);
+  uint64_t whole = hundredths / 100;
+  if (whole > 0xFFFFFFFFULL) {
+    append("null");
+    return;
+  }
+  uint8_t fraction = hundredths % 100;
+  appendUnsigned((uint32_t)whole);
+  appendChar('.');
+  appendChar('0' + fraction / 10);
+  appendChar('0' + fraction % 10);
+}
+
+void ResponseBuilder::appendKey(const char *name) {
+  if (need_comma_) {
+    append(", ");
+  }
+  appendChar('"');
+  append(name);
+  append("\": ");
+  need_comma_ = true;
+}
+
+void ResponseBuilder::putBytes(const void *data, size_t length) {
+  if (length_ + length > RESPONSE_MAX_PAYLOAD) {
+    overflow_ = true;
+    return;
+  }
+  memcpy(buffer_ + FRAME_HEADER_BYTES + length_, data, length);
+  length_ += length;
+}
+
+size_t ResponseBuilder::emitFrame(uint8_t type) {
+  buffer_[0] = type;
+  buffer_[1] = frame_seq_ & 0xFF;
+  buffer_[2] = (frame_seq_ >> 8) & 0xFF;
+  size_t packet_length = FRAME_HEADER_BYTES + length_;
+  uint16_t crc = crc16Ccitt(buffer_, packet_length);
+  buffer_[packet_length++] = crc & 0xFF;
+  buffer_[packet_length++] = (crc >> 8) & 0xFF;
+  frame_seq_++;
+  size_t encoded_length = cobsEncode(buffer_, packet_length, encoded_);
+  encoded_[encoded_length++] = 0x00;
+  return out_.write(encoded_, encoded_length);
+}
@@ -0,0 +1,90 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <Arduino.h>
+
+#define RESPONSE_MAX_PAYLOAD 1536
+#define RESPONSE_MAX_BYTES (RESPONSE_MAX_PAYLOAD + 5 + (RESPONSE_MAX_PAYLOAD + 5) / 254 + 2)
+
+#define FRAME_TEMP 0x01
+#define FRAME_SOLAR 0x02
+#define FRAME_RELAY 0x03
+#define FRAME_SETTINGS 0x04
+#define FRAME_SAMPLE 0x05
+#define FRAME_DUMP_BEGIN 0x06
+#define FRAME_DUMP_END 0x07
+#define FRAME_STREAM 0x08
+#define FRAME_AGG 0x09
+#define FRAME_LOG 0x0A
+#define FRAME_TEMPS 0x0B
+#define FRAME_ALL 0x0C
+#define FRAME_REPORT 0x0D
+#define FRAME_TEXT 0x7F
+#define FRAME_TAGGED 0x80
+
+#define RESPONSE_NO_REQUEST_ID 0xFFFFFFFF
+
+// Formats one reply at a time into a static buffer and emits it with a
+// single write. JSON replies become a TEXT frame when binary mode is on.
+// While a request id is set, JSON replies lead with "id" and binary frames
+// carry FRAME_TAGGED with the id as the first payload field. Events are
+// never tagged and lead with "event" instead.
+class ResponseBuilder {
+public:
+  explicit ResponseBuilder(Print &out);
+
+  void setBinary(bool binary);
+  bool isBinary() const;
+
+  void setRequestId(uint32_t id);
+  uint32_t requestId() const;
+
+  void beginJson();
+  void beginEvent(const char *name);
+  void beginObject(const char *name);
+  void endObject();
+  void addString(const char *name, const char *value);
+  void addFloat(const char *name, float value);
+  void addUnsigned(const char *name, uint32_t value);
+  void addSigned(const char *name, int32_t value);
+  void addBool(const char *name, bool value);
+  void addError(const char *name);
+
+  void beginFrame(uint8_t type);
+  void putU8(uint8_t value);
+  void putU16(uint16_t value);
+  void putU32(uint32_t value);
+  void putFloat(float value);
+
+  size_t send();
+  size_t sendLine(const char *text);
+
+private:
+  void startJson();
+  void append(const char *text);
+  void appendChar(char c);
+  void appendUnsigned(uint32_t value);
+  void appendFixed(float value);
+  void appendKey(const char *name);
+  void putBytes(const void *data, size_t length);
+  size_t emitFrame(uint8_t type);
+
+  Print &out_;
+  bool binary_;
+  bool building_frame_;
+  bool need_comma_;
+  bool overflow_;
+  uint8_t frame_type_;
+  uint16_t frame_seq_;
+  uint32_t request_id_;
+  size_t length_;
+  uint8_t buffer_[RESPONSE_MAX_PAYLOAD + 5];
+  uint8_t encoded_[RESPONSE_MAX_BYTES];
+};
+
+extern ResponseBuilder response;
+
+uint16_t crc16Ccitt(const uint8_t *data, size_t length);
+size_t cobsEncode(const uint8_t *input, size_t length, uint8_t *output);
+
+#endif
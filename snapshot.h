@@ -0,0 +1,48 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Single-writer seqlock holding the latest value of T. The writer never
+// blocks; a reader copies the value and retries if the sequence moved or
+// was odd (mid-write). Readers must run at a lower priority than the
+// writer on a single core so that a retry always makes progress.
+template <typename T>
+class Snapshot {
+public:
+  Snapshot() : seq_(0) {
+    memset(&value_, 0, sizeof(value_));
+  }
+
+  void publish(const T &value) {
+    uint32_t seq = __atomic_load_n(&seq_, __ATOMIC_RELAXED);
+    __atomic_store_n(&seq_, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&value_, &value, sizeof(value_));
+    __atomic_store_n(&seq_, seq + 2, __ATOMIC_RELEASE);
+  }
+
+  T read() const {
+    T value;
+    uint32_t before;
+    uint32_t after;
+    do {
+      before = __atomic_load_n(&seq_, __ATOMIC_ACQUIRE);
+      memcpy(&value, (const void *)&value_, sizeof(value));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&seq_, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    return value;
+  }
+
+  uint32_t version() const {
+    return __atomic_load_n(&seq_, __ATOMIC_ACQUIRE) >> 1;
+  }
+
+private:
+  uint32_t seq_;
+  T value_;
+};
+
+#endif
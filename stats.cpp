@@ -0,0 +1,61 @@
+#include "stats.h"
+
+Histogram::Histogram() {
+  reset();
+}
+
+void Histogram::reset() {
+  memset(buckets_, 0, sizeof(buckets_));
+  count_ = 0;
+  min_ = 0;
+  max_ = 0;
+  sum_ = 0;
+}
+
+void Histogram::record(uint32_t value) {
+  uint8_t bucket = value ? 32 - __builtin_clz(value) : 0;
+  if (bucket >= HISTOGRAM_BUCKETS) {
+    bucket = HISTOGRAM_BUCKETS - 1;
+  }
+  buckets_[bucket]++;
+  if (count_ == 0 || value < min_) {
+    min_ = value;
+  }
+  if (value > max_) {
+    max_ = value;
+  }
+  sum_ += value;
+  count_++;
+}
+
+uint32_t Histogram::count() const {
+  return count_;
+}
+
+uint32_t Histogram::min() const {
+  return min_;
+}
+
+uint32_t Histogram::max() const {
+  return max_;
+}
+
+uint32_t Histogram::mean() const {
+  return count_ ? sum_ / count_ : 0;
+}
+
+uint32_t Histogram::percentile(uint8_t pct) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  uint32_t target = ((uint64_t)count_ * pct + 99) / 100;
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+    seen += buckets_[i];
+    if (seen >= target) {
+      uint32_t upper = i ? (1UL << i) - 1 : 0;
+      return upper < max_ ? upper : max_;
+    }
+  }
+  return max_;
+}
@@ -0,0 +1,33 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <Arduino.h>
+
+#define HISTOGRAM_BUCKETS 24
+
+// Power-of-two bucket histogram: bucket 0 holds zero, bucket i holds
+// values in [2^(i-1), 2^i) and the last bucket everything larger.
+// Percentiles report the upper edge of the matching bucket, clamped to
+// the largest value seen.
+class Histogram {
+public:
+  Histogram();
+
+  void reset();
+  void record(uint32_t value);
+
+  uint32_t count() const;
+  uint32_t min() const;
+  uint32_t max() const;
+  uint32_t mean() const;
+  uint32_t percentile(uint8_t pct) const;
+
+private:
+  uint32_t buckets_[HISTOGRAM_BUCKETS];
+  uint32_t count_;
+  uint32_t min_;
+  uint32_t max_;
+  uint64_t sum_;
+};
+
+#endif
@@ -0,0 +1,200 @@
+#include "tx_queue.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+TxQueue tx_queue(Serial);
+
+TxQueue::TxQueue(HardwareSerial &serial)
+  : serial_(serial), buffer_(NULL), capacity_(0), head_(0), used_(0), high_water_(0),
+    policy_(TX_POLICY_DROP_OLDEST), dropped_messages_(0), dropped_bytes_(0), blocked_count_(0), blocked_ms_(0) {
+}
+
+bool TxQueue::begin(size_t capacity) {
+  flush();
+  uint8_t *buffer = (uint8_t *)realloc(buffer_, capacity);
+  if (!buffer) {
+    return false;
+  }
+  buffer_ = buffer;
+  capacity_ = capacity;
+  head_ = 0;
+  used_ = 0;
+  high_water_ = 0;
+  return true;
+}
+
+void TxQueue::setPolicy(uint8_t policy) {
+  policy_ = policy;
+}
+
+uint8_t TxQueue::policy() const {
+  return policy_;
+}
+
+size_t TxQueue::write(uint8_t byte) {
+  return write(&byte, 1);
+}
+
+size_t TxQueue::write(const uint8_t *data, size_t length) {
+  if (length == 0) {
+    return 0;
+  }
+  if (!buffer_) {
+    return serial_.write(data, length);
+  }
+  service();
+  if (used_ == 0 && serial_.availableForWrite() >= (int)length) {
+    return serial_.write(data, length);
+  }
+
+  size_t needed = length + TX_QUEUE_HEADER_BYTES;
+  if (needed > capacity_) {
+    dropped_messages_++;
+    dropped_bytes_ += length;
+    return 0;
+  }
+  if (capacity_ - used_ < needed) {
+    if (policy_ == TX_POLICY_BLOCK) {
+      waitForSpace(length);
+    } else {
+      while (capacity_ - used_ < needed) {
+        dropOldest();
+      }
+    }
+  }
+
+  uint8_t header[TX_QUEUE_HEADER_BYTES] = { (uint8_t)(length & 0xFF), (uint8_t)(length >> 8) };
+  copyIn(header, sizeof(header));
+  copyIn(data, length);
+  if (used_ > high_water_) {
+    high_water_ = used_;
+  }
+  return length;
+}
+
+int TxQueue::availableForWrite() {
+  if (!buffer_) {
+    return serial_.availableForWrite();
+  }
+  size_t free_bytes = capacity_ - used_;
+  return free_bytes > TX_QUEUE_HEADER_BYTES ? free_bytes - TX_QUEUE_HEADER_BYTES : 0;
+}
+
+// Bulk replies call this before each record so that a long listing waits
+// for the link instead of being thinned out by the drop policy.
+void TxQueue::waitForSpace(size_t length) {
+  if (!buffer_ || length + TX_QUEUE_HEADER_BYTES > capacity_) {
+    return;
+  }
+  service();
+  if (capacity_ - used_ >= length + TX_QUEUE_HEADER_BYTES) {
+    return;
+  }
+  blocked_count_++;
+  unsigned long start = millis();
+  while (capacity_ - used_ < length + TX_QUEUE_HEADER_BYTES) {
+    wait();
+  }
+  blocked_ms_ += millis() - start;
+}
+
+void TxQueue::service() {
+  while (used_ > 0) {
+    size_t length = headLength();
+    if (serial_.availableForWrite() < (int)length) {
+      return;
+    }
+    size_t start = (head_ + TX_QUEUE_HEADER_BYTES) % capacity_;
+    size_t first = min(length, capacity_ - start);
+    serial_.write(buffer_ + start, first);
+    if (first < length) {
+      serial_.write(buffer_, length - first);
+    }
+    head_ = (head_ + TX_QUEUE_HEADER_BYTES + length) % capacity_;
+    used_ -= TX_QUEUE_HEADER_BYTES + length;
+  }
+}
+
+void TxQueue::flush() {
+  while (used_ > 0) {
+    wait();
+  }
+  serial_.flush();
+}
+
+size_t TxQueue::capacity() const {
+  return capacity_;
+}
+
+size_t TxQueue::pending() const {
+  return used_;
+}
+
+size_t TxQueue::highWater() const {
+  return high_water_;
+}
+
+uint32_t TxQueue::droppedMessages() const {
+  return dropped_messages_;
+}
+
+uint32_t TxQueue::droppedBytes() const {
+  return dropped_bytes_;
+}
+
+uint32_t TxQueue::blockedCount() const {
+  return blocked_count_;
+}
+
+uint32_t TxQueue::blockedMs() const {
+  return blocked_ms_;
+}
+
+void TxQueue::resetCounters() {
+  high_water_ = used_;
+  dropped_messages_ = 0;
+  dropped_bytes_ = 0;
+  blocked_count_ = 0;
+  blocked_ms_ = 0;
+}
+
+const char *TxQueue::policyName(uint8_t policy) {
+  return policy == TX_POLICY_BLOCK ? "block" : "drop_oldest";
+}
+
+size_t TxQueue::headLength() const {
+  uint8_t header[TX_QUEUE_HEADER_BYTES];
+  copyOut(head_, header, sizeof(header));
+  return header[0] | ((size_t)header[1] << 8);
+}
+
+void TxQueue::copyOut(size_t offset, uint8_t *data, size_t length) const {
+  for (size_t i = 0; i < length; i++) {
+    data[i] = buffer_[(offset + i) % capacity_];
+  }
+}
+
+void TxQueue::copyIn(const uint8_t *data, size_t length) {
+  size_t tail = (head_ + used_) % capacity_;
+  size_t first = min(length, capacity_ - tail);
+  memcpy(buffer_ + tail, data, first);
+  memcpy(buffer_, data + first, length - first);
+  used_ += length;
+}
+
+void TxQueue::dropOldest() {
+  size_t length = headLength();
+  head_ = (head_ + TX_QUEUE_HEADER_BYTES + length) % capacity_;
+  used_ -= TX_QUEUE_HEADER_BYTES + length;
+  dropped_messages_++;
+  dropped_bytes_ += length;
+}
+
+// Gives the UART interrupt time to drain the driver buffer; only the I/O
+// task ever writes here, so this never holds up acquisition or control.
+void TxQueue::wait() {
+  service();
+  if (used_ > 0) {
+    vTaskDelay(1);
+  }
+}
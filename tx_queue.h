@@ -0,0 +1,67 @@
+#ifndef TX_QUEUE_H
+#define TX_QUEUE_H
+
+#include <Arduino.h>
+
+#define TX_QUEUE_DEFAULT_SIZE 8192
+#define TX_QUEUE_MIN_SIZE 2048
+#define TX_QUEUE_MAX_SIZE 32768
+#define TX_UART_BUFFER_SIZE 2048
+#define TX_QUEUE_HEADER_BYTES 2
+
+#define TX_POLICY_DROP_OLDEST 0
+#define TX_POLICY_BLOCK 1
+
+// Message ring in front of the UART driver. Each write() is kept whole and
+// handed to the interrupt-driven driver buffer only once it fits there, so
+// a message is never split by an overflow. When the ring is full the
+// oldest queued messages are dropped or the producer waits, per policy.
+class TxQueue : public Print {
+public:
+  explicit TxQueue(HardwareSerial &serial);
+
+  bool begin(size_t capacity);
+  void setPolicy(uint8_t policy);
+  uint8_t policy() const;
+
+  size_t write(uint8_t byte) override;
+  size_t write(const uint8_t *data, size_t length) override;
+  int availableForWrite() override;
+  void waitForSpace(size_t length);
+  void service();
+  void flush() override;
+
+  size_t capacity() const;
+  size_t pending() const;
+  size_t highWater() const;
+  uint32_t droppedMessages() const;
+  uint32_t droppedBytes() const;
+  uint32_t blockedCount() const;
+  uint32_t blockedMs() const;
+  void resetCounters();
+
+  static const char *policyName(uint8_t policy);
+
+private:
+  size_t headLength() const;
+  void copyOut(size_t offset, uint8_t *data, size_t length) const;
+  void copyIn(const uint8_t *data, size_t length);
+  void dropOldest();
+  void wait();
+
+  HardwareSerial &serial_;
+  uint8_t *buffer_;
+  size_t capacity_;
+  size_t head_;
+  size_t used_;
+  size_t high_water_;
+  uint8_t policy_;
+  uint32_t dropped_messages_;
+  uint32_t dropped_bytes_;
+  uint32_t blocked_count_;
+  uint32_t blocked_ms_;
+};
+
+extern TxQueue tx_queue;
+
+#endif
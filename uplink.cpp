@@ -0,0 +1,187 @@
+#include "uplink.h"
+#include <WiFi.h>
+#include "esp_now.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+EspNowUplink uplink;
+
+static volatile bool send_done = false;
+static volatile bool send_ok = false;
+static volatile unsigned long send_done_us = 0;
+
+static void onSendDone(const uint8_t *mac, esp_now_send_status_t status) {
+  send_ok = status == ESP_NOW_SEND_SUCCESS;
+  send_done_us = micros();
+  send_done = true;
+}
+
+static int16_t scaleSigned(float value, float scale) {
+  if (isnan(value)) {
+    return UPLINK_NO_VALUE_S16;
+  }
+  long scaled = lroundf(value * scale);
+  return constrain(scaled, INT16_MIN + 1, INT16_MAX);
+}
+
+static uint16_t scaleUnsigned(float value, float scale) {
+  if (isnan(value)) {
+    return UPLINK_NO_VALUE_U16;
+  }
+  long scaled = lroundf(value * scale);
+  return constrain(scaled, 0, UPLINK_NO_VALUE_U16 - 1);
+}
+
+UplinkBatch::UplinkBatch() : last_ts_ms_(0) {
+  memset(&header_, 0, sizeof(header_));
+}
+
+void UplinkBatch::begin(uint32_t node_id, uint32_t first_seq, uint16_t stride, uint16_t batch_seq, uint8_t flags) {
+  memset(&header_, 0, sizeof(header_));
+  header_.magic = UPLINK_MAGIC;
+  header_.version = UPLINK_VERSION;
+  header_.flags = flags;
+  header_.node_id = node_id;
+  header_.first_seq = first_seq;
+  header_.stride = stride;
+  header_.batch_seq = batch_seq;
+}
+
+bool UplinkBatch::add(uint32_t ts_ms, float outdoor_C, float indoor_C, float voltage_V, float current_mA, float power_mW) {
+  if (header_.count >= UPLINK_MAX_ENTRIES) {
+    return false;
+  }
+  if (header_.count == 0) {
+    header_.first_ts_ms = ts_ms;
+    last_ts_ms_ = ts_ms;
+  }
+  UplinkEntry &entry = entries_[header_.count++];
+  uint32_t dt = (ts_ms - last_ts_ms_) / 100;
+  entry.dt_100ms = dt > 0xFFFF ? 0xFFFF : dt;
+  last_ts_ms_ += (uint32_t)entry.dt_100ms * 100;
+  entry.outdoor_cC = scaleSigned(outdoor_C, 100);
+  entry.indoor_cC = scaleSigned(indoor_C, 100);
+  entry.voltage_mV = scaleUnsigned(voltage_V, 1000);
+  entry.current_100uA = scaleSigned(current_mA, 10);
+  entry.power_mW = scaleUnsigned(power_mW, 1);
+  return true;
+}
+
+uint8_t UplinkBatch::count() const {
+  return header_.count;
+}
+
+const uint8_t *UplinkBatch::data() const {
+  return (const uint8_t *)&header_;
+}
+
+size_t UplinkBatch::length() const {
+  return sizeof(header_) + header_.count * sizeof(UplinkEntry);
+}
+
+EspNowUplink::EspNowUplink()
+  : channel_(1), burst_count_(0), failure_count_(0), radio_on_total_us_(0), bytes_sent_(0) {
+  memset(peer_, 0xFF, sizeof(peer_));
+}
+
+void EspNowUplink::setPeer(const uint8_t *mac, uint8_t channel) {
+  memcpy(peer_, mac, sizeof(peer_));
+  channel_ = channel;
+}
+
+const uint8_t *EspNowUplink::peer() const {
+  return peer_;
+}
+
+uint8_t EspNowUplink::channel() const {
+  return channel_;
+}
+
+bool EspNowUplink::send(const uint8_t *data, size_t length) {
+  if (length > UPLINK_MAX_PAYLOAD) {
+    return false;
+  }
+  burst_count_++;
+  unsigned long on_us = micros();
+  bool ok = radioOn();
+  if (ok) {
+    send_done = false;
+    send_ok = false;
+    unsigned long send_us = micros();
+    ok = esp_now_send(peer_, data, length) == ESP_OK;
+    unsigned long start_ms = millis();
+    while (ok && !send_done && millis() - start_ms < UPLINK_SEND_TIMEOUT_MS) {
+      vTaskDelay(1);
+    }
+    ok = ok && send_done && send_ok;
+    if (send_done) {
+      airtime_stats_.record(send_done_us - send_us);
+    }
+  }
+  radioOff();
+  unsigned long radio_us = micros() - on_us;
+  radio_on_stats_.record(radio_us);
+  radio_on_total_us_ += radio_us;
+  if (ok) {
+    bytes_sent_ += length;
+  } else {
+    failure_count_++;
+  }
+  return ok;
+}
+
+uint32_t EspNowUplink::burstCount() const {
+  return burst_count_;
+}
+
+uint32_t EspNowUplink::failureCount() const {
+  return failure_count_;
+}
+
+uint64_t EspNowUplink::radioOnTotalUs() const {
+  return radio_on_total_us_;
+}
+
+uint32_t EspNowUplink::bytesSent() const {
+  return bytes_sent_;
+}
+
+const Histogram &EspNowUplink::radioOnStats() const {
+  return radio_on_stats_;
+}
+
+const Histogram &EspNowUplink::airtimeStats() const {
+  return airtime_stats_;
+}
+
+void EspNowUplink::resetCounters() {
+  burst_count_ = 0;
+  failure_count_ = 0;
+  radio_on_total_us_ = 0;
+  bytes_sent_ = 0;
+  radio_on_stats_.reset();
+  airtime_stats_.reset();
+}
+
+bool EspNowUplink::radioOn() {
+  if (!WiFi.mode(WIFI_STA)) {
+    return false;
+  }
+  esp_wifi_set_channel(channel_, WIFI_SECOND_CHAN_NONE);
+  if (esp_now_init() != ESP_OK) {
+    return false;
+  }
+  esp_now_register_send_cb(onSendDone);
+  esp_now_peer_info_t info;
+  memset(&info, 0, sizeof(info));
+  memcpy(info.peer_addr, peer_, sizeof(peer_));
+  info.channel = channel_;
+  info.encrypt = false;
+  return esp_now_add_peer(&info) == ESP_OK;
+}
+
+void EspNowUplink::radioOff() {
+  esp_now_deinit();
+  WiFi.mode(WIFI_OFF);
+}
@@ -0,0 +1,96 @@
+#ifndef UPLINK_H
+#define UPLINK_H
+
+#include <Arduino.h>
+#include "stats.h"
+
+#define UPLINK_MAGIC 0x54
+#define UPLINK_VERSION 1
+#define UPLINK_MAX_PAYLOAD 250
+#define UPLINK_SEND_TIMEOUT_MS 50
+#define UPLINK_MIN_CPU_MHZ 80
+#define UPLINK_NO_VALUE_S16 INT16_MIN
+#define UPLINK_NO_VALUE_U16 0xFFFF
+
+// One ESP-NOW packet: a header followed by fixed-size entries. Values are
+// scaled to 16 bits: centi-degrees, millivolts, tenths of a milliamp and
+// milliwatts. Missing readings use the NO_VALUE sentinels.
+struct __attribute__((packed)) UplinkHeader {
+  uint8_t magic;
+  uint8_t version;
+  uint8_t count;
+  uint8_t flags;
+  uint32_t node_id;
+  uint32_t first_seq;
+  uint32_t first_ts_ms;
+  uint16_t stride;
+  uint16_t batch_seq;
+};
+
+struct __attribute__((packed)) UplinkEntry {
+  uint16_t dt_100ms;
+  int16_t outdoor_cC;
+  int16_t indoor_cC;
+  uint16_t voltage_mV;
+  int16_t current_100uA;
+  uint16_t power_mW;
+};
+
+#define UPLINK_MAX_ENTRIES ((UPLINK_MAX_PAYLOAD - sizeof(UplinkHeader)) / sizeof(UplinkEntry))
+
+// Packs readings into a single uplink packet.
+class UplinkBatch {
+public:
+  UplinkBatch();
+
+  void begin(uint32_t node_id, uint32_t first_seq, uint16_t stride, uint16_t batch_seq, uint8_t flags);
+  bool add(uint32_t ts_ms, float outdoor_C, float indoor_C, float voltage_V, float current_mA, float power_mW);
+  uint8_t count() const;
+  const uint8_t *data() const;
+  size_t length() const;
+
+private:
+  UplinkHeader header_;
+  UplinkEntry entries_[UPLINK_MAX_ENTRIES];
+  uint32_t last_ts_ms_;
+};
+
+// ESP-NOW sender that keeps the radio off except for one burst per batch:
+// WiFi is started, the packet is sent and acknowledged by the peer's MAC
+// layer, then WiFi is stopped again. Radio-on time and airtime (send to
+// acknowledgement) are recorded per burst.
+class EspNowUplink {
+public:
+  EspNowUplink();
+
+  void setPeer(const uint8_t *mac, uint8_t channel);
+  const uint8_t *peer() const;
+  uint8_t channel() const;
+
+  bool send(const uint8_t *data, size_t length);
+
+  uint32_t burstCount() const;
+  uint32_t failureCount() const;
+  uint64_t radioOnTotalUs() const;
+  uint32_t bytesSent() const;
+  const Histogram &radioOnStats() const;
+  const Histogram &airtimeStats() const;
+  void resetCounters();
+
+private:
+  bool radioOn();
+  void radioOff();
+
+  uint8_t peer_[6];
+  uint8_t channel_;
+  uint32_t burst_count_;
+  uint32_t failure_count_;
+  uint64_t radio_on_total_us_;
+  uint32_t bytes_sent_;
+  Histogram radio_on_stats_;
+  Histogram airtime_stats_;
+};
+
+extern EspNowUplink uplink;
+
+#endif